@@ -0,0 +1,839 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   assembler for .s programs                                 */
+/***************************************************************/
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+A program file ending in .s is assembled as it is loaded, in one pass over
+the source: every instruction of InstructionID (and nop, the all-zero sll)
+is encoded where it stands into the image of its section (.text, or .data
+for the .word, .half, .byte, .ascii, .asciiz, .space and .align directives),
+and an operand naming a label leaves a fixup which is patched once all
+labels are known. The images
+are then copied into guest memory, the labels become symbols, and execution
+starts at main (or at the start of the text).
+
+Operands are registers ($0-$31 or their names), numbers, labels with an
+optional +/- offset, and %hi(...) / %lo(...) of them; a bare label is
+its upper half for lui and its lower half for the other immediates. A branch
+to a number takes it as the offset in instructions, as in mytest.s.
+
+With --asm-cache {dir} the images are also saved under the hash of the
+source and where it is placed, and a later run loads them from there.
+*/
+
+#define ASM_MAX_NAME 64
+#define ASM_MAX_LINE 1024
+#define ASM_IMAGE_MAGIC "MIPSASM"
+
+char *asm_cache_dir = NULL;
+
+// operand formats
+typedef enum
+{
+    F_RD_RS_RT, // add $rd, $rs, $rt
+    F_RD_RT_SA, // sll $rd, $rt, sa
+    F_RD_RT_RS, // sllv $rd, $rt, $rs
+    F_RS,       // jr $rs
+    F_JALR,     // jalr [$rd,] $rs
+    F_RS_RT,    // mult $rs, $rt
+    F_RD,       // mfhi $rd
+    F_NONE,     // syscall
+    F_J,        // j target
+    F_RT_RS_I,  // addi $rt, $rs, imm
+    F_RT_I,     // lui $rt, imm
+    F_MEM,      // lw $rt, offset($rs)
+    F_RS_RT_B,  // beq $rs, $rt, target
+    F_RS_B,     // blez $rs, target
+    F_REGIMM    // bltz $rs, target
+} asm_format_t;
+
+typedef struct
+{
+    const char *name;
+    uint8_t format, op, code; // code: funct, or rt of REGIMM
+} asm_ins_t;
+
+const asm_ins_t ASM_INSTRUCTIONS[] = {
+    {"sll", F_RD_RT_SA, 0, SLL}, {"srl", F_RD_RT_SA, 0, SRL}, {"sra", F_RD_RT_SA, 0, SRA},
+    {"sllv", F_RD_RT_RS, 0, SLLV}, {"srlv", F_RD_RT_RS, 0, SRLV}, {"srav", F_RD_RT_RS, 0, SRAV},
+    {"jr", F_RS, 0, JR}, {"jalr", F_JALR, 0, JALR}, {"syscall", F_NONE, 0, SYSCALL},
+    {"nop", F_NONE, 0, SLL},
+    {"mfhi", F_RD, 0, MFHI}, {"mthi", F_RS, 0, MTHI}, {"mflo", F_RD, 0, MFLO}, {"mtlo", F_RS, 0, MTLO},
+    {"mult", F_RS_RT, 0, MULT}, {"multu", F_RS_RT, 0, MULTU}, {"div", F_RS_RT, 0, DIV}, {"divu", F_RS_RT, 0, DIVU},
+    {"add", F_RD_RS_RT, 0, ADD}, {"addu", F_RD_RS_RT, 0, ADDU}, {"sub", F_RD_RS_RT, 0, SUB},
+    {"subu", F_RD_RS_RT, 0, SUBU}, {"and", F_RD_RS_RT, 0, AND}, {"or", F_RD_RS_RT, 0, OR},
+    {"xor", F_RD_RS_RT, 0, XOR}, {"nor", F_RD_RS_RT, 0, NOR}, {"slt", F_RD_RS_RT, 0, SLT},
+    {"sltu", F_RD_RS_RT, 0, SLTU},
+    {"j", F_J, J, 0}, {"jal", F_J, JAL, 0},
+    {"bltz", F_REGIMM, 001, BLTZ}, {"bgez", F_REGIMM, 001, BGEZ}, {"bltzal", F_REGIMM, 001, BLTZAL},
+    {"bgezal", F_REGIMM, 001, BGEZAL},
+    {"beq", F_RS_RT_B, BEQ, 0}, {"bne", F_RS_RT_B, BNE, 0}, {"blez", F_RS_B, BLEZ, 0}, {"bgtz", F_RS_B, BGTZ, 0},
+    {"addi", F_RT_RS_I, ADDI, 0}, {"addiu", F_RT_RS_I, ADDIU, 0}, {"slti", F_RT_RS_I, SLTI, 0},
+    {"sltiu", F_RT_RS_I, SLTIU, 0}, {"andi", F_RT_RS_I, ANDI, 0}, {"ori", F_RT_RS_I, ORI, 0},
+    {"xori", F_RT_RS_I, XORI, 0}, {"lui", F_RT_I, LUI, 0},
+    {"lb", F_MEM, LB, 0}, {"lh", F_MEM, LH, 0}, {"lw", F_MEM, LW, 0}, {"lbu", F_MEM, LBU, 0},
+    {"lhu", F_MEM, LHU, 0}, {"sb", F_MEM, SB, 0}, {"sh", F_MEM, SH, 0}, {"sw", F_MEM, SW, 0},
+};
+#define ASM_NUM_INSTRUCTIONS (sizeof(ASM_INSTRUCTIONS) / sizeof(ASM_INSTRUCTIONS[0]))
+
+const char *REG_NAMES[MIPS_REGS] = {"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3", "t0", "t1", "t2",
+                                    "t3", "t4", "t5", "t6", "t7", "s0", "s1", "s2", "s3", "s4", "s5",
+                                    "s6", "s7", "t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"};
+
+// how a fixup patches the word (or half, byte) it points at
+typedef enum
+{
+    FIX_BRANCH, // 16-bit offset in instructions from the next one
+    FIX_JUMP,   // 26-bit target
+    FIX_LO,     // lower 16 bits
+    FIX_HI,     // upper 16 bits
+    FIX_WORD,   // .word
+    FIX_HALF,   // .half
+    FIX_BYTE    // .byte
+} fix_kind_t;
+
+typedef struct
+{
+    char name[ASM_MAX_NAME];
+    uint32_t value;
+    int line; // where it is defined
+} asm_label_t;
+
+typedef struct
+{
+    char name[ASM_MAX_NAME];
+    int32_t addend;
+    uint8_t kind, section;
+    uint32_t offset; // in the image of the section
+    int line;
+} asm_fixup_t;
+
+enum
+{
+    SEC_TEXT,
+    SEC_DATA,
+    NUM_SECTIONS
+};
+
+typedef struct
+{
+    const char *filename;
+    int line;
+    int failed;
+    int section;
+    uint32_t origin[NUM_SECTIONS];
+    std::vector<uint8_t> image[NUM_SECTIONS];
+    std::vector<asm_label_t> labels;
+    std::vector<asm_fixup_t> fixups;
+} asm_state_t;
+
+void asm_error(asm_state_t *as, const char *message, const char *detail = "")
+{
+    if (!as->failed)
+        printf("@ Error: %s:%d: %s%s\n", as->filename, as->line, message, detail);
+    as->failed = TRUE;
+}
+
+// the location counter of the current section
+uint32_t asm_here(asm_state_t *as)
+{
+    return as->origin[as->section] + as->image[as->section].size();
+}
+void asm_emit(asm_state_t *as, uint32_t value, int bytes)
+{
+    for (int k = 0; k < bytes; k++)
+        as->image[as->section].push_back(value >> (8 * k));
+}
+// pad to a multiple of alignment, the labels just defined move along
+void asm_align(asm_state_t *as, uint32_t alignment)
+{
+    uint32_t here = asm_here(as);
+    while (asm_here(as) & (alignment - 1))
+        as->image[as->section].push_back(0);
+    for (size_t i = as->labels.size(); i > 0 && as->labels[i - 1].value == here; i--)
+        as->labels[i - 1].value = asm_here(as);
+}
+
+char *skip_blanks(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+int is_name_char(char ch)
+{
+    return isalnum((unsigned char)ch) || ch == '_' || ch == '.' || ch == '$';
+}
+
+// split the operands at p at the commas, trimmed, return how many
+int split_operands(char *p, char *operands[], int max)
+{
+    int num = 0;
+    p = skip_blanks(p);
+    if (*p == 0)
+        return 0;
+    while (num < max)
+    {
+        operands[num++] = p;
+        char *comma = strchr(p, ',');
+        char *end = comma ? comma : p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+            end--;
+        if (comma == NULL)
+        {
+            *end = 0;
+            return num;
+        }
+        *end = 0;
+        p = skip_blanks(comma + 1);
+    }
+    return max + 1; // too many
+}
+
+// the register named by s, -1 if s is not one
+int parse_register(const char *s)
+{
+    if (s[0] != '$')
+        return -1;
+    s++;
+    if (isdigit((unsigned char)s[0]))
+    {
+        char *end;
+        long r = strtol(s, &end, 10);
+        return *end == 0 && r >= 0 && r < MIPS_REGS ? r : -1;
+    }
+    for (int r = 0; r < MIPS_REGS; r++)
+        if (strcmp(s, REG_NAMES[r]) == 0)
+            return r;
+    return strcmp(s, "s8") == 0 ? 30 : -1;
+}
+int get_register(asm_state_t *as, const char *s)
+{
+    int r = parse_register(s);
+    if (r < 0)
+        asm_error(as, "expected a register, not ", s);
+    return r;
+}
+
+// a number: decimal, 0x hex, 0 octal, or a character in quotes
+int parse_number(const char *s, int64_t *value)
+{
+    char *end;
+    if (s[0] == '\'' && s[1] && s[2] == '\'' && s[3] == 0)
+    {
+        *value = (unsigned char)s[1];
+        return TRUE;
+    }
+    if (s[0] == 0)
+        return FALSE;
+    *value = strtoll(s, &end, 0);
+    return *end == 0;
+}
+
+/*
+Procedure : parse_value
+Purpose   : Read the expression s, a number or [%hi(|%lo(]label[+-number][)];
+            a number is returned in *value, a label leaves a fixup of kind
+            (FIX_HI or FIX_LO for %hi and %lo) for the word at offset
+*/
+int parse_value(asm_state_t *as, char *s, int kind, uint32_t offset, int64_t *value)
+{
+    *value = 0;
+    if (parse_number(s, value))
+        return TRUE;
+    if (strncmp(s, "%hi(", 4) == 0 || strncmp(s, "%lo(", 4) == 0)
+    {
+        size_t len = strlen(s);
+        if (s[len - 1] != ')')
+        {
+            asm_error(as, "unbalanced parenthesis in ", s);
+            return FALSE;
+        }
+        kind = s[1] == 'h' ? FIX_HI : FIX_LO;
+        s[len - 1] = 0;
+        s += 4;
+        if (parse_number(s, value))
+        {
+            *value = kind == FIX_HI ? (uint32_t)*value >> 16 : *value & 0xffff;
+            return TRUE;
+        }
+    }
+    asm_fixup_t fix;
+    size_t len = 0;
+    while (is_name_char(s[len]) && s[len] != '$')
+        len++;
+    if (len == 0 || len >= ASM_MAX_NAME || isdigit((unsigned char)s[0]))
+    {
+        asm_error(as, "expected a number or a label, not ", s);
+        return FALSE;
+    }
+    memcpy(fix.name, s, len);
+    fix.name[len] = 0;
+    int64_t addend = 0;
+    s = skip_blanks(s + len);
+    if (*s == '+' || *s == '-')
+    {
+        char sign = *s;
+        if (!parse_number(skip_blanks(s + 1), &addend))
+        {
+            asm_error(as, "bad offset after the label in ", fix.name);
+            return FALSE;
+        }
+        if (sign == '-')
+            addend = -addend;
+    }
+    else if (*s)
+    {
+        asm_error(as, "unexpected text after the label ", fix.name);
+        return FALSE;
+    }
+    fix.addend = addend;
+    fix.kind = kind;
+    fix.section = as->section;
+    fix.offset = offset;
+    fix.line = as->line;
+    as->fixups.push_back(fix);
+    return TRUE;
+}
+
+// a 16-bit immediate, signed or unsigned
+uint32_t get_immediate16(asm_state_t *as, char *s, int kind, uint32_t offset)
+{
+    int64_t value;
+    if (!parse_value(as, s, kind, offset, &value))
+        return 0;
+    if (value < -32768 || value > 65535)
+        asm_error(as, "immediate out of range: ", s);
+    return value & 0xffff;
+}
+
+/*
+Procedure : assemble_instruction
+Purpose   : Encode the instruction mnemonic with the operands at p
+*/
+void assemble_instruction(asm_state_t *as, const char *mnemonic, char *p)
+{
+    const asm_ins_t *ins = NULL;
+    for (size_t i = 0; i < ASM_NUM_INSTRUCTIONS && ins == NULL; i++)
+        if (strcmp(mnemonic, ASM_INSTRUCTIONS[i].name) == 0)
+            ins = &ASM_INSTRUCTIONS[i];
+    if (ins == NULL)
+    {
+        asm_error(as, "unknown instruction ", mnemonic);
+        return;
+    }
+    if (as->section != SEC_TEXT)
+    {
+        asm_error(as, "instruction outside .text: ", mnemonic);
+        return;
+    }
+    static const int NUM_OPERANDS[] = {3, 3, 3, 1, 2, 2, 1, 0, 1, 3, 2, 2, 3, 2, 2};
+    char *op[4];
+    int num = split_operands(p, op, 3);
+    int expected = NUM_OPERANDS[ins->format];
+    if (num != expected && !(ins->format == F_JALR && num == 1))
+    {
+        asm_error(as, "wrong number of operands for ", mnemonic);
+        return;
+    }
+
+    asm_align(as, 4);
+    uint32_t offset = as->image[SEC_TEXT].size();
+    uint32_t rs = 0, rt = 0, rd = 0, sa = 0, imm = 0, word = 0;
+    int64_t value;
+    switch (ins->format)
+    {
+    case F_RD_RS_RT:
+        rd = get_register(as, op[0]), rs = get_register(as, op[1]), rt = get_register(as, op[2]);
+        break;
+    case F_RD_RT_SA:
+        rd = get_register(as, op[0]), rt = get_register(as, op[1]);
+        if (!parse_number(op[2], &value) || value < 0 || value > 31)
+            asm_error(as, "shift amount out of range: ", op[2]);
+        sa = value & 31;
+        break;
+    case F_RD_RT_RS:
+        rd = get_register(as, op[0]), rt = get_register(as, op[1]), rs = get_register(as, op[2]);
+        break;
+    case F_RS:
+        rs = get_register(as, op[0]);
+        break;
+    case F_JALR:
+        rd = num == 1 ? 31 : get_register(as, op[0]);
+        rs = get_register(as, op[num - 1]);
+        break;
+    case F_RS_RT:
+        rs = get_register(as, op[0]), rt = get_register(as, op[1]);
+        break;
+    case F_RD:
+        rd = get_register(as, op[0]);
+        break;
+    case F_NONE:
+        break;
+    case F_J:
+        if (parse_value(as, op[0], FIX_JUMP, offset, &value))
+            imm = ((uint32_t)value >> 2) & 0x3ffffff;
+        break;
+    case F_RT_RS_I:
+        rt = get_register(as, op[0]), rs = get_register(as, op[1]);
+        imm = get_immediate16(as, op[2], FIX_LO, offset);
+        break;
+    case F_RT_I:
+        rt = get_register(as, op[0]);
+        imm = get_immediate16(as, op[1], FIX_HI, offset);
+        break;
+    case F_MEM:
+    {
+        rt = get_register(as, op[0]);
+        char *open = strrchr(op[1], '('), *close = strrchr(op[1], ')');
+        if (open == NULL || close == NULL || close < open || close[1])
+        {
+            asm_error(as, "expected offset($rs), not ", op[1]);
+            break;
+        }
+        *close = 0;
+        rs = get_register(as, skip_blanks(open + 1));
+        while (open > op[1] && (open[-1] == ' ' || open[-1] == '\t'))
+            open--;
+        *open = 0;
+        imm = op[1][0] ? get_immediate16(as, op[1], FIX_LO, offset) : 0;
+        break;
+    }
+    case F_RS_RT_B:
+    case F_RS_B:
+    case F_REGIMM:
+    {
+        rs = get_register(as, op[0]);
+        if (ins->format == F_RS_RT_B)
+            rt = get_register(as, op[1]);
+        char *target = op[num - 1];
+        if (!parse_number(target, &value))
+            value = 0, parse_value(as, target, FIX_BRANCH, offset, &value);
+        else if (value < -32768 || value > 32767)
+            asm_error(as, "branch offset out of range: ", target);
+        imm = value & 0xffff;
+        break;
+    }
+    }
+    if (ins->op == 0)
+        word = (rs << 21) | (rt << 16) | (rd << 11) | (sa << 6) | ins->code;
+    else if (ins->format == F_J)
+        word = (ins->op << 26) | imm;
+    else if (ins->format == F_REGIMM)
+        word = (ins->op << 26) | (rs << 21) | (ins->code << 16) | imm;
+    else
+        word = (ins->op << 26) | (rs << 21) | (rt << 16) | imm;
+    asm_emit(as, word, 4);
+}
+
+// the string in quotes at s, with its escapes
+void assemble_string(asm_state_t *as, char *s, int terminate)
+{
+    s = skip_blanks(s);
+    if (*s++ != '"')
+    {
+        asm_error(as, "expected a string in quotes");
+        return;
+    }
+    for (; *s && *s != '"'; s++)
+    {
+        char ch = *s;
+        if (ch == '\\' && s[1])
+        {
+            ch = *++s;
+            ch = ch == 'n' ? '\n' : ch == 't' ? '\t' : ch == 'r' ? '\r' : ch == '0' ? 0 : ch;
+        }
+        asm_emit(as, (unsigned char)ch, 1);
+    }
+    if (*s != '"')
+        asm_error(as, "unterminated string");
+    if (terminate)
+        asm_emit(as, 0, 1);
+}
+
+/*
+Procedure : assemble_directive
+Purpose   : Carry out the directive name with the arguments at p
+*/
+void assemble_directive(asm_state_t *as, const char *name, char *p)
+{
+    if (strcmp(name, ".text") == 0)
+        as->section = SEC_TEXT;
+    else if (strcmp(name, ".data") == 0)
+        as->section = SEC_DATA;
+    else if (strcmp(name, ".globl") == 0 || strcmp(name, ".global") == 0 || strcmp(name, ".ent") == 0 ||
+             strcmp(name, ".end") == 0)
+        return; // every label is global here
+    else if (strcmp(name, ".ascii") == 0 || strcmp(name, ".asciiz") == 0)
+        assemble_string(as, p, name[6] == 'z');
+    else if (strcmp(name, ".space") == 0)
+    {
+        int64_t size;
+        if (!parse_number(skip_blanks(p), &size) || size < 0)
+            asm_error(as, "bad size: ", p);
+        else
+            as->image[as->section].resize(as->image[as->section].size() + size);
+    }
+    else if (strcmp(name, ".align") == 0)
+    {
+        int64_t power;
+        if (!parse_number(skip_blanks(p), &power) || power < 0 || power > 12)
+            asm_error(as, "bad alignment: ", p);
+        else
+            asm_align(as, 1 << power);
+    }
+    else if (strcmp(name, ".word") == 0 || strcmp(name, ".half") == 0 || strcmp(name, ".byte") == 0)
+    {
+        int bytes = name[1] == 'w' ? 4 : name[1] == 'h' ? 2 : 1;
+        int kind = bytes == 4 ? FIX_WORD : bytes == 2 ? FIX_HALF : FIX_BYTE;
+        asm_align(as, bytes);
+        char *op[256];
+        int num = split_operands(p, op, 256);
+        if (num == 0 || num > 256)
+            asm_error(as, "expected 1 to 256 values after ", name);
+        for (int i = 0; i < num && i < 256; i++)
+        {
+            int64_t value;
+            parse_value(as, op[i], kind, as->image[as->section].size(), &value);
+            asm_emit(as, value, bytes);
+        }
+    }
+    else
+        asm_error(as, "unknown directive ", name);
+}
+
+// remove the comment, outside of quotes
+void strip_comment(char *line)
+{
+    int quoted = FALSE;
+    for (char *p = line; *p; p++)
+    {
+        if (*p == '"' && (p == line || p[-1] != '\\'))
+            quoted = !quoted;
+        else if (*p == '#' && !quoted)
+        {
+            *p = 0;
+            return;
+        }
+    }
+}
+
+/*
+Procedure : assemble_line
+Purpose   : Assemble a line of the source: labels, then a directive or an
+            instruction
+*/
+void assemble_line(asm_state_t *as, char *line)
+{
+    strip_comment(line);
+    char *p = skip_blanks(line);
+    while (*p)
+    {
+        char *end = p;
+        while (is_name_char(*end))
+            end++;
+        if (end == p)
+        {
+            asm_error(as, "unexpected ", p);
+            return;
+        }
+        char *after = skip_blanks(end);
+        if (*after == ':')
+        {
+            // a label
+            if (end - p >= ASM_MAX_NAME || isdigit((unsigned char)*p) || *p == '$')
+            {
+                asm_error(as, "bad label");
+                return;
+            }
+            asm_label_t label;
+            memcpy(label.name, p, end - p);
+            label.name[end - p] = 0;
+            label.value = asm_here(as);
+            label.line = as->line;
+            as->labels.push_back(label);
+            p = skip_blanks(after + 1);
+            continue;
+        }
+        char name[ASM_MAX_NAME];
+        size_t len = std::min<size_t>(end - p, ASM_MAX_NAME - 1);
+        memcpy(name, p, len);
+        name[len] = 0;
+        if (name[0] == '.')
+            assemble_directive(as, name, end);
+        else
+            assemble_instruction(as, name, end);
+        return;
+    }
+}
+
+// the value of the label name, FALSE if it is not defined
+int find_label(const asm_state_t *as, const char *name, uint32_t *value)
+{
+    const asm_label_t *first = as->labels.data(), *last = first + as->labels.size();
+    const asm_label_t *l = std::lower_bound(first, last, name, [](const asm_label_t &a, const char *b)
+                                            { return strcmp(a.name, b) < 0; });
+    if (l == last || strcmp(l->name, name) != 0)
+        return FALSE;
+    *value = l->value;
+    return TRUE;
+}
+
+/*
+Procedure : resolve_fixups
+Purpose   : Patch the label operands, once all labels are known
+*/
+void resolve_fixups(asm_state_t *as)
+{
+    std::stable_sort(as->labels.begin(), as->labels.end(), [](const asm_label_t &a, const asm_label_t &b)
+                     { return strcmp(a.name, b.name) < 0; });
+    for (size_t i = 1; i < as->labels.size(); i++)
+        if (strcmp(as->labels[i - 1].name, as->labels[i].name) == 0)
+        {
+            as->line = as->labels[i].line;
+            asm_error(as, "label defined again: ", as->labels[i].name);
+            return;
+        }
+    for (const asm_fixup_t &fix : as->fixups)
+    {
+        as->line = fix.line;
+        uint32_t value;
+        if (!find_label(as, fix.name, &value))
+        {
+            asm_error(as, "undefined label ", fix.name);
+            return;
+        }
+        value += fix.addend;
+        uint8_t *at = &as->image[fix.section][fix.offset];
+        if (fix.kind == FIX_HALF || fix.kind == FIX_BYTE)
+        {
+            at[0] = value;
+            if (fix.kind == FIX_HALF)
+                at[1] = value >> 8;
+            continue;
+        }
+        uint32_t word = at[0] | (at[1] << 8) | (at[2] << 16) | (at[3] << 24);
+        uint32_t pc = as->origin[fix.section] + fix.offset;
+        switch (fix.kind)
+        {
+        case FIX_BRANCH:
+        {
+            int64_t distance = ((int64_t)value - (pc + 4)) / 4;
+            if ((value & 3) || distance < -32768 || distance > 32767)
+                asm_error(as, "branch target out of reach: ", fix.name);
+            word = (word & 0xffff0000) | (distance & 0xffff);
+            break;
+        }
+        case FIX_JUMP:
+            if ((value & 3) || ((value ^ (pc + 4)) & 0xf0000000))
+                asm_error(as, "jump target out of reach: ", fix.name);
+            word = (word & 0xfc000000) | ((value >> 2) & 0x3ffffff);
+            break;
+        case FIX_LO:
+            word = (word & 0xffff0000) | (value & 0xffff);
+            break;
+        case FIX_HI:
+            word = (word & 0xffff0000) | (value >> 16);
+            break;
+        case FIX_WORD:
+            word = value;
+            break;
+        }
+        for (int k = 0; k < 4; k++)
+            at[k] = word >> (8 * k);
+    }
+}
+
+/* the image of an assembled program, as --asm-cache saves it */
+typedef struct
+{
+    char magic[8];
+    uint64_t hash;
+    uint32_t origin[NUM_SECTIONS], size[NUM_SECTIONS];
+    uint32_t entry, num_labels;
+} asm_image_t;
+
+// FNV-1a of the source, and of where it is placed
+uint64_t source_hash(const uint8_t *source, size_t size, const uint32_t *origin)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ source[i]) * 0x100000001b3ull;
+    for (int s = 0; s < NUM_SECTIONS; s++)
+        hash = (hash ^ origin[s]) * 0x100000001b3ull;
+    return hash;
+}
+
+// copy the sections into memory, and the labels into the symbols
+int place_image(const char *filename, asm_image_t *header, const uint8_t *const *image, const asm_label_t *labels)
+{
+    for (int s = 0; s < NUM_SECTIONS; s++)
+        if (header->size[s] && !mem_load(header->origin[s], image[s], header->size[s]))
+        {
+            printf("@ Error: The %s of %s does not fit in memory (see --mem)\n", s == SEC_TEXT ? "text" : "data",
+                   filename);
+            return FALSE;
+        }
+    std::vector<const char *> names(header->num_labels);
+    std::vector<uint32_t> values(header->num_labels);
+    for (uint32_t i = 0; i < header->num_labels; i++)
+        names[i] = labels[i].name, values[i] = labels[i].value;
+    add_symbols(names.data(), values.data(), header->num_labels);
+    return TRUE;
+}
+
+// the cached image of the source with this hash, if any, placed into memory
+int load_cached(const char *filename, uint64_t hash, asm_image_t *header)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%016llx.img", asm_cache_dir, (unsigned long long)hash);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return FALSE;
+    int loaded = FALSE;
+    if (fread(header, sizeof(*header), 1, file) == 1 && memcmp(header->magic, ASM_IMAGE_MAGIC, 8) == 0 &&
+        header->hash == hash)
+    {
+        std::vector<uint8_t> text(header->size[SEC_TEXT]), data(header->size[SEC_DATA]);
+        std::vector<asm_label_t> labels(header->num_labels);
+        if (fread(text.data(), 1, text.size(), file) == text.size() &&
+            fread(data.data(), 1, data.size(), file) == data.size() &&
+            fread(labels.data(), sizeof(asm_label_t), labels.size(), file) == labels.size())
+        {
+            const uint8_t *image[NUM_SECTIONS] = {text.data(), data.data()};
+            loaded = place_image(filename, header, image, labels.data()) ? TRUE : -1;
+        }
+    }
+    fclose(file);
+    return loaded;
+}
+
+// save the image under the hash, renamed into place whole
+void save_cached(const asm_state_t *as, const asm_image_t *header)
+{
+    char path[4096], temp[4096];
+    snprintf(path, sizeof(path), "%s/%016llx.img", asm_cache_dir, (unsigned long long)header->hash);
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    int fd = mkstemp(temp);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (file == NULL)
+    {
+        printf("@ Warning: Can't write to the assembly cache %s\n", asm_cache_dir);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    int written = fwrite(header, sizeof(*header), 1, file) == 1 &&
+                  fwrite(as->image[SEC_TEXT].data(), 1, header->size[SEC_TEXT], file) == header->size[SEC_TEXT] &&
+                  fwrite(as->image[SEC_DATA].data(), 1, header->size[SEC_DATA], file) == header->size[SEC_DATA] &&
+                  fwrite(as->labels.data(), sizeof(asm_label_t), header->num_labels, file) == header->num_labels;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temp, path) != 0)
+    {
+        printf("@ Warning: Can't write to the assembly cache %s\n", asm_cache_dir);
+        unlink(temp);
+    }
+}
+
+/*
+Procedure : assemble_program
+Purpose   : Assemble the source filename into memory, its text at
+            text_origin and its data at data_origin; return FALSE on an
+            error, else its entry and the ends of its text and data
+*/
+int assemble_program(const char *filename, uint32_t text_origin, uint32_t data_origin, uint32_t *entry,
+                     uint32_t *text_end, uint32_t *data_end)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("@ Error: Can't open program file %s\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    size_t size = st.st_size;
+    char *source = (char *)malloc(size + 1);
+    int read_all = read(fd, source, size) == (ssize_t)size;
+    close(fd);
+    if (!read_all)
+    {
+        printf("@ Error: Can't read program file %s\n", filename);
+        free(source);
+        return FALSE;
+    }
+    source[size] = 0;
+
+    asm_state_t as;
+    as.filename = filename;
+    as.line = 0;
+    as.failed = FALSE;
+    as.section = SEC_TEXT;
+    as.origin[SEC_TEXT] = text_origin;
+    as.origin[SEC_DATA] = data_origin;
+    asm_image_t header;
+    uint64_t hash = source_hash((uint8_t *)source, size, as.origin);
+    int cached = asm_cache_dir ? load_cached(filename, hash, &header) : FALSE;
+    if (cached)
+    {
+        free(source);
+        if (cached < 0)
+            return FALSE;
+    }
+    else
+    {
+        char line[ASM_MAX_LINE];
+        for (char *p = source; *p && !as.failed;)
+        {
+            char *newline = strchr(p, '\n');
+            size_t len = newline ? newline - p : strlen(p);
+            as.line++;
+            if (len >= ASM_MAX_LINE)
+            {
+                asm_error(&as, "line too long");
+                break;
+            }
+            memcpy(line, p, len);
+            line[len] = 0;
+            assemble_line(&as, line);
+            p += newline ? len + 1 : len;
+        }
+        free(source);
+        if (!as.failed)
+            resolve_fixups(&as);
+        if (as.failed)
+            return FALSE;
+
+        memcpy(header.magic, ASM_IMAGE_MAGIC, 8);
+        header.hash = hash;
+        for (int s = 0; s < NUM_SECTIONS; s++)
+            header.origin[s] = as.origin[s], header.size[s] = as.image[s].size();
+        if (!find_label(&as, "main", &header.entry))
+            header.entry = text_origin;
+        header.num_labels = as.labels.size();
+        const uint8_t *image[NUM_SECTIONS] = {as.image[SEC_TEXT].data(), as.image[SEC_DATA].data()};
+        if (!place_image(filename, &header, image, as.labels.data()))
+            return FALSE;
+        if (asm_cache_dir)
+            save_cached(&as, &header);
+    }
+    *entry = header.entry;
+    *text_end = header.origin[SEC_TEXT] + header.size[SEC_TEXT];
+    *data_end = header.origin[SEC_DATA] + header.size[SEC_DATA];
+    return TRUE;
+}
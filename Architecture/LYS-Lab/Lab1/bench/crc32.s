@@ -0,0 +1,67 @@
+# crc32: build the table of the reflected CRC-32 (polynomial 0xedb88320) bit
+# by bit, then run the table-driven CRC over a 16 KiB buffer of random bytes
+# 300 times in a row
+# result: $s7 = CRC-32 of the buffer repeated 300 times
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 the table, 256 words
+	ori		$s1, $s0, 0x1000	# $s1 = 0x10001000 the buffer
+	ori		$s2, $s0, 0x5000	# $s2 = end of the buffer
+	lui		$s6, 0xbb67			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0xae85
+	lui		$s5, 0xedb8			# $s5 = polynomial
+	ori		$s5, $s5, 0x8320
+
+	# table[n] = n shifted right 8 times, xoring the polynomial when a 1 drops out
+	addu	$t0, $0, $0			# $t0 = n
+	addu	$t9, $s0, $0
+table:
+	addu	$t1, $t0, $0
+	addiu	$t2, $0, 8
+bit:
+	andi	$t3, $t1, 1
+	srl		$t1, $t1, 1
+	beq		$t3, $0, zero
+	xor		$t1, $t1, $s5
+zero:
+	addiu	$t2, $t2, -1
+	bne		$t2, $0, bit
+	sw		$t1, 0($t9)
+	addiu	$t9, $t9, 4
+	addiu	$t0, $t0, 1
+	bne		$t9, $s1, table
+
+	# fill the buffer with random words
+	addu	$t0, $s1, $0
+fill:
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	sw		$s6, 0($t0)
+	addiu	$t0, $t0, 4
+	bne		$t0, $s2, fill
+
+	addiu	$s7, $0, -1			# $s7 = CRC register
+	addiu	$s3, $0, 300		# $s3 = passes left
+pass:
+	addu	$t0, $s1, $0
+byte:
+	lbu		$t1, 0($t0)			# crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8)
+	xor		$t2, $s7, $t1
+	andi	$t2, $t2, 0xff
+	sll		$t2, $t2, 2
+	addu	$t2, $t2, $s0
+	lw		$t2, 0($t2)
+	srl		$t3, $s7, 8
+	xor		$s7, $t3, $t2
+	addiu	$t0, $t0, 1
+	bne		$t0, $s2, byte
+	addiu	$s3, $s3, -1
+	bne		$s3, $0, pass
+	nor		$s7, $s7, $0		# final xor
+
+	addiu	$v0, $0, 10			# exit
+	syscall
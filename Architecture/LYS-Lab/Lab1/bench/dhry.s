@@ -0,0 +1,329 @@
+# dhry: the integer mix of Dhrystone 2.1 (procedure calls, record copies,
+# string copy and compare, array updates, branches on enumerations, multiply
+# and divide) with the globals, records and arrays in the data segment,
+# 88000 runs
+# result: $s7 = checksum of Int_1_Loc, Int_2_Loc and Int_3_Loc after every run,
+#         plus Arr_2_Glob[8][7]
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 the globals:
+								#   0x0000 Rec_1 (Ptr_Glob), 0x0040 Rec_2 (Next_Ptr_Glob),
+								#   records of 12 words: Ptr_Comp, Discr, Enum_Comp,
+								#   Int_Comp, Str_Comp
+								#   0x0080 Int_Glob, 0x0084 Bool_Glob,
+								#   0x0088 Ch_1_Glob, 0x0089 Ch_2_Glob (bytes)
+								#   0x0100 Str_1_Loc, 0x0140 Str_2_Loc, 0x0180 its text
+								#   0x1000 Arr_1_Glob[50], 0x2000 Arr_2_Glob[50][50]
+	lui		$sp, 0x8000			# $sp = top of the stack
+	addiu	$sp, $sp, -16
+
+	# Rec_1: Ptr_Comp = Rec_2, Discr = Ident_1 (0), Enum_Comp = Ident_3 (2), Int_Comp = 40
+	addiu	$t0, $s0, 0x40
+	sw		$t0, 0($s0)
+	sw		$0, 4($s0)
+	addiu	$t0, $0, 2
+	sw		$t0, 8($s0)
+	addiu	$t0, $0, 40
+	sw		$t0, 12($s0)
+	# the strings: 30 characters, the second differs from the 21st on
+	addu	$t0, $0, $0			# $t0 = index
+	addiu	$t9, $0, 30
+string:
+	addiu	$t1, $t0, 0x41		# 'A' + index
+	addu	$t2, $s0, $t0
+	sb		$t1, 0x100($t2)
+	slti	$t3, $t0, 20
+	bne		$t3, $0, same_char
+	addiu	$t1, $t1, 0x20		# lower case
+same_char:
+	sb		$t1, 0x180($t2)
+	addiu	$t0, $t0, 1
+	bne		$t0, $t9, string
+	sb		$0, 0x11e($s0)
+	sb		$0, 0x19e($s0)
+
+	addu	$s7, $0, $0
+	lui		$s3, 0x0001			# $s3 = runs left: 88000
+	ori		$s3, $s3, 0x57c0
+run:
+	jal		proc_5
+	jal		proc_4
+	addiu	$s4, $0, 2			# $s4 = Int_1_Loc
+	addiu	$s5, $0, 3			# $s5 = Int_2_Loc
+	addiu	$a0, $s0, 0x140		# strcpy (Str_2_Loc, "DHRYSTONE PROGRAM, 2'ND STRING")
+	addiu	$a1, $s0, 0x180
+	jal		strcpy
+	addiu	$s1, $0, 1			# $s1 = Enum_Loc = Ident_2
+	addiu	$a0, $s0, 0x100		# Bool_Glob = ! Func_2 (Str_1_Loc, Str_2_Loc)
+	addiu	$a1, $s0, 0x140
+	jal		func_2
+	sltiu	$v0, $v0, 1
+	sw		$v0, 0x84($s0)
+while:
+	slt		$t0, $s4, $s5		# while (Int_1_Loc < Int_2_Loc)
+	beq		$t0, $0, end_while
+	addiu	$t1, $0, 5			# Int_3_Loc = 5 * Int_1_Loc - Int_2_Loc
+	mult	$t1, $s4
+	mflo	$t1
+	subu	$s6, $t1, $s5
+	addu	$a0, $s4, $0		# Proc_7 (Int_1_Loc, Int_2_Loc, &Int_3_Loc)
+	addu	$a1, $s5, $0
+	jal		proc_7
+	addu	$s6, $v0, $0
+	addiu	$s4, $s4, 1
+	j		while
+end_while:
+	addu	$a0, $s4, $0		# Proc_8 (Arr_1_Glob, Arr_2_Glob, Int_1_Loc, Int_3_Loc)
+	addu	$a1, $s6, $0
+	jal		proc_8
+	addu	$a0, $s0, $0		# Proc_1 (Ptr_Glob)
+	jal		proc_1
+	addiu	$s2, $0, 0x41		# for (Ch_Index = 'A'; Ch_Index <= Ch_2_Glob; ++Ch_Index)
+for:
+	lbu		$t0, 0x89($s0)
+	slt		$t1, $t0, $s2
+	bne		$t1, $0, end_for
+	addu	$a0, $s2, $0		# if (Enum_Loc == Func_1 (Ch_Index, 'C'))
+	addiu	$a1, $0, 0x43
+	jal		func_1
+	bne		$v0, $s1, next_char
+	addu	$a0, $0, $0			# Proc_6 (Ident_1, &Enum_Loc)
+	jal		proc_6
+	addu	$s1, $v0, $0
+	addu	$s5, $s3, $0		# Int_2_Loc = Run_Index
+next_char:
+	addiu	$s2, $s2, 1
+	j		for
+end_for:
+	mult	$s5, $s4			# Int_2_Loc = Int_2_Loc * Int_1_Loc
+	mflo	$s5
+	div		$s5, $s6			# Int_1_Loc = Int_2_Loc / Int_3_Loc
+	mflo	$s4
+	subu	$t0, $s5, $s6		# Int_2_Loc = 7 * (Int_2_Loc - Int_3_Loc) - Int_1_Loc
+	addiu	$t1, $0, 7
+	mult	$t0, $t1
+	mflo	$t0
+	subu	$s5, $t0, $s4
+	addu	$a0, $s4, $0		# Proc_2 (&Int_1_Loc)
+	jal		proc_2
+	addu	$s4, $v0, $0
+	sll		$t0, $s7, 1			# checksum: rotate left by 1, mix the locals in
+	srl		$t1, $s7, 31
+	or		$s7, $t0, $t1
+	xor		$s7, $s7, $s4
+	addu	$s7, $s7, $s5
+	xor		$s7, $s7, $s6
+	addiu	$s3, $s3, -1
+	bne		$s3, $0, run
+
+	lw		$t0, 0x265c($s0)	# and Arr_2_Glob[8][7]
+	addu	$s7, $s7, $t0
+	addiu	$v0, $0, 10			# exit
+	syscall
+
+# Ch_1_Glob = 'A', Bool_Glob = false
+proc_5:
+	addiu	$t0, $0, 0x41
+	sb		$t0, 0x88($s0)
+	sw		$0, 0x84($s0)
+	jr		$ra
+
+# Bool_Glob |= Ch_1_Glob == 'A', Ch_2_Glob = 'B'
+proc_4:
+	lbu		$t0, 0x88($s0)
+	xori	$t0, $t0, 0x41
+	sltiu	$t0, $t0, 1
+	lw		$t1, 0x84($s0)
+	or		$t1, $t1, $t0
+	sw		$t1, 0x84($s0)
+	addiu	$t0, $0, 0x42
+	sb		$t0, 0x89($s0)
+	jr		$ra
+
+# copy the string at $a1 to $a0
+strcpy:
+	lbu		$t0, 0($a1)
+	sb		$t0, 0($a0)
+	addiu	$a0, $a0, 1
+	addiu	$a1, $a1, 1
+	bne		$t0, $0, strcpy
+	jr		$ra
+
+# $v0 = <0, 0 or >0 as the string at $a0 is below, equal to or above the one at $a1
+strcmp:
+	lbu		$t0, 0($a0)
+	lbu		$t1, 0($a1)
+	bne		$t0, $t1, differ
+	beq		$t0, $0, equal
+	addiu	$a0, $a0, 1
+	addiu	$a1, $a1, 1
+	j		strcmp
+differ:
+	subu	$v0, $t0, $t1
+	jr		$ra
+equal:
+	addu	$v0, $0, $0
+	jr		$ra
+
+# $v0 = Func_2 (Str_1_Par_Ref $a0, Str_2_Par_Ref $a1): the first string is above the second
+func_2:
+	addiu	$sp, $sp, -4
+	sw		$ra, 0($sp)
+	jal		strcmp
+	slt		$v0, $0, $v0
+	beq		$v0, $0, func_2_end
+	addiu	$t0, $0, 10			# Int_Glob = Int_Loc + 7
+	sw		$t0, 0x80($s0)
+func_2_end:
+	lw		$ra, 0($sp)
+	addiu	$sp, $sp, 4
+	jr		$ra
+
+# $v0 = Proc_7 ($a0, $a1) = $a0 + $a1 + 2
+proc_7:
+	addu	$v0, $a0, $a1
+	addiu	$v0, $v0, 2
+	jr		$ra
+
+# Proc_8 (Arr_1_Glob, Arr_2_Glob, Int_1_Par_Val $a0, Int_2_Par_Val $a1)
+proc_8:
+	addiu	$t0, $a0, 5			# $t0 = Int_Loc
+	sll		$t1, $t0, 2
+	addu	$t1, $t1, $s0		# $t1 = &Arr_1_Glob[Int_Loc] - 0x1000
+	sw		$a1, 0x1000($t1)	# Arr_1_Glob[Int_Loc] = Int_2_Par_Val
+	sw		$a1, 0x1004($t1)	# Arr_1_Glob[Int_Loc + 1] = Arr_1_Glob[Int_Loc]
+	sw		$t0, 0x1078($t1)	# Arr_1_Glob[Int_Loc + 30] = Int_Loc
+	addiu	$t2, $0, 200		# $t2 = &Arr_2_Glob[Int_Loc][Int_Loc] - 0x2000
+	mult	$t0, $t2
+	mflo	$t2
+	addu	$t2, $t2, $t1
+	sw		$t0, 0x2000($t2)	# Arr_2_Glob[Int_Loc][Int_Loc .. Int_Loc + 1] = Int_Loc
+	sw		$t0, 0x2004($t2)
+	lw		$t3, 0x1ffc($t2)	# Arr_2_Glob[Int_Loc][Int_Loc - 1] += 1
+	addiu	$t3, $t3, 1
+	sw		$t3, 0x1ffc($t2)
+	lw		$t3, 0x1000($t1)	# Arr_2_Glob[Int_Loc + 20][Int_Loc] = Arr_1_Glob[Int_Loc]
+	sw		$t3, 0x2fa0($t2)
+	addiu	$t3, $0, 5			# Int_Glob = 5
+	sw		$t3, 0x80($s0)
+	jr		$ra
+
+# Proc_1 (Ptr_Val_Par $a0)
+proc_1:
+	addiu	$sp, $sp, -8
+	sw		$ra, 0($sp)
+	sw		$a0, 4($sp)
+	lw		$t9, 0($a0)			# $t9 = Next_Record = Ptr_Val_Par->Ptr_Comp
+	addu	$t0, $a0, $0		# *Ptr_Val_Par->Ptr_Comp = *Ptr_Glob
+	addiu	$t1, $a0, 48
+copy_1:
+	lw		$t2, 0($t0)
+	sw		$t2, 0x40($t0)
+	addiu	$t0, $t0, 4
+	bne		$t0, $t1, copy_1
+	addiu	$t2, $0, 5			# Ptr_Val_Par->Int_Comp = 5
+	sw		$t2, 12($a0)
+	sw		$t2, 12($t9)		# Next_Record->Int_Comp = Ptr_Val_Par->Int_Comp
+	lw		$t2, 0($a0)			# Next_Record->Ptr_Comp = Ptr_Val_Par->Ptr_Comp
+	sw		$t2, 0($t9)
+	addu	$a0, $t9, $0		# Proc_3 (&Next_Record->Ptr_Comp)
+	jal		proc_3
+	lw		$a0, 4($sp)
+	lw		$t9, 0($a0)
+	lw		$t2, 4($t9)			# if (Next_Record->Discr == Ident_1)
+	bne		$t2, $0, copy_back
+	addiu	$t2, $0, 6			# Next_Record->Int_Comp = 6
+	sw		$t2, 12($t9)
+	lw		$a0, 8($a0)			# Proc_6 (Ptr_Val_Par->Enum_Comp, &Next_Record->Enum_Comp)
+	jal		proc_6
+	lw		$a0, 4($sp)
+	lw		$t9, 0($a0)
+	sw		$v0, 8($t9)
+	lw		$t2, 0($s0)			# Next_Record->Ptr_Comp = Ptr_Glob->Ptr_Comp
+	sw		$t2, 0($t9)
+	lw		$a0, 12($t9)		# Proc_7 (Next_Record->Int_Comp, 10, &Next_Record->Int_Comp)
+	addiu	$a1, $0, 10
+	jal		proc_7
+	lw		$a0, 4($sp)
+	lw		$t9, 0($a0)
+	sw		$v0, 12($t9)
+	j		proc_1_end
+copy_back:
+	addu	$t0, $a0, $0		# *Ptr_Val_Par = *Ptr_Val_Par->Ptr_Comp
+	addiu	$t1, $a0, 48
+copy_2:
+	lw		$t2, 0x40($t0)
+	sw		$t2, 0($t0)
+	addiu	$t0, $t0, 4
+	bne		$t0, $t1, copy_2
+proc_1_end:
+	lw		$ra, 0($sp)
+	addiu	$sp, $sp, 8
+	jr		$ra
+
+# Proc_3 (Ptr_Ref_Par $a0)
+proc_3:
+	lw		$t0, 0($s0)			# if (Ptr_Glob != Null)
+	beq		$t0, $0, proc_3_null
+	sw		$t0, 0($a0)			# *Ptr_Ref_Par = Ptr_Glob->Ptr_Comp
+proc_3_null:
+	lw		$t1, 0x80($s0)		# Proc_7 (10, Int_Glob, &Ptr_Glob->Int_Comp)
+	addiu	$v0, $t1, 12
+	sw		$v0, 12($s0)
+	jr		$ra
+
+# $v0 = Proc_6 (Enum_Val_Par $a0)
+proc_6:
+	addu	$v0, $a0, $0		# Enum_Ref_Par = Enum_Val_Par
+	addiu	$t0, $0, 2			# if (! Func_3 (Enum_Val_Par)): not Ident_3
+	beq		$a0, $t0, switch
+	addiu	$v0, $0, 3			# Enum_Ref_Par = Ident_4
+switch:
+	beq		$a0, $0, case_1
+	addiu	$t0, $0, 1
+	beq		$a0, $t0, case_2
+	addiu	$t0, $0, 2
+	beq		$a0, $t0, case_3
+	addiu	$t0, $0, 4
+	beq		$a0, $t0, case_5
+	jr		$ra
+case_1:
+	addu	$v0, $0, $0			# Ident_1
+	jr		$ra
+case_2:
+	lw		$t1, 0x80($s0)		# Int_Glob > 100 ? Ident_1 : Ident_4
+	slti	$t1, $t1, 101
+	addiu	$v0, $0, 3
+	bne		$t1, $0, case_2_end
+	addu	$v0, $0, $0
+case_2_end:
+	jr		$ra
+case_3:
+	addiu	$v0, $0, 1			# Ident_2
+	jr		$ra
+case_5:
+	addiu	$v0, $0, 2			# Ident_3
+	jr		$ra
+
+# $v0 = Func_1 (Ch_1_Par_Val $a0, Ch_2_Par_Val $a1): Ident_2 if they are equal
+func_1:
+	bne		$a0, $a1, func_1_differ
+	sb		$a0, 0x88($s0)		# Ch_1_Glob = Ch_1_Loc
+	addiu	$v0, $0, 1
+	jr		$ra
+func_1_differ:
+	addu	$v0, $0, $0
+	jr		$ra
+
+# $v0 = Proc_2 (Int_Par_Ref $a0)
+proc_2:
+	lbu		$t1, 0x88($s0)		# if (Ch_1_Glob == 'A')
+	xori	$t1, $t1, 0x41
+	bne		$t1, $0, proc_2_keep
+	addiu	$t0, $a0, 9			# *Int_Par_Ref = Int_Par_Ref + 10 - 1 - Int_Glob
+	lw		$t2, 0x80($s0)
+	subu	$v0, $t0, $t2
+	jr		$ra
+proc_2_keep:
+	addu	$v0, $a0, $0
+	jr		$ra
@@ -0,0 +1,51 @@
+# list: a linked list of 32768 nodes {next, value} scattered over 256 KiB in
+# a fixed pseudo-random order (node j of the list is slot j * 9973 mod 32768),
+# walked 250 times, adding up and incrementing the values on the way
+# result: $s7 = sum of the values read
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 the slots, 8 bytes each
+	lui		$s6, 0x3c6e			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0xf372
+	addiu	$s1, $0, 9973		# $s1 = stride between the slots of neighbours
+	lui		$s2, 0x0003			# $s2 = 256 KiB - 8, to wrap a slot offset
+	ori		$s2, $s2, 0xfff8
+
+	# link the slots: $t0 = offset of node j, $t1 = offset of node j + 1
+	addu	$t0, $0, $0
+	ori		$t9, $0, 0x8000		# $t9 = nodes left
+link:
+	sll		$t2, $s1, 3
+	addu	$t1, $t0, $t2
+	and		$t1, $t1, $s2
+	addu	$t3, $s0, $t0		# $t3 = node j
+	addu	$t4, $s0, $t1		# $t4 = node j + 1
+	sw		$t4, 0($t3)
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	sw		$s6, 4($t3)
+	addu	$t0, $t1, $0
+	addiu	$t9, $t9, -1
+	bne		$t9, $0, link
+	sw		$0, 0($t3)			# the last node ends the list
+
+	addu	$s7, $0, $0
+	addiu	$s3, $0, 250		# $s3 = walks left
+walk:
+	addu	$t0, $s0, $0		# the list starts at slot 0
+node:
+	lw		$t1, 4($t0)
+	addu	$s7, $s7, $t1
+	addiu	$t1, $t1, 1
+	sw		$t1, 4($t0)
+	lw		$t0, 0($t0)
+	bne		$t0, $0, node
+	addiu	$s3, $s3, -1
+	bne		$s3, $0, walk
+
+	addiu	$v0, $0, 10			# exit
+	syscall
@@ -0,0 +1,90 @@
+# matmul: multiply two 48x48 matrices of random bytes (C = A * B, row-major
+# words) with the naive triple loop, 55 times, each time replacing A by C mod 256
+# result: $s7 = checksum of the last product
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 matrix A
+	lui		$s1, 0x1001			# $s1 = 0x10010000 matrix B
+	lui		$s2, 0x1002			# $s2 = 0x10020000 matrix C
+	lui		$s6, 0x6a09			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0xe667
+	addiu	$s5, $0, 192		# $s5 = bytes per row (48 words)
+
+	# fill A and B with random numbers 0-255
+	addu	$t0, $s0, $0
+	ori		$t1, $s0, 0x2400	# 48 * 48 words
+	addu	$t8, $s1, $0
+fill:
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	andi	$t3, $s6, 0xff
+	sw		$t3, 0($t0)
+	srl		$t3, $s6, 24
+	sw		$t3, 0($t8)
+	addiu	$t0, $t0, 4
+	addiu	$t8, $t8, 4
+	bne		$t0, $t1, fill
+
+	addiu	$s3, $0, 55			# $s3 = products left
+product:
+	addu	$t0, $s0, $0		# $t0 = row i of A
+	addu	$t9, $s2, $0		# $t9 = C[i][j]
+row:
+	addu	$t1, $s1, $0		# $t1 = column j of B
+	addu	$t7, $t0, $s5		# $t7 = end of row i of A
+column:
+	addu	$t2, $t0, $0		# $t2 = A[i][k]
+	addu	$t3, $t1, $0		# $t3 = B[k][j]
+	addu	$t4, $0, $0			# $t4 = sum
+dot:
+	lw		$t5, 0($t2)
+	lw		$t6, 0($t3)
+	mult	$t5, $t6
+	mflo	$t5
+	addu	$t4, $t4, $t5
+	addiu	$t2, $t2, 4
+	addu	$t3, $t3, $s5
+	bne		$t2, $t7, dot
+	sw		$t4, 0($t9)
+	addiu	$t9, $t9, 4
+	addiu	$t1, $t1, 4
+	subu	$t5, $t1, $s1
+	bne		$t5, $s5, column
+	addu	$t0, $t0, $s5
+	ori		$t5, $s0, 0x2400
+	bne		$t0, $t5, row
+
+	# A = C mod 256, so that every product differs
+	addu	$t0, $s0, $0
+	addu	$t9, $s2, $0
+	ori		$t1, $s0, 0x2400
+copy:
+	lw		$t5, 0($t9)
+	andi	$t5, $t5, 0xff
+	sw		$t5, 0($t0)
+	addiu	$t0, $t0, 4
+	addiu	$t9, $t9, 4
+	bne		$t0, $t1, copy
+
+	addiu	$s3, $s3, -1
+	bne		$s3, $0, product
+
+	# checksum: rotate left by 1 and add every element of C
+	addu	$s7, $0, $0
+	addu	$t9, $s2, $0
+	ori		$t1, $s2, 0x2400
+sum:
+	lw		$t5, 0($t9)
+	sll		$t2, $s7, 1
+	srl		$t3, $s7, 31
+	or		$s7, $t2, $t3
+	addu	$s7, $s7, $t5
+	addiu	$t9, $t9, 4
+	bne		$t9, $t1, sum
+
+	addiu	$v0, $0, 10			# exit
+	syscall
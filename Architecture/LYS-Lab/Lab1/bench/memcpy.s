@@ -0,0 +1,71 @@
+# memcpy: copy a 16 KiB buffer word by word (unrolled 4 times) and 4 KiB of it
+# byte by byte between unaligned addresses, 1500 times
+# result: $s7 = checksum of the destination buffer
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 source buffer
+	lui		$s1, 0x1001			# $s1 = 0x10010000 destination buffer
+	lui		$s6, 0x1234			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0x5678
+	ori		$t1, $s0, 0x4000	# $t1 = end of the source
+
+	# fill the source with random words
+	addu	$t0, $s0, $0
+fill:
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	sw		$s6, 0($t0)
+	addiu	$t0, $t0, 4
+	bne		$t0, $t1, fill
+
+	addiu	$s2, $0, 1500		# $s2 = passes left
+pass:
+	# 16 KiB, 4 words per iteration
+	addu	$t0, $s0, $0		# $t0 = source pointer
+	addu	$t3, $s1, $0		# $t3 = destination pointer
+wcopy:
+	lw		$t4, 0($t0)
+	lw		$t5, 4($t0)
+	lw		$t6, 8($t0)
+	lw		$t7, 12($t0)
+	sw		$t4, 0($t3)
+	sw		$t5, 4($t3)
+	sw		$t6, 8($t3)
+	sw		$t7, 12($t3)
+	addiu	$t0, $t0, 16
+	addiu	$t3, $t3, 16
+	bne		$t0, $t1, wcopy
+
+	# 4 KiB from source + 1 to destination + 0x4003, a byte at a time
+	addiu	$t0, $s0, 1
+	addiu	$t3, $s1, 0x4003
+	addiu	$t2, $t0, 0x1000	# $t2 = end of the bytes
+bcopy:
+	lbu		$t4, 0($t0)
+	sb		$t4, 0($t3)
+	addiu	$t0, $t0, 1
+	addiu	$t3, $t3, 1
+	bne		$t0, $t2, bcopy
+
+	addiu	$s2, $s2, -1
+	bne		$s2, $0, pass
+
+	# checksum: rotate left by 1 and add every word of the destination
+	addu	$s7, $0, $0
+	addu	$t0, $s1, $0
+	ori		$t1, $s1, 0x5004	# end of the bytes copied, rounded up
+sum:
+	lw		$t4, 0($t0)
+	sll		$t5, $s7, 1
+	srl		$t6, $s7, 31
+	or		$s7, $t5, $t6
+	addu	$s7, $s7, $t4
+	addiu	$t0, $t0, 4
+	bne		$t0, $t1, sum
+
+	addiu	$v0, $0, 10			# exit
+	syscall
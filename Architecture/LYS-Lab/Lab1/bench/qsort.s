@@ -0,0 +1,91 @@
+# qsort: fill an array of 4096 words with random numbers and sort it with a
+# recursive quicksort (Lomuto partition), 90 times
+# result: $s5 = pairs found out of order after sorting (0),
+#         $s7 = checksum of the smallest, middle and largest elements
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 the array
+	ori		$s1, $s0, 0x3ffc	# $s1 = its last element
+	lui		$s6, 0x9e37			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0x79b9
+	lui		$sp, 0x8000			# $sp = top of the stack
+	addiu	$sp, $sp, -16
+	addu	$s5, $0, $0
+	addu	$s7, $0, $0
+	addiu	$s2, $0, 90			# $s2 = passes left
+pass:
+	addu	$t0, $s0, $0
+	addiu	$t1, $s1, 4			# $t1 = end of the array
+fill:
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	sw		$s6, 0($t0)
+	addiu	$t0, $t0, 4
+	bne		$t0, $t1, fill
+
+	addu	$a0, $s0, $0
+	addu	$a1, $s1, $0
+	jal		quicksort
+
+	# count the pairs out of order
+	addu	$t0, $s0, $0
+check:
+	lw		$t1, 0($t0)
+	lw		$t2, 4($t0)
+	slt		$t3, $t2, $t1
+	addu	$s5, $s5, $t3
+	addiu	$t0, $t0, 4
+	bne		$t0, $s1, check
+	lw		$t1, 0($s0)			# $s7 = $s7 * 2 ^ first ^ middle ^ last
+	lw		$t2, 0x2000($s0)
+	lw		$t3, 0($s1)
+	sll		$s7, $s7, 1
+	xor		$s7, $s7, $t1
+	xor		$s7, $s7, $t2
+	xor		$s7, $s7, $t3
+
+	addiu	$s2, $s2, -1
+	bne		$s2, $0, pass
+
+	addiu	$v0, $0, 10			# exit
+	syscall
+
+# sort the words from $a0 to $a1 (inclusive) in ascending (signed) order
+quicksort:
+	sltu	$t0, $a0, $a1
+	beq		$t0, $0, done
+	addiu	$sp, $sp, -12
+	sw		$ra, 0($sp)
+	sw		$a1, 4($sp)
+	lw		$t1, 0($a1)			# $t1 = pivot, the last element
+	addu	$t2, $a0, $0		# $t2 = where the next element below the pivot goes
+	addu	$t3, $a0, $0		# $t3 = element compared
+partition:
+	lw		$t4, 0($t3)
+	slt		$t5, $t4, $t1
+	beq		$t5, $0, above
+	lw		$t6, 0($t2)			# swap it down
+	sw		$t4, 0($t2)
+	sw		$t6, 0($t3)
+	addiu	$t2, $t2, 4
+above:
+	addiu	$t3, $t3, 4
+	bne		$t3, $a1, partition
+	lw		$t6, 0($t2)			# the pivot goes between both parts
+	sw		$t1, 0($t2)
+	sw		$t6, 0($a1)
+	sw		$t2, 8($sp)
+	addiu	$a1, $t2, -4		# sort the part below
+	jal		quicksort
+	lw		$t2, 8($sp)			# sort the part above
+	addiu	$a0, $t2, 4
+	lw		$a1, 4($sp)
+	jal		quicksort
+	lw		$ra, 0($sp)
+	addiu	$sp, $sp, 12
+done:
+	jr		$ra
@@ -0,0 +1,65 @@
+# strlen: 512 strings of random lengths (0-255), each measured a byte at a
+# time by a strlen function, 250 times
+# result: $s7 = total length measured
+	.text
+main:
+	lui		$s0, 0x1000			# $s0 = 0x10000000 strings, one after another
+	lui		$s1, 0x1008			# $s1 = 0x10080000 table of the string addresses
+	lui		$s6, 0x2545			# $s6 = xorshift32 state
+	ori		$s6, $s6, 0xf491
+	lui		$sp, 0x8000			# $sp = top of the stack
+	addiu	$sp, $sp, -16
+
+	# build the strings: random length, characters 0x20-0x5f
+	addu	$t0, $s0, $0		# $t0 = next string
+	addu	$t1, $s1, $0		# $t1 = next table entry
+	addiu	$t9, $s1, 2048		# $t9 = end of the table (512 entries)
+build:
+	sw		$t0, 0($t1)
+	sll		$t2, $s6, 13		# $s6 ^= $s6 << 13
+	xor		$s6, $s6, $t2
+	srl		$t2, $s6, 17		# $s6 ^= $s6 >> 17
+	xor		$s6, $s6, $t2
+	sll		$t2, $s6, 5			# $s6 ^= $s6 << 5
+	xor		$s6, $s6, $t2
+	andi	$t3, $s6, 0xff		# $t3 = length
+	addu	$t4, $t0, $t3		# $t4 = end of the string
+	beq		$t0, $t4, terminate
+chars:
+	andi	$t5, $t0, 0x3f		# a character from the address
+	addiu	$t5, $t5, 0x20
+	sb		$t5, 0($t0)
+	addiu	$t0, $t0, 1
+	bne		$t0, $t4, chars
+terminate:
+	sb		$0, 0($t0)
+	addiu	$t0, $t0, 1
+	addiu	$t1, $t1, 4
+	bne		$t1, $t9, build
+
+	addu	$s7, $0, $0			# $s7 = total length
+	addiu	$s2, $0, 250		# $s2 = passes left
+pass:
+	addu	$s3, $s1, $0		# $s3 = table entry
+next:
+	lw		$a0, 0($s3)
+	jal		strlen
+	addu	$s7, $s7, $v0
+	addiu	$s3, $s3, 4
+	bne		$s3, $t9, next
+	addiu	$s2, $s2, -1
+	bne		$s2, $0, pass
+
+	addiu	$v0, $0, 10			# exit
+	syscall
+
+# $v0 = length of the string at $a0
+strlen:
+	addu	$t0, $a0, $0
+loop:
+	lbu		$t1, 0($t0)
+	addiu	$t0, $t0, 1
+	bne		$t1, $0, loop
+	subu	$v0, $t0, $a0
+	addiu	$v0, $v0, -1
+	jr		$ra
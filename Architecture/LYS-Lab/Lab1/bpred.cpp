@@ -0,0 +1,408 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   branch prediction                                         */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+Every executed control transfer is first predicted, then the predictor is
+trained with its outcome:
+- conditional branches by the selected direction predictor,
+- returns (JR $31) by the return address stack, which JAL, JALR and taken
+  BLTZAL/BGEZAL push,
+- other JR/JALR by the branch target buffer.
+The BTB is also looked up for every taken branch and jump to see whether the
+target would have been known at fetch. The outcome of every site is counted
+in a dense array indexed by text offset, like the decode cache.
+*/
+
+enum
+{
+    BP_STATIC, // backward taken, forward not taken
+    BP_BIMODAL,
+    BP_GSHARE,
+    BP_TOURNAMENT,
+    BP_TAGE
+};
+const char *BPRED_NAMES[] = {"static", "bimodal", "gshare", "tournament", "tage"};
+#define NUM_BPREDS (sizeof(BPRED_NAMES) / sizeof(BPRED_NAMES[0]))
+
+int bpred_model = FALSE;
+int bpred_kind = BP_GSHARE;
+int bpred_bits = 12; // log2 of the entries of the main tables
+
+#define BTB_BITS 9   // direct mapped, 512 entries
+#define RAS_DEPTH 16 // entries, the oldest is overwritten when full
+#define LOCAL_BITS 10
+// TAGE-lite: tagged tables of 2^(bpred_bits - 2) entries with geometric history lengths
+#define TAGE_TABLES 4
+#define TAGE_TAG_BITS 8
+const int TAGE_HISTORY[TAGE_TABLES] = {5, 11, 22, 44};
+#define TAGE_U_RESET 0x40000 // branches between two resets of the useful bits
+
+typedef struct
+{
+    uint8_t ctr, tag, u; // 3-bit counter, taken if >= 4
+} tage_entry_t;
+
+typedef struct
+{
+    uint64_t executed, taken, mispredicted;
+} bpred_site_t;
+
+// kinds of control transfers
+enum
+{
+    CT_BRANCH,
+    CT_JUMP, // J, JAL
+    CT_RETURN,
+    CT_INDIRECT, // other JR, JALR
+    NUM_CT
+};
+const char *CT_NAMES[NUM_CT] = {"branch", "jump", "return", "indirect"};
+
+typedef struct
+{
+    uint8_t *counters; // 2-bit, bimodal / gshare / global of tournament / base of TAGE
+    uint8_t *chooser;  // tournament: >= 2 selects global
+    uint16_t *local_history;
+    uint8_t *local_counters;
+    tage_entry_t *tage[TAGE_TABLES];
+    uint64_t history; // global, the last outcome in bit 0
+    uint64_t branches;
+    uint32_t btb_tag[1 << BTB_BITS], btb_target[1 << BTB_BITS];
+    uint32_t ras[RAS_DEPTH], ras_top;
+    bpred_site_t *sites, other; // per text word, and sites outside of the text
+    uint32_t sites_start, sites_size;
+    // totals per kind of control transfer
+    uint64_t executed[NUM_CT], mispredicted[NUM_CT];
+    uint64_t btb_lookups, btb_misses;
+} bpred_t;
+
+thread_local bpred_t BP;
+thread_local int bpred_ready = FALSE;
+
+/*
+Procedure : bpred_config
+Purpose   : Select the predictor given as "{name}[:{bits}]", bits is the log2
+            of the entries of its tables (4 to 20, 12 by default)
+*/
+int bpred_config(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    int bits = 12;
+    if (colon)
+    {
+        char *end;
+        bits = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || bits < 4 || bits > 20)
+            return FALSE;
+    }
+    for (int i = 0; i < NUM_BPREDS; i++)
+    {
+        if (strlen(BPRED_NAMES[i]) == len && strncmp(BPRED_NAMES[i], spec, len) == 0)
+        {
+            bpred_kind = i, bpred_bits = bits;
+            bpred_model = TRUE;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+Procedure : bpred_reset
+Purpose   : Start with untrained tables and no statistics
+*/
+void bpred_reset()
+{
+    free(BP.counters);
+    free(BP.chooser);
+    free(BP.local_history);
+    free(BP.local_counters);
+    for (int t = 0; t < TAGE_TABLES; t++)
+        free(BP.tage[t]);
+    free(BP.sites);
+    memset(&BP, 0, sizeof(BP));
+    uint32_t entries = 1u << bpred_bits;
+    // weakly not taken
+    BP.counters = (uint8_t *)malloc(entries);
+    memset(BP.counters, 1, entries);
+    BP.chooser = (uint8_t *)malloc(entries);
+    memset(BP.chooser, 1, entries);
+    BP.local_history = (uint16_t *)calloc(1 << LOCAL_BITS, sizeof(uint16_t));
+    BP.local_counters = (uint8_t *)malloc(1 << LOCAL_BITS);
+    memset(BP.local_counters, 1, 1 << LOCAL_BITS);
+    for (int t = 0; t < TAGE_TABLES; t++)
+        BP.tage[t] = (tage_entry_t *)calloc(entries >> 2, sizeof(tage_entry_t));
+    BP.sites_start = MEM_REGIONS[REGION_TEXT].start;
+    BP.sites_size = MEM_REGIONS[REGION_TEXT].size;
+    // calloc leaves the pages of sites which never branch untouched
+    BP.sites = (bpred_site_t *)calloc(BP.sites_size / 4, sizeof(bpred_site_t));
+    if (BP.sites == NULL)
+    {
+        printf("@ Error: Can't allocate the branch predictor\n");
+        exit(-1);
+    }
+    bpred_ready = TRUE;
+}
+
+// 2-bit / 3-bit saturating counters
+inline void count2(uint8_t *ctr, int up)
+{
+    if (up && *ctr < 3)
+        (*ctr)++;
+    else if (!up && *ctr > 0)
+        (*ctr)--;
+}
+inline void count3(uint8_t *ctr, int up)
+{
+    if (up && *ctr < 7)
+        (*ctr)++;
+    else if (!up && *ctr > 0)
+        (*ctr)--;
+}
+// the last len outcomes of the history folded to bits bits
+inline uint32_t fold(uint64_t history, int len, int bits)
+{
+    uint64_t h = len < 64 ? history & ((1ull << len) - 1) : history;
+    uint32_t folded = 0;
+    for (; h; h >>= bits)
+        folded ^= h & ((1u << bits) - 1);
+    return folded;
+}
+inline uint32_t tage_index(uint32_t pc, int t)
+{
+    int bits = bpred_bits - 2;
+    return ((pc >> 2) ^ (pc >> (2 + bits)) ^ fold(BP.history, TAGE_HISTORY[t], bits)) & ((1u << bits) - 1);
+}
+inline uint8_t tage_tag(uint32_t pc, int t)
+{
+    return ((pc >> 2) ^ fold(BP.history, TAGE_HISTORY[t], TAGE_TAG_BITS) ^
+            (fold(BP.history, TAGE_HISTORY[t], TAGE_TAG_BITS - 1) << 1)) &
+           ((1u << TAGE_TAG_BITS) - 1);
+}
+
+// predict the direction of the conditional branch at pc, then train with taken
+int predict_direction(uint32_t pc, uint32_t target, int taken)
+{
+    uint32_t mask = (1u << bpred_bits) - 1, index = (pc >> 2) & mask;
+    uint32_t gindex = ((pc >> 2) ^ BP.history) & mask;
+    int prediction = FALSE;
+    switch (bpred_kind)
+    {
+    case BP_STATIC:
+        prediction = target <= pc;
+        break;
+    case BP_BIMODAL:
+        prediction = BP.counters[index] >= 2;
+        count2(&BP.counters[index], taken);
+        break;
+    case BP_GSHARE:
+        prediction = BP.counters[gindex] >= 2;
+        count2(&BP.counters[gindex], taken);
+        break;
+    case BP_TOURNAMENT:
+    {
+        // per-branch history of the last LOCAL_BITS outcomes vs global history
+        uint32_t lindex = (pc >> 2) & ((1 << LOCAL_BITS) - 1);
+        uint16_t *local = &BP.local_history[lindex];
+        uint8_t *lctr = &BP.local_counters[*local], *gctr = &BP.counters[BP.history & mask];
+        uint8_t *choice = &BP.chooser[BP.history & mask];
+        int lpred = *lctr >= 2, gpred = *gctr >= 2;
+        prediction = *choice >= 2 ? gpred : lpred;
+        if (lpred != gpred)
+            count2(choice, gpred == taken);
+        count2(lctr, taken);
+        count2(gctr, taken);
+        *local = ((*local << 1) | taken) & ((1 << LOCAL_BITS) - 1);
+        break;
+    }
+    case BP_TAGE:
+    {
+        // the longest matching history provides the prediction, the next one the alternate
+        int provider = -1, alternate = -1;
+        uint32_t indices[TAGE_TABLES];
+        uint8_t tags[TAGE_TABLES];
+        for (int t = TAGE_TABLES - 1; t >= 0; t--)
+        {
+            indices[t] = tage_index(pc, t), tags[t] = tage_tag(pc, t);
+            if (BP.tage[t][indices[t]].tag == tags[t] && BP.tage[t][indices[t]].ctr)
+            {
+                if (provider < 0)
+                    provider = t;
+                else if (alternate < 0)
+                    alternate = t;
+            }
+        }
+        int base = BP.counters[index] >= 2;
+        int altpred = alternate >= 0 ? BP.tage[alternate][indices[alternate]].ctr >= 4 : base;
+        prediction = provider >= 0 ? BP.tage[provider][indices[provider]].ctr >= 4 : base;
+
+        if (provider >= 0)
+        {
+            tage_entry_t *e = &BP.tage[provider][indices[provider]];
+            if (prediction != altpred)
+                e->u = prediction == taken ? std::min(e->u + 1, 3) : std::max(e->u - 1, 0);
+            // a counter of 0 marks an empty entry, keep trained ones at 1 at least
+            count3(&e->ctr, taken);
+            if (e->ctr == 0)
+                e->ctr = 1;
+        }
+        else
+            count2(&BP.counters[index], taken);
+        // on a misprediction take an entry of a longer history
+        if (prediction != taken && provider < TAGE_TABLES - 1)
+        {
+            int allocated = FALSE;
+            for (int t = provider + 1; t < TAGE_TABLES && !allocated; t++)
+            {
+                tage_entry_t *e = &BP.tage[t][indices[t]];
+                if (e->u == 0)
+                {
+                    e->tag = tags[t], e->ctr = taken ? 4 : 3, e->u = 0;
+                    allocated = TRUE;
+                }
+            }
+            for (int t = provider + 1; t < TAGE_TABLES && !allocated; t++)
+                if (BP.tage[t][indices[t]].u)
+                    BP.tage[t][indices[t]].u--;
+        }
+        if ((BP.branches & (TAGE_U_RESET - 1)) == 0)
+            for (int t = 0; t < TAGE_TABLES; t++)
+                for (uint32_t i = 0; i < (mask + 1) >> 2; i++)
+                    BP.tage[t][i].u >>= 1;
+        break;
+    }
+    }
+    BP.history = (BP.history << 1) | taken;
+    BP.branches++;
+    return prediction;
+}
+
+// whether the BTB holds target for the taken transfer at pc, then train it
+inline int btb_hit(uint32_t pc, uint32_t target)
+{
+    uint32_t i = (pc >> 2) & ((1 << BTB_BITS) - 1);
+    int hit = BP.btb_tag[i] == pc && BP.btb_target[i] == target;
+    BP.btb_tag[i] = pc, BP.btb_target[i] = target;
+    BP.btb_lookups++;
+    BP.btb_misses += !hit;
+    return hit;
+}
+inline void ras_push(uint32_t address)
+{
+    BP.ras_top = (BP.ras_top + 1) % RAS_DEPTH;
+    BP.ras[BP.ras_top] = address;
+}
+inline uint32_t ras_pop()
+{
+    uint32_t address = BP.ras[BP.ras_top];
+    BP.ras_top = (BP.ras_top + RAS_DEPTH - 1) % RAS_DEPTH;
+    return address;
+}
+
+/*
+Procedure : bpred_update
+Purpose   : Predict and train with the control transfer d executed at pc,
+            next_pc is the PC it went on with
+*/
+void bpred_update(const decoded_ins_t *d, uint32_t pc, uint32_t next_pc)
+{
+    if (!bpred_ready)
+        bpred_reset();
+    int kind, mispredicted, taken = next_pc != pc + 4;
+    switch (d->handler)
+    {
+    case H_I_Branch:
+        kind = CT_BRANCH;
+        mispredicted = predict_direction(pc, pc + 4 + d->imm * 4, taken) != taken;
+        if (taken)
+            btb_hit(pc, next_pc);
+        if (d->opid == OP_BLTZAL || d->opid == OP_BGEZAL)
+            if (taken)
+                ras_push(pc + 4);
+        break;
+    case H_J_Jump:
+        kind = CT_JUMP;
+        mispredicted = FALSE;
+        btb_hit(pc, next_pc);
+        if (d->opid == OP_JAL)
+            ras_push(pc + 4);
+        break;
+    case H_R_Jump:
+        if (d->opid == OP_JR && d->rs == 31)
+        {
+            kind = CT_RETURN;
+            mispredicted = ras_pop() != next_pc;
+        }
+        else
+        {
+            kind = CT_INDIRECT;
+            mispredicted = !btb_hit(pc, next_pc);
+        }
+        if (d->opid == OP_JALR)
+            ras_push(pc + 4);
+        break;
+    default:
+        return;
+    }
+    BP.executed[kind]++;
+    BP.mispredicted[kind] += mispredicted;
+    uint32_t offset = pc - BP.sites_start;
+    bpred_site_t *site = offset < BP.sites_size ? &BP.sites[offset >> 2] : &BP.other;
+    site->executed++;
+    site->taken += taken;
+    site->mispredicted += mispredicted;
+}
+
+/*
+Procedure : bpred_report
+Purpose   : Print the accuracy of every kind of control transfer and the
+            branch sites mispredicted most often
+*/
+void bpred_report()
+{
+    if (!bpred_ready)
+        bpred_reset();
+    printf("@ Branch prediction (%s, 2^%d entries) :\n", BPRED_NAMES[bpred_kind], bpred_bits);
+    printf("-------------------------------------\n");
+    for (int k = 0; k < NUM_CT; k++)
+        printf("%-8s : %llu executed, %llu mispredicted (%.2f%%)\n", CT_NAMES[k],
+               (unsigned long long)BP.executed[k], (unsigned long long)BP.mispredicted[k],
+               BP.executed[k] ? 100.0 * BP.mispredicted[k] / BP.executed[k] : 0.0);
+    printf("BTB      : %llu lookups, %llu misses\n",
+           (unsigned long long)BP.btb_lookups, (unsigned long long)BP.btb_misses);
+
+    // the sites with the most mispredictions
+    std::vector<uint32_t> worst;
+    for (uint32_t i = 0; i < BP.sites_size / 4; i++)
+        if (BP.sites[i].mispredicted)
+            worst.push_back(i);
+    std::sort(worst.begin(), worst.end(), [](uint32_t a, uint32_t b)
+              { return BP.sites[a].mispredicted != BP.sites[b].mispredicted
+                           ? BP.sites[a].mispredicted > BP.sites[b].mispredicted
+                           : a < b; });
+    if (worst.size() > 20)
+        worst.resize(20);
+    printf("PC        executed    taken     mispredicted\n");
+    for (uint32_t i : worst)
+    {
+        bpred_site_t *s = &BP.sites[i];
+        printf("%08x  %-10llu  %6.2f%%  %llu (%.2f%%)\n", BP.sites_start + i * 4,
+               (unsigned long long)s->executed, 100.0 * s->taken / s->executed,
+               (unsigned long long)s->mispredicted, 100.0 * s->mispredicted / s->executed);
+    }
+    if (BP.other.mispredicted)
+        printf("outside of the text: %llu executed, %llu mispredicted\n",
+               (unsigned long long)BP.other.executed, (unsigned long long)BP.other.mispredicted);
+    printf("-------------------------------------\n");
+}
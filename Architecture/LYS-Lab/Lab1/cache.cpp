@@ -0,0 +1,444 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   cache hierarchy model                                     */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include "myshell.h"
+
+/*
+Instruction fetches go to the L1 instruction cache, loads and stores to the
+L1 data cache, and the misses and write-backs of both to the unified L2 if
+there is one. Only tags are kept, the data stays in the guest memory.
+
+The tags of a set are contiguous, so a lookup scans a few words of one cache
+line of the host. With LRU replacement a set is kept in recency order, the
+most recently used way first, which makes the common hit a single compare.
+
+Misses are classified with the 3C model: compulsory if the line was never
+accessed before, capacity if a fully associative LRU cache of the same size
+misses as well, conflict otherwise. The fully associative cache is a list of
+its lines in recency order, and a dense array indexed by line number gives
+the place of a line in the list (or tells it was never / is no longer there).
+*/
+
+enum
+{
+    CACHE_L1I,
+    CACHE_L1D,
+    CACHE_L2,
+    NUM_CACHES
+};
+enum
+{
+    POLICY_LRU,
+    POLICY_PLRU,
+    POLICY_RANDOM
+};
+const char *CACHE_NAMES[NUM_CACHES] = {"l1i", "l1d", "l2"};
+const char *POLICY_NAMES[] = {"lru", "plru", "random"};
+
+typedef struct
+{
+    uint32_t size, ways, line; // bytes, associativity, bytes
+    int policy, write_back;    // write-back & write-allocate, or write-through & no-write-allocate
+} cache_config_t;
+
+// L1 caches of 16 KiB, 4-way, 32 B lines, no L2 unless configured
+cache_config_t CACHE_CONFIG[NUM_CACHES] = {
+    {16 << 10, 4, 32, POLICY_LRU, TRUE},
+    {16 << 10, 4, 32, POLICY_LRU, TRUE},
+    {0, 8, 64, POLICY_LRU, TRUE}};
+int cache_model = FALSE;
+
+// a tag is the line number shifted left by 2 with these flags, 0 if the way is empty
+#define TAG_VALID 2
+#define TAG_DIRTY 1
+// state of a line in the fully associative cache
+#define FA_NEVER 0
+#define FA_EVICTED 1 // otherwise 2 + the slot holding the line
+
+typedef struct
+{
+    cache_config_t config;
+    uint32_t line_shift, set_mask;
+    uint32_t *tags; // ways tags per set
+    uint32_t *plru; // tree bits per set
+    // fully associative shadow cache
+    uint32_t *fa_state;                    // per line number
+    size_t fa_state_bytes;
+    uint32_t *fa_line, *fa_prev, *fa_next; // per slot
+    uint32_t fa_head, fa_used, fa_slots;
+    // the line accessed last and its tag, most recently used in both caches
+    uint32_t last_line, *last_tag;
+    // statistics
+    uint64_t reads, writes, read_misses, write_misses;
+    uint64_t compulsory, capacity, conflict, writebacks;
+} cache_t;
+
+thread_local cache_t CACHES[NUM_CACHES];
+thread_local int caches_ready = FALSE;
+thread_local uint32_t cache_random = 0x2545f491;
+
+inline uint32_t log2_of(uint32_t n)
+{
+    uint32_t k = 0;
+    while ((1u << k) < n)
+        k++;
+    return k;
+}
+
+/*
+Procedure : cache_config
+Purpose   : Configure the caches as given by a comma separated list of
+            "{cache}={size}:{ways}:{line}[:{policy}[:{write}]]", cache is
+            l1i/l1d/l2, size may end with k, policy is lru/plru/random and
+            write wb/wt; "default" keeps the default configuration
+*/
+int cache_config(const char *spec)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    for (char *save, *item = strtok_r(buffer, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        if (strcmp(item, "default") == 0)
+            continue;
+        char *eq = strchr(item, '='), *end;
+        if (eq == NULL)
+            return FALSE;
+        *eq = '\0';
+        int i = 0;
+        while (i < NUM_CACHES && strcmp(item, CACHE_NAMES[i]) != 0)
+            i++;
+        if (i == NUM_CACHES)
+            return FALSE;
+        cache_config_t c = CACHE_CONFIG[i];
+        c.size = strtoul(eq + 1, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            c.size <<= 10, end++;
+        if (*end++ != ':')
+            return FALSE;
+        c.ways = strtoul(end, &end, 0);
+        if (*end++ != ':')
+            return FALSE;
+        c.line = strtoul(end, &end, 0);
+        if (*end == ':')
+        {
+            char *field = ++end;
+            end = field + strcspn(field, ":");
+            int p = 0;
+            while (p < 3 && ((size_t)(end - field) != strlen(POLICY_NAMES[p]) ||
+                             strncmp(field, POLICY_NAMES[p], end - field) != 0))
+                p++;
+            if (p == 3)
+                return FALSE;
+            c.policy = p;
+        }
+        if (*end == ':')
+        {
+            if (strcmp(end + 1, "wb") == 0)
+                c.write_back = TRUE;
+            else if (strcmp(end + 1, "wt") == 0)
+                c.write_back = FALSE;
+            else
+                return FALSE;
+            end += strlen(end);
+        }
+        // powers of two, lines of 16 B to 4 KiB, at most 32 ways (PLRU bits of a set)
+        uint32_t sets = c.ways && c.line ? c.size / c.line / c.ways : 0;
+        if (*end != '\0' || sets == 0 || (sets & (sets - 1)) || (c.line & (c.line - 1)) ||
+            c.line < 16 || c.line > 4096 || c.ways > 32 || sets * c.ways * c.line != c.size ||
+            (c.policy == POLICY_PLRU && (c.ways & (c.ways - 1))))
+            return FALSE;
+        CACHE_CONFIG[i] = c;
+    }
+    cache_model = TRUE;
+    return TRUE;
+}
+
+// release the tags and the shadow cache of c
+void cache_free(cache_t *c)
+{
+    free(c->tags);
+    free(c->plru);
+    free(c->fa_line);
+    free(c->fa_prev);
+    free(c->fa_next);
+    if (c->fa_state)
+        munmap(c->fa_state, c->fa_state_bytes);
+    memset(c, 0, sizeof(*c));
+}
+
+/*
+Procedure : cache_reset
+Purpose   : Start with empty caches of the configured geometry and no statistics
+*/
+void cache_reset()
+{
+    for (int i = 0; i < NUM_CACHES; i++)
+    {
+        cache_t *c = &CACHES[i];
+        cache_free(c);
+        c->config = CACHE_CONFIG[i];
+        c->last_line = UINT32_MAX;
+        if (c->config.size == 0)
+            continue;
+        uint32_t lines = c->config.size / c->config.line;
+        c->line_shift = log2_of(c->config.line);
+        c->set_mask = lines / c->config.ways - 1;
+        c->tags = (uint32_t *)calloc(lines, sizeof(uint32_t));
+        c->plru = (uint32_t *)calloc(c->set_mask + 1, sizeof(uint32_t));
+        // one state per line of the 4 GiB address space, pages are only backed once used
+        c->fa_state_bytes = ((size_t)1 << (32 - c->line_shift)) * sizeof(uint32_t);
+        void *state = mmap(NULL, c->fa_state_bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        c->fa_state = state == MAP_FAILED ? NULL : (uint32_t *)state;
+        c->fa_line = (uint32_t *)malloc(lines * sizeof(uint32_t));
+        c->fa_prev = (uint32_t *)malloc(lines * sizeof(uint32_t));
+        c->fa_next = (uint32_t *)malloc(lines * sizeof(uint32_t));
+        c->fa_slots = lines;
+        if (c->tags == NULL || c->plru == NULL || c->fa_state == NULL ||
+            c->fa_line == NULL || c->fa_prev == NULL || c->fa_next == NULL)
+        {
+            printf("@ Error: Can't allocate the %s cache model\n", CACHE_NAMES[i]);
+            exit(-1);
+        }
+    }
+    caches_ready = TRUE;
+}
+
+// access line in the fully associative cache, return TRUE on a hit;
+// *seen tells whether the line had ever been accessed
+inline int fa_access(cache_t *c, uint32_t line, int *seen)
+{
+    uint32_t state = c->fa_state[line], slot;
+    *seen = state != FA_NEVER;
+    if (state > FA_EVICTED)
+    {
+        slot = state - 2;
+        if (slot == c->fa_head)
+            return TRUE;
+        // unlink, then move to the front below
+        c->fa_next[c->fa_prev[slot]] = c->fa_next[slot];
+        c->fa_prev[c->fa_next[slot]] = c->fa_prev[slot];
+    }
+    else if (c->fa_used < c->fa_slots)
+        slot = c->fa_used++;
+    else
+    {
+        // the least recently used line is the one before the head
+        slot = c->fa_prev[c->fa_head];
+        c->fa_state[c->fa_line[slot]] = FA_EVICTED;
+        c->fa_next[c->fa_prev[slot]] = c->fa_next[slot];
+        c->fa_prev[c->fa_next[slot]] = c->fa_prev[slot];
+    }
+    if (c->fa_used == 1 && state <= FA_EVICTED)
+        c->fa_prev[slot] = c->fa_next[slot] = slot;
+    else
+    {
+        uint32_t head = c->fa_head, tail = c->fa_prev[head];
+        c->fa_next[slot] = head, c->fa_prev[slot] = tail;
+        c->fa_next[tail] = slot, c->fa_prev[head] = slot;
+    }
+    c->fa_head = slot;
+    c->fa_line[slot] = line;
+    c->fa_state[line] = slot + 2;
+    return state > FA_EVICTED;
+}
+
+// mark way as the most recently used one of the PLRU tree of set
+inline void plru_touch(cache_t *c, uint32_t set, uint32_t way)
+{
+    // node n has children 2n+1 and 2n+2, its bit points away from the last used half
+    uint32_t bits = c->plru[set], node = 0;
+    for (uint32_t half = c->config.ways >> 1; half; half >>= 1)
+    {
+        int right = (way & half) != 0;
+        bits = right ? bits & ~(1u << node) : bits | (1u << node);
+        node = 2 * node + 1 + right;
+    }
+    c->plru[set] = bits;
+}
+// the way the PLRU tree of set points to
+inline uint32_t plru_victim(cache_t *c, uint32_t set)
+{
+    uint32_t bits = c->plru[set], node = 0, way = 0;
+    for (uint32_t half = c->config.ways >> 1; half; half >>= 1)
+    {
+        int right = (bits >> node) & 1;
+        way |= right ? half : 0;
+        node = 2 * node + 1 + right;
+    }
+    return way;
+}
+
+void cache_access(int level, uint32_t address, int write);
+
+// the line with tag was evicted from c, write it back if it is dirty
+inline void cache_evict(cache_t *c, int level, uint32_t tag)
+{
+    if ((tag & (TAG_VALID | TAG_DIRTY)) != (TAG_VALID | TAG_DIRTY))
+        return;
+    c->writebacks++;
+    if (level != CACHE_L2 && CACHES[CACHE_L2].tags)
+        cache_access(CACHE_L2, (tag >> 2) << c->line_shift, TRUE);
+}
+
+/*
+Procedure : cache_access
+Purpose   : Read or write the line holding address in the cache of level,
+            going to the L2 on a miss
+*/
+void cache_access(int level, uint32_t address, int write)
+{
+    cache_t *c = &CACHES[level];
+    uint32_t line = address >> c->line_shift, set = line & c->set_mask;
+    uint32_t ways = c->config.ways, want = (line << 2) | TAG_VALID;
+    uint32_t *tags = &c->tags[set * ways], way = 0;
+    int seen;
+
+    // consecutive accesses to one line (fetches above all) change no recency
+    if (line == c->last_line)
+    {
+        if (write)
+        {
+            c->writes++;
+            if (c->config.write_back)
+                *c->last_tag |= TAG_DIRTY;
+            else if (level != CACHE_L2 && CACHES[CACHE_L2].tags)
+                cache_access(CACHE_L2, address, TRUE);
+        }
+        else
+            c->reads++;
+        return;
+    }
+
+    while (way < ways && (tags[way] & ~TAG_DIRTY) != want)
+        way++;
+    int fa_hit = fa_access(c, line, &seen);
+    if (write)
+        c->writes++;
+    else
+        c->reads++;
+
+    if (way < ways)
+    {
+        // hit
+        uint32_t tag = tags[way] | (write && c->config.write_back ? TAG_DIRTY : 0);
+        if (c->config.policy == POLICY_LRU)
+        {
+            memmove(tags + 1, tags, way * sizeof(uint32_t));
+            tags[0] = tag;
+            way = 0;
+        }
+        else
+        {
+            tags[way] = tag;
+            if (c->config.policy == POLICY_PLRU)
+                plru_touch(c, set, way);
+        }
+        c->last_line = line, c->last_tag = &tags[way];
+        if (write && !c->config.write_back && level != CACHE_L2 && CACHES[CACHE_L2].tags)
+            cache_access(CACHE_L2, address, TRUE);
+        return;
+    }
+
+    // miss
+    if (write)
+        c->write_misses++;
+    else
+        c->read_misses++;
+    if (!seen)
+        c->compulsory++;
+    else if (!fa_hit)
+        c->capacity++;
+    else
+        c->conflict++;
+    if (level != CACHE_L2 && CACHES[CACHE_L2].tags)
+        cache_access(CACHE_L2, address, write && !c->config.write_back);
+    if (write && !c->config.write_back)
+        return;
+    c->last_line = line;
+
+    // allocate, taking an empty way if there is one
+    uint32_t tag = want | (write ? TAG_DIRTY : 0);
+    for (way = 0; way < ways && tags[way]; way++)
+        ;
+    if (c->config.policy == POLICY_LRU)
+    {
+        if (way == ways)
+            cache_evict(c, level, tags[--way]);
+        memmove(tags + 1, tags, way * sizeof(uint32_t));
+        tags[0] = tag;
+        c->last_tag = &tags[0];
+        return;
+    }
+    if (way == ways)
+    {
+        if (c->config.policy == POLICY_PLRU)
+            way = plru_victim(c, set);
+        else
+        {
+            // xorshift32
+            cache_random ^= cache_random << 13;
+            cache_random ^= cache_random >> 17;
+            cache_random ^= cache_random << 5;
+            way = cache_random % ways;
+        }
+        cache_evict(c, level, tags[way]);
+    }
+    tags[way] = tag;
+    c->last_tag = &tags[way];
+    if (c->config.policy == POLICY_PLRU)
+        plru_touch(c, set, way);
+}
+
+/*
+Procedure : cache_fetch / cache_data
+Purpose   : Hooks of the instruction fetch and of the loads and stores
+*/
+void cache_fetch(uint32_t address)
+{
+    if (!caches_ready)
+        cache_reset();
+    cache_access(CACHE_L1I, address, FALSE);
+}
+void cache_data(uint32_t address, int write)
+{
+    if (!caches_ready)
+        cache_reset();
+    cache_access(CACHE_L1D, address, write);
+}
+
+/*
+Procedure : cache_report
+Purpose   : Print accesses, misses and their classification for every cache
+*/
+void cache_report()
+{
+    if (!caches_ready)
+        cache_reset();
+    printf("@ Cache statistics :\n");
+    printf("-------------------------------------\n");
+    for (int i = 0; i < NUM_CACHES; i++)
+    {
+        cache_t *c = &CACHES[i];
+        if (c->tags == NULL)
+            continue;
+        uint64_t accesses = c->reads + c->writes, misses = c->read_misses + c->write_misses;
+        printf("%-3s %u %s, %u-way, %u B lines, %s, %s\n", CACHE_NAMES[i],
+               c->config.size & 1023 ? c->config.size : c->config.size >> 10,
+               c->config.size & 1023 ? "B" : "KiB", c->config.ways, c->config.line,
+               POLICY_NAMES[c->config.policy], c->config.write_back ? "write-back" : "write-through");
+        printf("    accesses %llu (reads %llu, writes %llu), misses %llu (%.2f%%)\n",
+               (unsigned long long)accesses, (unsigned long long)c->reads, (unsigned long long)c->writes,
+               (unsigned long long)misses, accesses ? 100.0 * misses / accesses : 0.0);
+        printf("    compulsory %llu, capacity %llu, conflict %llu, write-backs %llu\n",
+               (unsigned long long)c->compulsory, (unsigned long long)c->capacity,
+               (unsigned long long)c->conflict, (unsigned long long)c->writebacks);
+    }
+    printf("-------------------------------------\n");
+}
@@ -0,0 +1,352 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   lockstep co-simulation against the reference engine       */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+With --cosim the selected engine is checked against the reference path
+(step_instruction) interval by interval. The reference executes an interval
+first, saving what its stores replace (the words, or with {num} the page at
+the first store to it), so that the memory and the CPU state are then wound
+back to the start of the interval, and the candidate engine executes the
+same number of instructions from there. The two results must agree: the CPU
+state, the run bit and exception, and
+
+    insn   (every instruction)  the words stored, in order
+    block  (every basic block)  the words stored, in order
+    {num}  (every num instructions) a hash of the pages stored to
+
+On the first difference the interval is executed again one instruction at a
+time to find the instruction which diverges, the machine halts before it as
+for an exception, and the differing state is reported. A divergence which
+only shows when the candidate runs the whole interval (a superinstruction or
+a compiled block spanning it) is reported for the interval.
+
+System calls are executed once, by the reference path, between intervals:
+their I/O can't be done twice. The pass of the reference counts nothing in
+the profile and the instruction mix. The models (pipeline, caches, branch
+prediction, trace, undo log) and breakpoints would see every instruction
+twice, so while one of them is on execute() takes its path instead; the
+watchpoints are not checked.
+*/
+
+#define COSIM_PAGES (1 << (32 - MEM_PAGE_SHIFT))
+
+typedef struct
+{
+    uint32_t address, value;
+} cosim_write_t;
+
+// what one engine did in an interval
+typedef struct
+{
+    CPU_State state;
+    int run_bit;
+    uint32_t exception;
+    uint64_t executed;
+    std::vector<cosim_write_t> writes;
+    uint64_t hash;
+} cosim_result_t;
+
+int cosim_model = FALSE;
+uint32_t cosim_interval = 1; // instructions, COSIM_BLOCK for basic blocks
+int cosim_recording = FALSE, cosim_silent = FALSE;
+// the stores of a pass, and the words they replaced (insn and block)
+std::vector<cosim_write_t> cosim_writes, undo_words;
+// the pages the pass stored to as they were before it ({num}); per guest
+// page, the serial of the pass which saved it
+uint32_t *cosim_page_serial = NULL, cosim_serial = 0;
+std::vector<uint32_t> saved_pages;
+std::vector<uint8_t> saved_bytes;
+
+// whether the stores are compared one by one, rather than by their pages
+int log_stores = FALSE;
+
+/*
+Procedure : cosim_config
+Purpose   : Set the interval from spec: insn, block or a number of
+            instructions; return FALSE if it is none of them
+*/
+int cosim_config(const char *spec)
+{
+    char *end;
+    unsigned long num = strtoul(spec, &end, 10);
+    if (strcmp(spec, "insn") == 0)
+        cosim_interval = 1;
+    else if (strcmp(spec, "block") == 0)
+        cosim_interval = COSIM_BLOCK;
+    else if (*spec >= '1' && *spec <= '9' && *end == 0 && num < COSIM_BLOCK)
+        cosim_interval = num;
+    else
+        return FALSE;
+    cosim_model = TRUE;
+    return TRUE;
+}
+
+/*
+Procedure : cosim_write
+Purpose   : Note the store of value to the word at address (from
+            mem_write_32), and save what it replaces
+*/
+void cosim_write(uint32_t address, uint32_t value)
+{
+    if (log_stores)
+    {
+        cosim_writes.push_back({address, value});
+        undo_words.push_back({address, mem_peek_32(address)});
+        return;
+    }
+    // the first store to a page saves the page
+    uint32_t page_no = address >> MEM_PAGE_SHIFT;
+    if (cosim_page_serial[page_no] != cosim_serial)
+    {
+        size_t end = saved_bytes.size();
+        cosim_page_serial[page_no] = cosim_serial;
+        saved_bytes.resize(end + MEM_PAGE_SIZE);
+        // what is outside the regions reads as zeros and is not loaded back
+        mem_read(page_no << MEM_PAGE_SHIFT, &saved_bytes[end], MEM_PAGE_SIZE);
+        saved_pages.push_back(page_no);
+    }
+}
+
+// start recording the stores of a pass
+void begin_pass()
+{
+    cosim_writes.clear();
+    undo_words.clear();
+    saved_pages.clear();
+    saved_bytes.clear();
+    cosim_serial++;
+    cosim_recording = TRUE;
+}
+
+// FNV-1a, a 64-bit word at a time, of the pages the pass stored to in the
+// order of their numbers
+uint64_t hash_pages()
+{
+    std::vector<uint32_t> pages(saved_pages);
+    std::sort(pages.begin(), pages.end());
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint64_t page[MEM_PAGE_SIZE / 8];
+    for (uint32_t page_no : pages)
+    {
+        mem_read(page_no << MEM_PAGE_SHIFT, (uint8_t *)page, MEM_PAGE_SIZE);
+        hash = (hash ^ page_no) * 0x100000001b3ull;
+        for (uint32_t k = 0; k < MEM_PAGE_SIZE / 8; k++)
+            hash = (hash ^ page[k]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// stop recording and keep what the pass did
+void end_pass(cosim_result_t *result, uint64_t executed)
+{
+    cosim_recording = FALSE;
+    result->state = CURRENT_STATE;
+    result->run_bit = RUN_BIT;
+    result->exception = LAST_EXCEPTION;
+    result->executed = executed;
+    result->writes.swap(cosim_writes);
+    result->hash = log_stores ? 0 : hash_pages();
+}
+
+// wind the machine back to start, before the pass
+void rewind_to(const CPU_State *start)
+{
+    const mem_region_t *text = &MEM_REGIONS[REGION_TEXT];
+    for (size_t i = undo_words.size(); i-- > 0;)
+        mem_write_32(undo_words[i].address, undo_words[i].value);
+    for (size_t i = 0; i < saved_pages.size(); i++)
+    {
+        uint32_t address = saved_pages[i] << MEM_PAGE_SHIFT;
+        mem_load(address, &saved_bytes[i * MEM_PAGE_SIZE], MEM_PAGE_SIZE);
+        if (address + MEM_PAGE_SIZE > text->start && address < text->start + text->size)
+            for (uint32_t k = 0; k < MEM_PAGE_SIZE; k += 4)
+                invalidate_decoded(address + k);
+    }
+    CURRENT_STATE = NEXT_STATE = *start;
+    RUN_BIT = TRUE;
+    LAST_EXCEPTION = NoError;
+}
+
+inline int is_syscall(uint32_t ins)
+{
+    return (ins & 0xfc00003f) == SYSCALL;
+}
+
+// execute at most limit instructions on the reference path, up to the end
+// of the basic block with block, and not the system call it would reach
+uint64_t reference_pass(uint64_t limit, int block)
+{
+    // the candidate counts these instructions: the profile goes to scratch,
+    // the taken branches are taken back
+    int64_t *profile = profile_delta;
+    static int64_t *scratch = NULL;
+    static uint32_t scratch_size = 0;
+    if (scratch_size != decoded_size)
+    {
+        free(scratch);
+        scratch = (int64_t *)calloc(decoded_size / 4 + 1, sizeof(int64_t));
+        scratch_size = decoded_size;
+    }
+    profile_delta = scratch;
+    cosim_silent = TRUE;
+    uint64_t n = 0;
+    while (n < limit && RUN_BIT && !(n && is_syscall(mem_peek_32(CURRENT_STATE.PC))))
+    {
+        uint32_t pc = CURRENT_STATE.PC;
+        const decoded_ins_t *d = step_decoded();
+        INSN_MIX.taken[d->opid] -= is_branch(d->opid) & (CURRENT_STATE.PC != pc + 4);
+        n++;
+        if (block && (d->handler == H_R_Jump || d->handler == H_R_SYSCALL || d->handler == H_J_Jump ||
+                      d->handler == H_I_Branch || d->handler == H_Unknown))
+            break;
+    }
+    cosim_silent = FALSE;
+    profile_delta = profile;
+    return n;
+}
+
+int same_result(const cosim_result_t *a, const cosim_result_t *b)
+{
+    return memcmp(&a->state, &b->state, sizeof(CPU_State)) == 0 && a->run_bit == b->run_bit &&
+           a->exception == b->exception && a->executed == b->executed && a->hash == b->hash &&
+           a->writes.size() == b->writes.size() &&
+           memcmp(a->writes.data(), b->writes.data(), a->writes.size() * sizeof(cosim_write_t)) == 0;
+}
+
+// run limit instructions on both engines from the current state into ref
+// and cand, leaving the machine after those of the candidate
+void compare_interval(uint64_t (*candidate)(uint64_t), uint64_t limit, int block, cosim_result_t *ref,
+                      cosim_result_t *cand)
+{
+    CPU_State start = CURRENT_STATE;
+    begin_pass();
+    end_pass(ref, reference_pass(limit, block));
+    rewind_to(&start);
+    begin_pass();
+    uint64_t done = 0;
+    if (candidate)
+        done = candidate(ref->executed);
+    else
+        for (; done < ref->executed && RUN_BIT; done++)
+            step_instruction();
+    end_pass(cand, done);
+}
+
+void print_difference(const char *what, uint32_t ref, uint32_t cand)
+{
+    if (ref != cand)
+        printf("\t%-10s: reference %08x, %s %08x\n", what, ref, ENGINE_NAMES[sim_engine], cand);
+}
+
+// report how cand differs from ref, which started at instruction count at
+// pc; the machine stops where it is
+void report_divergence(const cosim_result_t *ref, const cosim_result_t *cand, uint64_t count, uint32_t pc,
+                       int narrowed)
+{
+    const char *engine = ENGINE_NAMES[sim_engine];
+    alert_exception(mem_peek_32(CURRENT_STATE.PC), Divergence);
+    if (narrowed)
+    {
+        printf("@ Co-simulation : the %s engine diverges from the reference in instruction %llu :\n\t", engine,
+               (unsigned long long)count);
+        explain_instruction(CURRENT_STATE.PC, NoError, FALSE);
+    }
+    else
+        printf("@ Co-simulation : the %s engine diverges from the reference in the %llu instructions from %llu"
+               " (PC %08x), not one instruction at a time\n",
+               engine, (unsigned long long)ref->executed, (unsigned long long)count, pc);
+    if (ref->executed != cand->executed)
+        printf("\tinstructions : reference %llu, %s %llu\n", (unsigned long long)ref->executed, engine,
+               (unsigned long long)cand->executed);
+    print_difference("run bit", ref->run_bit, cand->run_bit);
+    print_difference("exception", ref->exception, cand->exception);
+    print_difference("PC", ref->state.PC, cand->state.PC);
+    for (int i = 0; i < MIPS_REGS; i++)
+    {
+        char name[8];
+        snprintf(name, sizeof(name), "$%d", i);
+        print_difference(name, ref->state.REGS[i], cand->state.REGS[i]);
+    }
+    print_difference("HI", ref->state.HI, cand->state.HI);
+    print_difference("LO", ref->state.LO, cand->state.LO);
+    if (ref->hash != cand->hash)
+        printf("\tpages     : reference hash %016llx, %s hash %016llx\n", (unsigned long long)ref->hash, engine,
+               (unsigned long long)cand->hash);
+    size_t n = std::max(ref->writes.size(), cand->writes.size());
+    for (size_t i = 0; i < n; i++)
+    {
+        const cosim_write_t *a = i < ref->writes.size() ? &ref->writes[i] : NULL;
+        const cosim_write_t *b = i < cand->writes.size() ? &cand->writes[i] : NULL;
+        if (a && b && a->address == b->address && a->value == b->value)
+            continue;
+        printf("\tstore %-4zu: reference ", i + 1);
+        a ? printf("[%08x] <- %08x", a->address, a->value) : printf("none");
+        printf(", %s ", engine);
+        b ? printf("[%08x] <- %08x\n", b->address, b->value) : printf("none\n");
+        break;
+    }
+}
+
+/*
+Procedure : run_cosim
+Purpose   : Execute at most max_ins instructions checking the candidate
+            engine (the reference path itself if NULL) against the
+            reference, return the number of instructions executed
+*/
+uint64_t run_cosim(uint64_t max_ins, uint64_t (*candidate)(uint64_t))
+{
+    if (cosim_page_serial == NULL)
+        cosim_page_serial = (uint32_t *)calloc(COSIM_PAGES, sizeof(uint32_t));
+    int block = cosim_interval == COSIM_BLOCK;
+    log_stores = block || cosim_interval == 1;
+    uint64_t done = 0;
+    cosim_result_t ref, cand;
+    while (done < max_ins && RUN_BIT)
+    {
+        if (is_syscall(mem_peek_32(CURRENT_STATE.PC)))
+        {
+            step_instruction();
+            done++;
+            continue;
+        }
+        CPU_State start = CURRENT_STATE;
+        uint64_t limit = block ? max_ins - done : std::min<uint64_t>(cosim_interval, max_ins - done);
+        compare_interval(candidate, limit, block, &ref, &cand);
+        if (same_result(&ref, &cand))
+        {
+            done += ref.executed;
+            continue;
+        }
+        // find the instruction: from the start again, one at a time
+        uint64_t count = INSTRUCTION_COUNT + done;
+        rewind_to(&start);
+        log_stores = TRUE;
+        cosim_result_t ref1, cand1;
+        for (uint64_t i = 0; i < ref.executed; i++)
+        {
+            CPU_State before = CURRENT_STATE;
+            compare_interval(candidate, 1, FALSE, &ref1, &cand1);
+            if (!same_result(&ref1, &cand1))
+            {
+                rewind_to(&before);
+                report_divergence(&ref1, &cand1, count + i, before.PC, TRUE);
+                return done + i;
+            }
+        }
+        // each instruction agrees: stop after them
+        report_divergence(&ref, &cand, count, start.PC, FALSE);
+        return done + ref.executed;
+    }
+    NEXT_STATE = CURRENT_STATE;
+    return done;
+}
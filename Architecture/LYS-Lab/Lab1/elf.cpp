@@ -0,0 +1,282 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   ELF32 program loader                                      */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <elf.h>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+An ELF32 MIPS executable is loaded by its program headers: each PT_LOAD
+segment is copied in bulk into the memory region holding its addresses
+(mem_load), the rest of it up to p_memsz (.bss) is zero-filled, and
+execution starts at e_entry. Files of either byte order are read; the
+simulated machine is little-endian, so the words of a big-endian file are
+swapped as they are loaded: instructions and words read as they were
+meant to, but the bytes within a word are then in little-endian order.
+
+The symbol table (.symtab) is kept to name addresses in diagnostics
+(print_symbol): exceptions, breakpoints and the profile; the assembler adds
+the labels of the programs it assembles (add_symbols).
+*/
+
+typedef struct
+{
+    uint32_t value, size;
+    uint32_t name; // offset in SYMBOL_NAMES
+} elf_symbol_t;
+
+thread_local elf_symbol_t *SYMBOLS = NULL;
+thread_local uint32_t NUM_SYMBOLS = 0;
+thread_local char *SYMBOL_NAMES = NULL;
+thread_local uint32_t SYMBOL_NAMES_SIZE = 0;
+
+typedef struct
+{
+    const uint8_t *image;
+    size_t size;
+    int big; // big-endian
+} elf_file_t;
+
+// the fields of the file, at offsets checked to lie in it
+uint32_t elf_word(const elf_file_t *f, size_t offset)
+{
+    const uint8_t *p = f->image + offset;
+    if (f->big)
+        return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+uint32_t elf_half(const elf_file_t *f, size_t offset)
+{
+    const uint8_t *p = f->image + offset;
+    return f->big ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+int elf_fits(const elf_file_t *f, uint64_t offset, uint64_t size)
+{
+    return offset <= f->size && size <= f->size - offset;
+}
+
+// the memory region holding [address, address + size), -1 if none
+int region_of(uint32_t address, uint32_t size)
+{
+    for (int i = 0; i < MEM_NREGIONS; i++)
+        if (address - MEM_REGIONS[i].start < MEM_REGIONS[i].size &&
+            size <= MEM_REGIONS[i].size - (address - MEM_REGIONS[i].start))
+            return i;
+    return -1;
+}
+
+/*
+Procedure : load_segment
+Purpose   : Load the segment of program header ph, return FALSE if it does
+            not fit; *text_end and *data_end are raised to the end of the
+            text and data it fills
+*/
+int load_segment(const elf_file_t *f, size_t ph, const char *filename, uint32_t *text_end, uint32_t *data_end)
+{
+    uint32_t offset = elf_word(f, ph + offsetof(Elf32_Phdr, p_offset));
+    uint32_t vaddr = elf_word(f, ph + offsetof(Elf32_Phdr, p_vaddr));
+    uint32_t filesz = elf_word(f, ph + offsetof(Elf32_Phdr, p_filesz));
+    uint32_t memsz = elf_word(f, ph + offsetof(Elf32_Phdr, p_memsz));
+    if (memsz == 0)
+        return TRUE;
+    // the words of a big-endian segment are swapped whole
+    uint32_t loaded = f->big ? (filesz + 3) & ~3u : filesz;
+    int region = region_of(vaddr, std::max(memsz, loaded));
+    if (filesz > memsz || !elf_fits(f, offset, filesz) || (f->big && (vaddr & 3)))
+    {
+        printf("@ Error: %s has a malformed segment at %08x\n", filename, vaddr);
+        return FALSE;
+    }
+    if (region < 0)
+    {
+        printf("@ Error: The segment %08x-%08x of %s is outside the memory regions (see --mem)\n", vaddr,
+               vaddr + memsz - 1, filename);
+        return FALSE;
+    }
+    if (f->big)
+    {
+        uint8_t *words = (uint8_t *)calloc(loaded ? loaded : 1, 1);
+        memcpy(words, f->image + offset, filesz);
+        for (uint32_t k = 0; k < loaded; k += 4)
+            std::swap(words[k], words[k + 3]), std::swap(words[k + 1], words[k + 2]);
+        mem_load(vaddr, words, loaded);
+        free(words);
+    }
+    else
+        mem_load(vaddr, f->image + offset, loaded);
+    if (memsz > loaded)
+        mem_load(vaddr + loaded, NULL, memsz - loaded);
+    if (region == REGION_TEXT)
+        *text_end = std::max(*text_end, vaddr + std::max(memsz, loaded));
+    else if (region == REGION_DATA)
+        *data_end = std::max(*data_end, vaddr + std::max(memsz, loaded));
+    return TRUE;
+}
+
+void sort_symbols()
+{
+    std::sort(SYMBOLS, SYMBOLS + NUM_SYMBOLS, [](const elf_symbol_t &a, const elf_symbol_t &b)
+              { return a.value != b.value ? a.value < b.value : a.size > b.size; });
+}
+
+// keep the named functions and objects of the symbol table section sh
+void read_symbols(const elf_file_t *f, size_t shoff, uint32_t shentsize, uint32_t shnum, size_t sh)
+{
+    uint32_t offset = elf_word(f, sh + offsetof(Elf32_Shdr, sh_offset));
+    uint32_t size = elf_word(f, sh + offsetof(Elf32_Shdr, sh_size));
+    uint32_t link = elf_word(f, sh + offsetof(Elf32_Shdr, sh_link));
+    if (link >= shnum)
+        return;
+    size_t strtab = shoff + (size_t)link * shentsize;
+    uint32_t str_offset = elf_word(f, strtab + offsetof(Elf32_Shdr, sh_offset));
+    uint32_t str_size = elf_word(f, strtab + offsetof(Elf32_Shdr, sh_size));
+    if (!elf_fits(f, offset, size) || !elf_fits(f, str_offset, str_size) || str_size == 0)
+        return;
+
+    // the names follow those of the programs loaded before, ending with a NUL
+    uint32_t base = SYMBOL_NAMES_SIZE;
+    SYMBOL_NAMES = (char *)realloc(SYMBOL_NAMES, base + str_size + 1);
+    memcpy(SYMBOL_NAMES + base, f->image + str_offset, str_size);
+    SYMBOL_NAMES[base + str_size] = 0;
+    SYMBOL_NAMES_SIZE += str_size + 1;
+    uint32_t num = size / sizeof(Elf32_Sym);
+    SYMBOLS = (elf_symbol_t *)realloc(SYMBOLS, (NUM_SYMBOLS + num) * sizeof(elf_symbol_t));
+    for (uint32_t i = 0; i < num; i++)
+    {
+        size_t sym = offset + (size_t)i * sizeof(Elf32_Sym);
+        uint32_t name = elf_word(f, sym + offsetof(Elf32_Sym, st_name));
+        uint32_t type = ELF32_ST_TYPE(f->image[sym + offsetof(Elf32_Sym, st_info)]);
+        uint32_t shndx = elf_half(f, sym + offsetof(Elf32_Sym, st_shndx));
+        if (name == 0 || name >= str_size || shndx == SHN_UNDEF ||
+            (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE))
+            continue;
+        elf_symbol_t *s = &SYMBOLS[NUM_SYMBOLS++];
+        s->value = elf_word(f, sym + offsetof(Elf32_Sym, st_value));
+        s->size = elf_word(f, sym + offsetof(Elf32_Sym, st_size));
+        s->name = base + name;
+    }
+    sort_symbols();
+}
+
+/*
+Procedure : load_elf
+Purpose   : Load the ELF32 MIPS executable image of size bytes, return
+            FALSE if it can't be; *entry is its entry point, *text_end and
+            *data_end the ends of the text and data it fills
+*/
+int load_elf(const char *filename, const uint8_t *image, size_t size, uint32_t *entry, uint32_t *text_end,
+             uint32_t *data_end)
+{
+    elf_file_t file = {image, size, FALSE}, *f = &file;
+    if (size < sizeof(Elf32_Ehdr) || image[EI_CLASS] != ELFCLASS32 ||
+        (image[EI_DATA] != ELFDATA2LSB && image[EI_DATA] != ELFDATA2MSB))
+    {
+        printf("@ Error: %s is not a 32-bit ELF file\n", filename);
+        return FALSE;
+    }
+    f->big = image[EI_DATA] == ELFDATA2MSB;
+    if (elf_half(f, offsetof(Elf32_Ehdr, e_machine)) != EM_MIPS ||
+        elf_half(f, offsetof(Elf32_Ehdr, e_type)) != ET_EXEC)
+    {
+        printf("@ Error: %s is not a MIPS executable\n", filename);
+        return FALSE;
+    }
+    uint32_t phoff = elf_word(f, offsetof(Elf32_Ehdr, e_phoff));
+    uint32_t phentsize = elf_half(f, offsetof(Elf32_Ehdr, e_phentsize));
+    uint32_t phnum = elf_half(f, offsetof(Elf32_Ehdr, e_phnum));
+    if (phentsize < sizeof(Elf32_Phdr) || !elf_fits(f, phoff, (uint64_t)phentsize * phnum))
+    {
+        printf("@ Error: %s has malformed program headers\n", filename);
+        return FALSE;
+    }
+    if (f->big)
+        printf("@ Warning: %s is big-endian, bytes within a word are loaded in little-endian order\n",
+               filename);
+    for (uint32_t i = 0; i < phnum; i++)
+    {
+        size_t ph = phoff + (size_t)i * phentsize;
+        if (elf_word(f, ph + offsetof(Elf32_Phdr, p_type)) == PT_LOAD && !load_segment(f, ph, filename, text_end, data_end))
+            return FALSE;
+    }
+    *entry = elf_word(f, offsetof(Elf32_Ehdr, e_entry));
+
+    // the symbols are only for diagnostics, a file without them loads all the same
+    uint32_t shoff = elf_word(f, offsetof(Elf32_Ehdr, e_shoff));
+    uint32_t shentsize = elf_half(f, offsetof(Elf32_Ehdr, e_shentsize));
+    uint32_t shnum = elf_half(f, offsetof(Elf32_Ehdr, e_shnum));
+    if (shoff == 0 || shentsize < sizeof(Elf32_Shdr) || !elf_fits(f, shoff, (uint64_t)shentsize * shnum))
+        return TRUE;
+    for (uint32_t i = 0; i < shnum; i++)
+    {
+        size_t sh = shoff + (size_t)i * shentsize;
+        if (elf_word(f, sh + offsetof(Elf32_Shdr, sh_type)) == SHT_SYMTAB)
+            read_symbols(f, shoff, shentsize, shnum, sh);
+    }
+    return TRUE;
+}
+
+/*
+Procedure : add_symbols
+Purpose   : Add num labels of the given names and values to the symbols
+*/
+void add_symbols(const char *const *names, const uint32_t *values, uint32_t num)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < num; i++)
+        size += strlen(names[i]) + 1;
+    SYMBOL_NAMES = (char *)realloc(SYMBOL_NAMES, SYMBOL_NAMES_SIZE + size);
+    SYMBOLS = (elf_symbol_t *)realloc(SYMBOLS, (NUM_SYMBOLS + num) * sizeof(elf_symbol_t));
+    for (uint32_t i = 0; i < num; i++)
+    {
+        elf_symbol_t *s = &SYMBOLS[NUM_SYMBOLS++];
+        s->value = values[i];
+        s->size = 0;
+        s->name = SYMBOL_NAMES_SIZE;
+        strcpy(SYMBOL_NAMES + SYMBOL_NAMES_SIZE, names[i]);
+        SYMBOL_NAMES_SIZE += strlen(names[i]) + 1;
+    }
+    sort_symbols();
+}
+
+/*
+Procedure : symbols_reset
+Purpose   : Forget the symbols of the programs loaded before
+*/
+void symbols_reset()
+{
+    free(SYMBOLS);
+    free(SYMBOL_NAMES);
+    SYMBOLS = NULL;
+    SYMBOL_NAMES = NULL;
+    NUM_SYMBOLS = SYMBOL_NAMES_SIZE = 0;
+}
+
+/*
+Procedure : print_symbol
+Purpose   : Print " <symbol+offset>" for the symbol address falls in,
+            nothing if there is none
+*/
+void print_symbol(uint32_t address)
+{
+    // the last symbol starting at or before address
+    const elf_symbol_t *s = std::upper_bound(SYMBOLS, SYMBOLS + NUM_SYMBOLS, address,
+                                             [](uint32_t a, const elf_symbol_t &b)
+                                             { return a < b.value; });
+    if (s == SYMBOLS)
+        return;
+    s--;
+    // a symbol with a size only covers it, a label the addresses up to the next one
+    if (s->size && address - s->value >= s->size)
+        return;
+    if (address == s->value)
+        printf(" <%s>", SYMBOL_NAMES + s->name);
+    else
+        printf(" <%s+0x%x>", SYMBOL_NAMES + s->name, address - s->value);
+}
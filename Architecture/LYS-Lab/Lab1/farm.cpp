@@ -0,0 +1,143 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   simulation farm                                           */
+/***************************************************************/
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "myshell.h"
+
+/*
+Every program file is simulated on its own machine, like sim --run would do.
+The machines live in thread_local state, a pool of threads takes the next
+unstarted program whenever one becomes idle, and the results are printed in
+the order the programs were given once all of them finished.
+*/
+
+typedef struct
+{
+    const char *program;
+    int status;            // EXIT_* of the simulation
+    uint32_t err;          // LAST_EXCEPTION
+    uint64_t instructions; // INSTRUCTION_COUNT
+    uint32_t pc, v0;       // final PC and $2
+    uint32_t exit_status;  // EXIT_STATUS, of exit2
+    uint32_t resident;     // pages of guest memory taking host memory
+    double seconds;
+} farm_job_t;
+
+const char *FARM_STATUS[] = {"halted", "error", "exception", "running"};
+
+// simulate the programs of jobs until none is left, with the memory layout given
+void farm_worker(farm_job_t *jobs, int num_jobs, std::atomic<int> *next,
+                 const mem_region_t *layout, uint64_t budget)
+{
+    for (int i; (i = (*next)++) < num_jobs;)
+    {
+        farm_job_t *job = &jobs[i];
+        double start = wall_time();
+        memcpy(MEM_REGIONS, layout, sizeof(MEM_REGIONS));
+        memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+        INSTRUCTION_COUNT = 0, INSTRUCTION_BUDGET = budget;
+        LAST_EXCEPTION = 0;
+        if (initialize((char **)&job->program, 1))
+        {
+            execute(UINT64_MAX);
+            job->status = LAST_EXCEPTION ? EXIT_EXCEPTION : RUN_BIT ? EXIT_RUNNING : EXIT_HALTED;
+        }
+        else
+            job->status = EXIT_ERROR;
+        job->err = LAST_EXCEPTION;
+        job->exit_status = EXIT_STATUS;
+        job->instructions = INSTRUCTION_COUNT;
+        job->pc = CURRENT_STATE.PC, job->v0 = CURRENT_STATE.REGS[2];
+        job->resident = job->status == EXIT_ERROR ? 0 : resident_pages(-1);
+        free_memory();
+        job->seconds = wall_time() - start;
+    }
+}
+
+/*
+Procedure : run_farm
+Purpose   : Simulate every program on num_threads threads (0: one per core),
+            print a summary and return 0 if all of them halted with status
+            0, else the exit status sim --run gives the first one which did not
+*/
+int run_farm(char *program_files[], int num_prog_files, int num_threads)
+{
+    // "@list" stands for the program files listed in list, one per line
+    std::vector<std::string> names;
+    for (int i = 0; i < num_prog_files; i++)
+    {
+        if (program_files[i][0] != '@')
+        {
+            names.push_back(program_files[i]);
+            continue;
+        }
+        FILE *list = fopen(program_files[i] + 1, "r");
+        if (list == NULL)
+        {
+            printf("@ Error: Can't open program list %s\n", program_files[i] + 1);
+            return EXIT_ERROR;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), list))
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0])
+                names.push_back(line);
+        }
+        fclose(list);
+    }
+
+    int num_jobs = names.size();
+    std::vector<farm_job_t> jobs(num_jobs);
+    for (int i = 0; i < num_jobs; i++)
+        jobs[i].program = names[i].c_str();
+    if (num_threads <= 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads > num_jobs)
+        num_threads = num_jobs;
+    if (num_threads <= 0)
+        num_threads = 1;
+
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    double start = wall_time();
+    for (int t = 0; t < num_threads; t++)
+        pool.push_back(std::thread(farm_worker, jobs.data(), num_jobs, &next,
+                                   MEM_REGIONS, INSTRUCTION_BUDGET));
+    for (int t = 0; t < num_threads; t++)
+        pool[t].join();
+    double elapsed = wall_time() - start;
+
+    int status = EXIT_HALTED;
+    uint64_t total = 0;
+    printf("@ Farm summary :\n");
+    printf("-------------------------------------\n");
+    printf("status    instructions         PC       $v0      err      seconds  MIPS     KiB      program\n");
+    for (int i = 0; i < num_jobs; i++)
+    {
+        farm_job_t *job = &jobs[i];
+        double mips = job->seconds > 0 ? job->instructions / job->seconds * 1e-6 : 0;
+        // halted with a status other than 0 by exit2
+        int failed = job->status == EXIT_HALTED && job->exit_status;
+        char exited[16];
+        snprintf(exited, sizeof(exited), "exit %u", job->exit_status & 0xff);
+        printf("%-9s %-20llu %08x %08x %08x %8.3f %8.2f %-8u %s\n", failed ? exited : FARM_STATUS[job->status],
+               (unsigned long long)job->instructions, job->pc, job->v0, job->err,
+               job->seconds, mips, job->resident * (MEM_PAGE_SIZE >> 10), job->program);
+        total += job->instructions;
+        if (status == EXIT_HALTED)
+            status = failed ? job->exit_status & 0xff : job->status;
+    }
+    printf("-------------------------------------\n");
+    printf("@ %d programs on %d threads: %llu instructions in %.3f s (%.2f MIPS, %s engine)\n",
+           num_jobs, num_threads, (unsigned long long)total, elapsed,
+           total / elapsed * 1e-6, ENGINE_NAMES[sim_engine]);
+    return status;
+}
@@ -0,0 +1,778 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   basic block JIT compiler to x86-64                        */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <sys/mman.h>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+Hot basic blocks of the text segment are translated into x86-64 code that
+works directly on CURRENT_STATE. A block runs from its entry up to and
+including the first branch/jump (or up to an instruction the JIT leaves to
+the interpreter, e.g. SYSCALL). Exits to statically known targets are
+patched into direct jumps once the target block is compiled, so hot loops
+run from block to block without returning to run_jit.
+
+Register usage of generated code:
+    rbx: &CURRENT_STATE, rbp: &jit_ctx,
+    eax/ecx/edx/esi/edi: scratch, eax holds the next PC when leaving.
+Any instruction that may raise an exception is checked first, and on failure
+the block exits to the interpreter right before it, which then executes it
+(and alerts) exactly as process_instruction does.
+A block counts its executions in a counter of its own, which jit_collect
+adds to the execution counts (profile_delta) as runs, and the exits leaving
+before its end take the instructions not executed back at once; the code
+then holds the address of profile_delta, which profile_reset discards
+together with the code. A taken conditional branch also counts itself in
+the instruction mix on the way to its target.
+*/
+
+#if defined(__x86_64__)
+
+#define JIT_CACHE_SIZE (32 << 20) // bytes of generated code
+#define JIT_MAX_BLOCK 64          // instructions per block
+#define JIT_MAX_BLOCK_CODE 16384  // upper bound of the code of one block
+#define JIT_MAX_COUNTERS (1 << 18) // compiled blocks between flushes
+#define JIT_HOT 16                // executions before a block is compiled
+#define JIT_NOCODE ((uint8_t *)1) // block map entry: leave to the interpreter
+#define JIT_DYNAMIC_PC 0xffffffff // exit PC: eax already holds the computed target
+
+// how an exit leaves the generated code (exit_site for non-chainable exits)
+typedef enum
+{
+    EXIT_CHAIN,              // may be patched into a jump to the block at its PC
+    EXIT_PLAIN = -1,         // continue at its PC
+    EXIT_INTERPRET = -2      // interpret the instruction at its PC
+} exit_kind_t;
+
+// state shared with generated code through rbp
+typedef struct
+{
+    int64_t budget;    // instructions left to execute
+    int32_t exit_site; // offset of the jump which left the code, or an exit_kind_t
+    uint8_t flush;     // text holding compiled code was written
+    uint8_t watch;     // a load or store hit a watchpoint, right after flush
+} jit_ctx_t;
+#define CTX_BUDGET offsetof(jit_ctx_t, budget)
+#define CTX_EXIT_SITE offsetof(jit_ctx_t, exit_site)
+#define CTX_FLUSH offsetof(jit_ctx_t, flush)
+#define CTX_WATCH offsetof(jit_ctx_t, watch)
+static_assert(CTX_WATCH == CTX_FLUSH + 1, "stores test flush and watch as one word");
+#define STATE_REG(r) (offsetof(CPU_State, REGS) + 4 * (r))
+#define STATE_HI offsetof(CPU_State, HI)
+#define STATE_LO offsetof(CPU_State, LO)
+
+// x86 registers
+enum
+{
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+    ESI = 6,
+    EDI = 7
+};
+
+// each thread compiles into a code cache of its own
+thread_local jit_ctx_t jit_ctx;
+thread_local uint8_t *jit_cache = NULL, *jit_ptr = NULL, *jit_code_start = NULL;
+thread_local uint32_t (*jit_enter)(CPU_State *, jit_ctx_t *, uint8_t *) = NULL;
+thread_local uint8_t *jit_epilogue = NULL;
+// per text word: compiled block and hotness, per text page: holds compiled code
+thread_local uint8_t **jit_blocks = NULL;
+thread_local uint8_t *jit_hot = NULL, *jit_pages = NULL;
+thread_local uint32_t jit_start = 0, jit_size = 0;
+thread_local uint32_t jit_flushes = 0;
+// executions of the blocks compiled since the last flush, not yet collected
+typedef struct
+{
+    uint64_t executions;
+    uint32_t pc, n;
+} jit_counter_t;
+thread_local jit_counter_t *jit_counters = NULL;
+thread_local uint32_t jit_ncounters = 0;
+thread_local int jit_unavailable = FALSE;
+
+/*emit x86-64 code*/
+inline void emit8(uint32_t b) { *jit_ptr++ = b; }
+inline void emit32(uint32_t w)
+{
+    memcpy(jit_ptr, &w, 4);
+    jit_ptr += 4;
+}
+inline void emit64(uint64_t w)
+{
+    memcpy(jit_ptr, &w, 8);
+    jit_ptr += 8;
+}
+// point the rel32 field at site to target
+inline void patch_rel32(uint8_t *site, uint8_t *target)
+{
+    int32_t rel = target - (site + 4);
+    memcpy(site, &rel, 4);
+}
+// op reg, [rbx + disp32]
+inline void emit_state_op(uint32_t op, uint32_t reg, uint32_t disp)
+{
+    emit8(op);
+    emit8(0x80 | (reg << 3) | 3);
+    emit32(disp);
+}
+// reg <- guest register r
+inline void emit_load(uint32_t reg, uint32_t r)
+{
+    if (r == 0)
+    {
+        emit8(0x31); // xor reg, reg
+        emit8(0xC0 | (reg << 3) | reg);
+    }
+    else
+        emit_state_op(0x8B, reg, STATE_REG(r));
+}
+// guest register r <- reg
+inline void emit_store(uint32_t r, uint32_t reg) { emit_state_op(0x89, reg, STATE_REG(r)); }
+// guest register r <- imm
+inline void emit_store_imm(uint32_t r, uint32_t imm)
+{
+    emit_state_op(0xC7, 0, STATE_REG(r));
+    emit32(imm);
+}
+// op dst, src (both 32-bit registers)
+inline void emit_rr(uint32_t op, uint32_t dst, uint32_t src)
+{
+    emit8(op);
+    emit8(0xC0 | (src << 3) | dst);
+}
+// group-1 op (/ext) reg, imm32
+inline void emit_ri(uint32_t ext, uint32_t reg, uint32_t imm)
+{
+    emit8(0x81);
+    emit8(0xC0 | (ext << 3) | reg);
+    emit32(imm);
+}
+// shift (/ext) reg by imm8, or by cl if count < 0
+inline void emit_shift(uint32_t ext, uint32_t reg, int count)
+{
+    emit8(count < 0 ? 0xD3 : 0xC1);
+    emit8(0xC0 | (ext << 3) | reg);
+    if (count >= 0)
+        emit8(count);
+}
+// eax <- (flags satisfy cc) ? 1 : 0
+inline void emit_setcc(uint32_t cc)
+{
+    emit8(0x0F), emit8(0x90 | cc), emit8(0xC0); // setcc al
+    emit8(0x0F), emit8(0xB6), emit8(0xC0);      // movzx eax, al
+}
+// call a C function
+inline void emit_call(void *func)
+{
+    emit8(0x48), emit8(0xB8), emit64((uint64_t)func); // mov rax, imm64
+    emit8(0xFF), emit8(0xD0);                         // call rax
+}
+// jcc rel32 / jmp rel32, return the rel32 field to patch
+inline uint8_t *emit_jcc(uint32_t cc)
+{
+    emit8(0x0F), emit8(0x80 | cc), emit32(0);
+    return jit_ptr - 4;
+}
+inline uint8_t *emit_jmp()
+{
+    emit8(0xE9), emit32(0);
+    return jit_ptr - 4;
+}
+// x86 condition codes
+enum
+{
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_S = 0x8,
+    CC_NS = 0x9,
+    CC_L = 0xC,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+/*helpers called by generated code*/
+uint32_t jit_lb(uint32_t address)
+{
+    return extend_sign_8((mem_read_part(address, 1) >> (8 * (address & 003))) & 0xff);
+}
+uint32_t jit_lbu(uint32_t address)
+{
+    return (mem_read_part(address, 1) >> (8 * (address & 003))) & 0xff;
+}
+uint32_t jit_lh(uint32_t address)
+{
+    return extend_sign_16((mem_read_part(address, 2) >> (8 * (address & 002))) & 0xffff);
+}
+uint32_t jit_lhu(uint32_t address)
+{
+    return (mem_read_part(address, 2) >> (8 * (address & 002))) & 0xffff;
+}
+void jit_sb(uint32_t address, uint32_t value)
+{
+    uint32_t shift = 8 * (address & 003);
+    uint32_t word = mem_read_32(address & ~3) & ~(0xffu << shift);
+    mem_write_32(address & ~3, word | ((value & 0xff) << shift));
+}
+void jit_sh(uint32_t address, uint32_t value)
+{
+    uint32_t shift = 8 * (address & 002);
+    uint32_t word = mem_read_32(address & ~3) & ~(0xffffu << shift);
+    mem_write_32(address & ~3, word | ((value & 0xffff) << shift));
+}
+
+/*
+Walk the page table for the guest address in edi: rcx <- the host page, eax <-
+the offset in it. Returns the jz to patch to the slow path, taken for pages
+not in the table (unmapped, watched or partially covered by a region), which
+the C helpers handle; edi and esi are left as their arguments.
+*/
+uint8_t *emit_page_walk()
+{
+    emit_rr(0x89, EAX, EDI);                                // mov eax, edi
+    emit_shift(5, EAX, 22);                                 // shr eax, 22
+    emit8(0x48), emit8(0xB9), emit64((uint64_t)PAGE_TABLE); // mov rcx, imm64
+    emit8(0x48), emit8(0x8B), emit8(0x0C), emit8(0xC1);     // mov rcx, [rcx+rax*8]
+    emit_rr(0x89, EAX, EDI);
+    emit_shift(5, EAX, MEM_PAGE_SHIFT);
+    emit_ri(4, EAX, PT_ENTRIES - 1);                        // and eax, PT_ENTRIES - 1
+    emit8(0x48), emit8(0x8B), emit8(0x0C), emit8(0xC1);     // mov rcx, [rcx+rax*8]
+    emit8(0x48), emit8(0x85), emit8(0xC9);                  // test rcx, rcx
+    uint8_t *slow = emit_jcc(CC_E);
+    emit_rr(0x89, EAX, EDI);
+    emit_ri(4, EAX, MEM_PAGE_MASK);                         // and eax, MEM_PAGE_MASK
+    return slow;
+}
+
+/*block exits*/
+// profile_delta[pc] += add, profile_delta[pc + 4 * words] -= add
+void emit_profile_run(uint32_t pc, uint32_t words, int add)
+{
+    emit8(0x48), emit8(0xB8), emit64((uint64_t)&profile_delta[(pc - jit_start) >> 2]); // mov rax, imm64
+    emit8(0x48), emit8(0xFF), emit8(add > 0 ? 0x00 : 0x08);                            // inc/dec qword [rax]
+    emit8(0x48), emit8(0xFF), emit8(add > 0 ? 0x88 : 0x80), emit32(8 * words);         // dec/inc qword [rax + disp32]
+}
+
+// exits emitted after the body of a block
+typedef struct
+{
+    uint8_t *site;   // rel32 jumping to the exit
+    uint32_t pc;     // PC to continue at
+    int32_t refund;  // instructions of the block not executed
+    int kind;        // exit_kind_t
+} jit_exit_t;
+thread_local jit_exit_t jit_exits[4 * JIT_MAX_BLOCK + 4];
+thread_local int jit_nexits;
+
+inline void add_exit(uint8_t *site, uint32_t pc, int32_t refund, int kind)
+{
+    jit_exits[jit_nexits++] = {site, pc, refund, kind};
+}
+void emit_exits()
+{
+    for (int i = 0; i < jit_nexits; i++)
+    {
+        jit_exit_t *e = &jit_exits[i];
+        patch_rel32(e->site, jit_ptr);
+        // the refunded instructions are the last ones of the block, from the exit PC on
+        if (e->refund)
+            emit_profile_run(e->pc, e->refund, -1);
+        if (e->refund)
+        {
+            emit8(0x48), emit8(0x81), emit8(0x45), emit8(CTX_BUDGET); // add qword [rbp+budget], imm32
+            emit32(e->refund);
+        }
+        emit8(0xC7), emit8(0x45), emit8(CTX_EXIT_SITE); // mov dword [rbp+exit_site], imm32
+        emit32(e->kind == EXIT_CHAIN ? (uint32_t)(e->site - jit_cache) : (uint32_t)e->kind);
+        if (e->pc != JIT_DYNAMIC_PC)
+            emit8(0xB8), emit32(e->pc); // mov eax, pc
+        patch_rel32(emit_jmp(), jit_epilogue);
+    }
+}
+
+/*compile*/
+inline int jit_supported(uint32_t opid)
+{
+    return opid != OP_UNDECODED && opid != OP_UNKNOWN && opid != OP_SYSCALL;
+}
+inline int jit_ends_block(uint32_t opid)
+{
+    return (OP_JR <= opid && opid <= OP_JALR) || (OP_J <= opid && opid <= OP_BGTZ);
+}
+// emit one instruction at pc, the idx-th of a block of n; return whether it writes $0
+int emit_instruction(const decoded_ins_t *d, uint32_t pc, int idx, int n)
+{
+    uint32_t rs = d->rs, rt = d->rt, rd = d->rd, imm = d->imm;
+    uint32_t write = 32; // guest register written
+    switch (d->opid)
+    {
+    case OP_SLL:
+    case OP_SRL:
+    case OP_SRA:
+        emit_load(EAX, rt);
+        emit_shift(d->opid == OP_SLL ? 4 : 5, EAX, d->shamt);
+        if (d->opid == OP_SRA)
+            goto sign_16;
+        goto store_rd;
+    case OP_SLLV:
+    case OP_SRLV:
+    case OP_SRAV:
+        emit_load(EAX, rt);
+        emit_load(ECX, rs);
+        emit_shift(d->opid == OP_SLLV ? 4 : 5, EAX, -1);
+        if (d->opid == OP_SRAV)
+            goto sign_16;
+        goto store_rd;
+    sign_16:
+        // eax |= (eax & 0x8000) ? 0xffff0000 : 0, as extend_sign_16
+        emit_rr(0x89, ECX, EAX);
+        emit_shift(4, ECX, 16);
+        emit_shift(7, ECX, 31);
+        emit_ri(4, ECX, 0xffff0000);
+        emit_rr(0x09, EAX, ECX);
+        goto store_rd;
+    case OP_JR:
+        emit_load(EAX, rs);
+        emit8(0xA8), emit8(003); // test al, 3
+        add_exit(emit_jcc(CC_NE), pc, n - idx, EXIT_INTERPRET);
+        add_exit(emit_jmp(), JIT_DYNAMIC_PC, 0, EXIT_PLAIN);
+        break;
+    case OP_JALR:
+        emit_load(EAX, rs);
+        emit_store_imm(rd, pc + 4);
+        write = rd;
+        add_exit(emit_jmp(), JIT_DYNAMIC_PC, 0, EXIT_PLAIN);
+        break;
+    case OP_MFHI:
+    case OP_MFLO:
+        emit_state_op(0x8B, EAX, d->opid == OP_MFHI ? STATE_HI : STATE_LO);
+        goto store_rd;
+    case OP_MTHI:
+    case OP_MTLO:
+        emit_load(EAX, rs);
+        emit_state_op(0x89, EAX, d->opid == OP_MTHI ? STATE_HI : STATE_LO);
+        break;
+    case OP_MULT:
+    case OP_MULTU:
+    case OP_DIV:
+    case OP_DIVU:
+    {
+        static const uint8_t ext[] = {5, 4, 7, 6}; // imul, mul, idiv, div
+        emit_load(EAX, rs);
+        if (d->opid == OP_DIV)
+            emit8(0x99); // cdq
+        else if (d->opid == OP_DIVU)
+            emit_rr(0x31, EDX, EDX);
+        emit_state_op(0xF7, ext[d->opid - OP_MULT], STATE_REG(rt));
+        // edx: high word or remainder, eax: low word or quotient
+        emit_state_op(0x89, EDX, STATE_HI);
+        emit_state_op(0x89, EAX, STATE_LO);
+        break;
+    }
+    case OP_ADD:
+    case OP_ADDU:
+    case OP_SUB:
+    case OP_SUBU:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_NOR:
+    {
+        static const uint8_t ops[] = {0x01, 0x01, 0x29, 0x29, 0x21, 0x09, 0x31, 0x09};
+        emit_load(EAX, rs);
+        emit_load(ECX, rt);
+        emit_rr(ops[d->opid - OP_ADD], EAX, ECX);
+        if (d->opid == OP_NOR)
+            emit8(0xF7), emit8(0xD0); // not eax
+        goto store_rd;
+    }
+    case OP_SLT:
+    case OP_SLTU:
+        emit_load(EAX, rs);
+        emit_load(ECX, rt);
+        emit_rr(0x39, EAX, ECX);
+        emit_setcc(d->opid == OP_SLT ? CC_L : CC_B);
+        goto store_rd;
+    store_rd:
+        emit_store(rd, EAX);
+        write = rd;
+        break;
+    case OP_J:
+    case OP_JAL:
+        if (d->opid == OP_JAL)
+            emit_store_imm(31, pc + 4);
+        add_exit(emit_jmp(), (pc & 0xf0000000) | imm, 0, EXIT_CHAIN);
+        break;
+    case OP_BLTZ:
+    case OP_BGEZ:
+    case OP_BLTZAL:
+    case OP_BGEZAL:
+    case OP_BLEZ:
+    case OP_BGTZ:
+    case OP_BEQ:
+    case OP_BNE:
+    {
+        uint32_t cc;
+        emit_load(EAX, rs);
+        if (d->opid == OP_BEQ || d->opid == OP_BNE)
+        {
+            emit_load(ECX, rt);
+            emit_rr(0x39, EAX, ECX);
+            cc = d->opid == OP_BEQ ? CC_E : CC_NE;
+        }
+        else
+        {
+            emit_rr(0x85, EAX, EAX); // test eax, eax
+            if (d->opid == OP_BLEZ)
+                cc = CC_LE;
+            else if (d->opid == OP_BGTZ)
+                cc = CC_G;
+            else
+                cc = (d->opid == OP_BLTZ || d->opid == OP_BLTZAL) ? CC_S : CC_NS;
+        }
+        // linking does not change the flags of the condition
+        if (d->opid == OP_BLTZAL || d->opid == OP_BGEZAL)
+            emit_store_imm(31, pc + 4);
+        // taken: INSN_MIX.taken[opid]++ on the way to the target, unless it is the fall-through
+        if (imm != 0)
+        {
+            emit8(0x70 | (cc ^ 1)), emit8(18);                                     // jncc to the fall-through
+            emit8(0x48), emit8(0xB8), emit64((uint64_t)&INSN_MIX.taken[d->opid]); // mov rax, imm64
+            emit8(0x48), emit8(0xFF), emit8(0x00);                                 // inc qword [rax]
+            add_exit(emit_jmp(), pc + 4 + imm * 4, 0, EXIT_CHAIN);
+        }
+        else
+            add_exit(emit_jcc(cc), pc + 4 + imm * 4, 0, EXIT_CHAIN);
+        add_exit(emit_jmp(), pc + 4, 0, EXIT_CHAIN);
+        break;
+    }
+    case OP_ADDI:
+    case OP_ADDIU:
+    case OP_ANDI:
+    case OP_ORI:
+    case OP_XORI:
+        emit_load(EAX, rs);
+        emit_ri(d->opid <= OP_ADDIU ? 0 : d->opid == OP_ANDI ? 4 : d->opid == OP_ORI ? 1 : 6, EAX, imm);
+        goto store_rt;
+    case OP_SLTI:
+    case OP_SLTIU:
+        emit_load(EAX, rs);
+        emit_ri(7, EAX, imm); // cmp eax, imm
+        emit_setcc(d->opid == OP_SLTI ? CC_L : CC_B);
+        goto store_rt;
+    case OP_LUI:
+        emit_store_imm(rt, imm << 16);
+        write = rt;
+        break;
+    case OP_LB:
+    case OP_LBU:
+    case OP_LH:
+    case OP_LHU:
+    case OP_LW:
+    {
+        static void *const loads[] = {(void *)jit_lb, (void *)jit_lh, (void *)mem_read_32,
+                                      (void *)jit_lbu, (void *)jit_lhu};
+        uint32_t align = d->opid == OP_LW ? 003 : (d->opid == OP_LH || d->opid == OP_LHU) ? 001 : 0;
+        emit_load(EDI, rs);
+        emit_ri(0, EDI, imm);
+        if (align)
+        {
+            emit8(0xF7), emit8(0xC7), emit32(align); // test edi, align
+            add_exit(emit_jcc(CC_NE), pc, n - idx, EXIT_INTERPRET);
+        }
+        // [rcx+rax] with the width and extension of the load
+        static const uint8_t access[][4] = {{0x0F, 0xBE, 0x04, 0x01}, {0x0F, 0xBF, 0x04, 0x01},
+                                            {0x8B, 0x04, 0x01}, {0x0F, 0xB6, 0x04, 0x01},
+                                            {0x0F, 0xB7, 0x04, 0x01}};
+        const uint8_t *op = access[d->opid - OP_LB];
+        uint8_t *slow = emit_page_walk();
+        for (int k = 0; k < (d->opid == OP_LW ? 3 : 4); k++)
+            emit8(op[k]);
+        uint8_t *done = emit_jmp();
+        patch_rel32(slow, jit_ptr);
+        emit_call(loads[d->opid - OP_LB]);
+        patch_rel32(done, jit_ptr);
+        emit_store(rt, EAX);
+        write = rt;
+        // only code compiled while there are watches checks its loads
+        if (watch_model)
+        {
+            emit8(0x80), emit8(0x7D), emit8(CTX_WATCH), emit8(0); // cmp byte [rbp+watch], 0
+            add_exit(emit_jcc(CC_NE), pc + 4, n - idx - 1, EXIT_PLAIN);
+        }
+        break;
+    }
+    case OP_SB:
+    case OP_SH:
+    case OP_SW:
+    {
+        static void *const stores[] = {(void *)jit_sb, (void *)jit_sh, (void *)mem_write_32};
+        uint32_t align = d->opid == OP_SW ? 003 : d->opid == OP_SH ? 001 : 0;
+        emit_load(EDI, rs);
+        emit_ri(0, EDI, imm);
+        if (align)
+        {
+            emit8(0xF7), emit8(0xC7), emit32(align);
+            add_exit(emit_jcc(CC_NE), pc, n - idx, EXIT_INTERPRET);
+        }
+        emit_load(ESI, rt);
+        // stores to the text segment invalidate decoded code, and co-simulation
+        // records every store: both are left to mem_write_32
+        uint8_t *text = NULL, *slow = NULL, *done = NULL;
+        if (!cosim_model)
+        {
+            mem_region_t *region = &MEM_REGIONS[REGION_TEXT];
+            emit_rr(0x89, EAX, EDI);
+            emit_ri(5, EAX, region->start - 3); // sub eax, start - 3
+            emit_ri(7, EAX, region->size + 3);  // cmp eax, size + 3
+            text = emit_jcc(CC_B);
+            slow = emit_page_walk();
+            if (d->opid == OP_SH)
+                emit8(0x66);
+            else if (d->opid == OP_SB)
+                emit8(0x40);
+            emit8(d->opid == OP_SB ? 0x88 : 0x89), emit8(0x34), emit8(0x01); // mov [rcx+rax], esi/si/sil
+            done = emit_jmp();
+            patch_rel32(text, jit_ptr), patch_rel32(slow, jit_ptr);
+        }
+        emit_call(stores[d->opid - OP_SB]);
+        // the store hit compiled code or a watchpoint: leave before running stale code
+        emit8(0x66), emit8(0x83), emit8(0x7D), emit8(CTX_FLUSH), emit8(0); // cmp word [rbp+flush], 0
+        add_exit(emit_jcc(CC_NE), pc + 4, n - idx - 1, EXIT_PLAIN);
+        if (done != NULL)
+            patch_rel32(done, jit_ptr);
+        break;
+    }
+    store_rt:
+        emit_store(rt, EAX);
+        write = rt;
+        break;
+    }
+    return write == 0;
+}
+
+// discard all generated code
+void jit_flush()
+{
+    jit_collect();
+    jit_ncounters = 0;
+    jit_ptr = jit_code_start;
+    memset(jit_blocks, 0, (jit_size / 4) * sizeof(uint8_t *));
+    memset(jit_hot, 0, jit_size / 4);
+    memset(jit_pages, 0, (jit_size >> MEM_PAGE_SHIFT) + 1);
+    jit_ctx.flush = FALSE;
+    jit_flushes++;
+}
+
+// compile the block starting at pc (in the text segment)
+uint8_t *jit_compile(uint32_t pc)
+{
+    const decoded_ins_t *block[JIT_MAX_BLOCK];
+    int n = 0, ends = FALSE;
+    for (uint32_t offset = pc - jit_start; n < JIT_MAX_BLOCK && offset < jit_size; offset += 4)
+    {
+        decoded_ins_t *d = &decoded_text[offset >> 2];
+        if (d->opid == OP_UNDECODED)
+            decode_text(jit_start + offset, d);
+        if (!jit_supported(d->opid))
+            break;
+        block[n++] = d;
+        if ((ends = jit_ends_block(d->opid)))
+            break;
+    }
+    if (n == 0)
+        return JIT_NOCODE;
+    if (jit_ptr + JIT_MAX_BLOCK_CODE > jit_cache + JIT_CACHE_SIZE || jit_ncounters == JIT_MAX_COUNTERS)
+        jit_flush();
+
+    uint8_t *code = jit_ptr;
+    jit_nexits = 0;
+    // counters live apart from the code, writing next to running code would be slow
+    jit_counter_t *counter = &jit_counters[jit_ncounters++];
+    *counter = {0, pc, (uint32_t)n};
+    emit8(0x48), emit8(0xB8), emit64((uint64_t)&counter->executions); // mov rax, imm64
+    emit8(0x48), emit8(0xFF), emit8(0x00);                            // inc qword [rax]
+    // budget -= n, interpret instead if it was not enough for the whole block
+    emit8(0x48), emit8(0x81), emit8(0x6D), emit8(CTX_BUDGET), emit32(n);
+    add_exit(emit_jcc(CC_L), pc, n, EXIT_INTERPRET);
+    // $0 is cleared before every instruction following one which wrote it
+    int dirty = TRUE;
+    for (int i = 0; i < n; i++)
+    {
+        if (dirty)
+            emit_store_imm(0, 0);
+        dirty = emit_instruction(block[i], pc + 4 * i, i, n);
+    }
+    if (!ends)
+        add_exit(emit_jmp(), pc + 4 * n, 0, EXIT_CHAIN);
+    emit_exits();
+
+    for (uint32_t offset = pc - jit_start; offset < pc - jit_start + 4 * n; offset += MEM_PAGE_SIZE)
+        jit_pages[offset >> MEM_PAGE_SHIFT] = TRUE;
+    jit_pages[(pc - jit_start + 4 * n - 1) >> MEM_PAGE_SHIFT] = TRUE;
+    return code;
+}
+
+// set up the code cache and the block map of the current text segment
+int jit_init()
+{
+    if (jit_unavailable)
+        return FALSE;
+    if (jit_cache == NULL)
+    {
+        void *mem = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            printf("@ JIT unavailable (no executable memory), using the threaded engine\n");
+            jit_unavailable = TRUE;
+            return FALSE;
+        }
+        jit_cache = jit_ptr = (uint8_t *)mem;
+        // entry: save rbx/rbp, keep the stack 16-byte aligned for calls, jump to the block
+        jit_enter = (uint32_t(*)(CPU_State *, jit_ctx_t *, uint8_t *))jit_ptr;
+        emit8(0x53), emit8(0x55);                           // push rbx; push rbp
+        emit8(0x48), emit8(0x83), emit8(0xEC), emit8(0x08); // sub rsp, 8
+        emit8(0x48), emit8(0x89), emit8(0xFB);              // mov rbx, rdi
+        emit8(0x48), emit8(0x89), emit8(0xF5);              // mov rbp, rsi
+        emit8(0xFF), emit8(0xE2);                           // jmp rdx
+        // epilogue: CURRENT_STATE.PC <- eax, return eax
+        jit_epilogue = jit_ptr;
+        emit8(0x89), emit8(0x03);                           // mov [rbx], eax
+        emit8(0x48), emit8(0x83), emit8(0xC4), emit8(0x08); // add rsp, 8
+        emit8(0x5D), emit8(0x5B), emit8(0xC3);              // pop rbp; pop rbx; ret
+        jit_code_start = jit_ptr;
+        jit_counters = (jit_counter_t *)calloc(JIT_MAX_COUNTERS, sizeof(jit_counter_t));
+    }
+    if (jit_blocks == NULL)
+    {
+        jit_start = decoded_start, jit_size = decoded_size;
+        jit_blocks = (uint8_t **)calloc(jit_size / 4, sizeof(uint8_t *));
+        jit_hot = (uint8_t *)calloc(jit_size / 4, 1);
+        jit_pages = (uint8_t *)calloc((jit_size >> MEM_PAGE_SHIFT) + 1, 1);
+        jit_ptr = jit_code_start;
+        jit_ncounters = 0;
+        jit_ctx.flush = FALSE;
+    }
+    return TRUE;
+}
+
+/*
+Procedure : jit_collect
+Purpose   : Add the executions the compiled blocks counted to profile_delta
+*/
+void jit_collect()
+{
+    for (uint32_t i = 0; i < jit_ncounters; i++)
+    {
+        jit_counter_t *c = &jit_counters[i];
+        profile_delta[(c->pc - jit_start) >> 2] += c->executions;
+        profile_delta[((c->pc - jit_start) >> 2) + c->n] -= c->executions;
+        c->executions = 0;
+    }
+}
+
+/*
+Procedure : jit_reset
+Purpose   : Drop all generated code, e.g. when the text segment is replaced
+*/
+void jit_reset()
+{
+    // the counts of the blocks were collected before the text segment changed
+    free(jit_blocks), free(jit_hot), free(jit_pages);
+    jit_blocks = NULL, jit_hot = jit_pages = NULL;
+    jit_ncounters = 0;
+}
+
+/*
+Procedure : jit_invalidate
+Purpose   : Called for every write to the text segment
+*/
+void jit_invalidate(uint32_t address)
+{
+    uint32_t offset = address - jit_start;
+    if (jit_pages != NULL && offset < jit_size && jit_pages[offset >> MEM_PAGE_SHIFT])
+        jit_ctx.flush = TRUE;
+}
+
+/*
+Procedure : jit_watch
+Purpose   : Make generated code leave after the load or store being executed
+            (hit), or go on
+*/
+void jit_watch(int hit)
+{
+    jit_ctx.watch = hit;
+}
+
+/*
+Procedure : jit_recompile
+Purpose   : Drop all generated code before it next runs, e.g. when watches change
+*/
+void jit_recompile()
+{
+    jit_ctx.flush = TRUE;
+}
+
+/*
+Procedure : run_jit
+Purpose   : Execute at most max_ins instructions or until halted,
+            return the number of instructions executed
+*/
+uint64_t run_jit(uint64_t max_ins)
+{
+    if (RUN_BIT == FALSE)
+        return 0;
+    if (!jit_init())
+        return run_threaded(max_ins);
+    int64_t budget = max_ins > INT64_MAX ? INT64_MAX : max_ins;
+    int32_t pending_site = EXIT_PLAIN;
+    jit_ctx.budget = budget;
+    jit_ctx.watch = FALSE;
+    while (RUN_BIT && jit_ctx.budget > 0)
+    {
+        uint32_t flushes = jit_flushes;
+        if (jit_ctx.flush)
+            jit_flush();
+        uint32_t pc = CURRENT_STATE.PC, offset = pc - jit_start;
+        uint8_t *code = NULL;
+        if (pending_site != EXIT_INTERPRET && offset < jit_size && (offset & 003) == 0)
+        {
+            code = jit_blocks[offset >> 2];
+            if (code == NULL && ++jit_hot[offset >> 2] >= JIT_HOT)
+                code = jit_blocks[offset >> 2] = jit_compile(pc);
+        }
+        if (code == NULL || code == JIT_NOCODE)
+        {
+            jit_ctx.budget -= run_threaded(1);
+            pending_site = EXIT_PLAIN;
+            continue;
+        }
+        // chain the exit we came from straight to this block
+        if (pending_site >= 0 && flushes == jit_flushes)
+            patch_rel32(jit_cache + pending_site, code);
+        jit_enter(&CURRENT_STATE, &jit_ctx, code);
+        pending_site = jit_ctx.exit_site;
+    }
+    NEXT_STATE = CURRENT_STATE;
+    return budget - jit_ctx.budget;
+}
+
+#else
+
+void jit_collect() {}
+void jit_reset() {}
+void jit_invalidate(uint32_t address) {}
+void jit_watch(int hit) {}
+void jit_recompile() {}
+uint64_t run_jit(uint64_t max_ins) { return run_threaded(max_ins); }
+
+#endif
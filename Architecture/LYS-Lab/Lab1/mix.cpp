@@ -0,0 +1,138 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   dynamic instruction mix                                   */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+The engines do not count the mix per instruction, which would cost a memory
+increment each: the number of executions of every PC is already kept as
+runs of straight-line code (profile_delta), and the mix is the sum of the
+executions of each PC under the OpID of its instruction. INSN_MIX.executed
+keeps the counts of the instructions before the execution counts restart
+(mix_fold), e.g. when the text segment is replaced. A PC counts under the
+instruction at it when the counts are read, so an instruction rewritten by
+the program counts its earlier executions under the new one. The taken
+branches, which the counts do not tell, the engines count themselves,
+indexed by the dense OpID so that counting is an increment without a
+branch. Faulting instructions are not counted. The threaded engine also
+counts the pairs it executes as superinstructions (the fusion rate).
+*/
+
+thread_local insn_mix_t INSN_MIX;
+
+const char *OP_NAMES[OP_COUNT] = {
+    "undecoded", "unknown",
+    "sll", "srl", "sra", "sllv", "srlv", "srav",
+    "jr", "jalr", "syscall",
+    "mfhi", "mthi", "mflo", "mtlo",
+    "mult", "multu", "div", "divu",
+    "add", "addu", "sub", "subu",
+    "and", "or", "xor", "nor", "slt", "sltu",
+    "j", "jal",
+    "bltz", "bgez", "bltzal", "bgezal",
+    "beq", "bne", "blez", "bgtz",
+    "addi", "addiu", "slti", "sltiu",
+    "andi", "ori", "xori", "lui",
+    "lb", "lh", "lw", "lbu", "lhu",
+    "sb", "sh", "sw"};
+
+/*
+Procedure : mix_reset
+Purpose   : Clear the counters (the execution counts have just restarted)
+*/
+void mix_reset()
+{
+    memset(&INSN_MIX, 0, sizeof(INSN_MIX));
+}
+
+// add the current execution counts to executed by OpID
+void mix_count(uint64_t *executed)
+{
+    if (profile_delta == NULL)
+        return;
+    jit_collect();
+    int64_t sum = 0;
+    for (uint32_t i = 0; i < decoded_size / 4; i++)
+    {
+        sum += profile_delta[i];
+        if (sum == 0)
+            continue;
+        uint32_t opid = decoded_text[i].opid;
+        if (opid == OP_UNDECODED)
+        {
+            decoded_ins_t d;
+            decode_instruction(mem_read_32(decoded_start + 4 * i), &d);
+            opid = d.opid;
+        }
+        executed[opid] += sum;
+    }
+}
+
+/*
+Procedure : mix_fold
+Purpose   : Keep the current execution counts in the mix before they restart
+*/
+void mix_fold()
+{
+    mix_count(INSN_MIX.executed);
+}
+
+// sum of the counters of the OpIDs first..last
+uint64_t mix_sum(const uint64_t *counters, int first, int last)
+{
+    uint64_t sum = 0;
+    for (int op = first; op <= last; op++)
+        sum += counters[op];
+    return sum;
+}
+
+/*
+Procedure : mix_print
+Purpose   : Print the mix by class and by instruction to file
+*/
+void mix_print(FILE *file)
+{
+    insn_mix_t mix = INSN_MIX;
+    mix_count(mix.executed);
+    const uint64_t *e = mix.executed, *t = mix.taken;
+    uint64_t total = mix_sum(e, 0, OP_COUNT - 1);
+    double scale = total ? 100.0 / total : 0.0;
+    uint64_t muldiv = mix_sum(e, OP_MULT, OP_DIVU);
+    uint64_t word_loads = e[OP_LW], loads = mix_sum(e, OP_LB, OP_LHU);
+    uint64_t word_stores = e[OP_SW], stores = mix_sum(e, OP_SB, OP_SW);
+    uint64_t branches = mix_sum(e, OP_BLTZ, OP_BGTZ), taken = mix_sum(t, OP_BLTZ, OP_BGTZ);
+    uint64_t jumps = mix_sum(e, OP_JR, OP_JALR) + mix_sum(e, OP_J, OP_JAL);
+    uint64_t other = e[OP_SYSCALL];
+    uint64_t alu = total - muldiv - loads - stores - branches - jumps - other;
+
+    fprintf(file, "@ Instruction mix :\n");
+    fprintf(file, "-------------------------------------\n");
+    fprintf(file, "Total     : %llu\n", (unsigned long long)total);
+    fprintf(file, "ALU       : %llu (%.2f%%)\n", (unsigned long long)alu, alu * scale);
+    fprintf(file, "Mul/Div   : %llu (%.2f%%)\n", (unsigned long long)muldiv, muldiv * scale);
+    fprintf(file, "Load      : %llu (%.2f%%), word %llu, sub-word %llu\n", (unsigned long long)loads,
+            loads * scale, (unsigned long long)word_loads, (unsigned long long)(loads - word_loads));
+    fprintf(file, "Store     : %llu (%.2f%%), word %llu, sub-word %llu\n", (unsigned long long)stores,
+            stores * scale, (unsigned long long)word_stores, (unsigned long long)(stores - word_stores));
+    fprintf(file, "Branch    : %llu (%.2f%%), taken %llu, not taken %llu\n", (unsigned long long)branches,
+            branches * scale, (unsigned long long)taken, (unsigned long long)(branches - taken));
+    fprintf(file, "Jump      : %llu (%.2f%%)\n", (unsigned long long)jumps, jumps * scale);
+    fprintf(file, "Syscall   : %llu\n", (unsigned long long)other);
+    fprintf(file, "Fused     : %llu pairs, %.2f%% of the instructions\n", (unsigned long long)mix.fused,
+            2 * mix.fused * scale);
+    for (int op = OP_SLL; op < OP_COUNT; op++)
+    {
+        if (e[op] == 0)
+            continue;
+        fprintf(file, "  %-8s %-12llu %6.2f%%", OP_NAMES[op], (unsigned long long)e[op], e[op] * scale);
+        if (OP_BLTZ <= op && op <= OP_BGTZ)
+            fprintf(file, "  taken %.2f%%", 100.0 * t[op] / e[op]);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "-------------------------------------\n");
+}
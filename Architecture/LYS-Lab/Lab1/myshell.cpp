@@ -7,69 +7,307 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdint>
+#include <ctime>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "myshell.h"
+#include "sim.h"
 
 /***************************************************************/
 /* Main memory.                                                */
 /***************************************************************/
 
-#define MEM_DATA_START 0x10000000
-#define MEM_DATA_SIZE 0x00100000
-// #define MEM_TEXT_START 0x00400000 原始定义
-#define MEM_TEXT_START 0x00400028
-#define MEM_TEXT_SIZE 0x00100000
-#define MEM_STACK_START 0x7ff00000
-#define MEM_STACK_SIZE 0x00100000
-#define MEM_KDATA_START 0x90000000
-#define MEM_KDATA_SIZE 0x00100000
-#define MEM_KTEXT_START 0x80000000
-#define MEM_KTEXT_SIZE 0x00100000
+/* memory will be dynamically allocated at initialization */
+thread_local mem_region_t MEM_REGIONS[MEM_NREGIONS] = {
+	{"text", MEM_TEXT_START, MEM_TEXT_SIZE, NULL},
+	{"data", MEM_DATA_START, MEM_DATA_SIZE, NULL},
+	{"stack", MEM_STACK_START, MEM_STACK_SIZE, NULL},
+	{"kdata", MEM_KDATA_START, MEM_KDATA_SIZE, NULL},
+	{"ktext", MEM_KTEXT_START, MEM_KTEXT_SIZE, NULL}};
 
-typedef struct
+/*
+software page table: bits 31:22 of an address select a second-level table,
+bits 21:12 select the host page backing the guest page (NULL if unmapped)
+*/
+uint8_t *EMPTY_PAGE_TABLE[PT_ENTRIES];
+thread_local uint8_t **PAGE_TABLE[PT_ENTRIES];
+
+inline uint8_t *mem_page(uint32_t address)
+{
+	return PAGE_TABLE[address >> 22][(address >> MEM_PAGE_SHIFT) & (PT_ENTRIES - 1)];
+}
+inline uint8_t *&mem_page_entry(uint32_t page_no)
 {
-	uint32_t start, size;
-	uint8_t *mem;
-} mem_region_t;
+	return PAGE_TABLE[page_no >> 10][page_no & (PT_ENTRIES - 1)];
+}
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{MEM_TEXT_START, MEM_TEXT_SIZE, NULL},
-	{MEM_DATA_START, MEM_DATA_SIZE, NULL},
-	{MEM_STACK_START, MEM_STACK_SIZE, NULL},
-	{MEM_KDATA_START, MEM_KDATA_SIZE, NULL},
-	{MEM_KTEXT_START, MEM_KTEXT_SIZE, NULL}};
+/* the range of guest page numbers covered by region i */
+inline void region_pages(int i, uint32_t *first, uint32_t *last)
+{
+	*first = MEM_REGIONS[i].start >> MEM_PAGE_SHIFT;
+	*last = ((uint64_t)MEM_REGIONS[i].start + MEM_REGIONS[i].size - 1) >> MEM_PAGE_SHIFT;
+}
 
-#define MEM_NREGIONS (sizeof(MEM_REGIONS) / sizeof(mem_region_t))
+/* files whose pages are mapped into the page table (program images, checkpoints) */
+#define MAX_FILE_MAPS 16
+typedef struct
+{
+	uint8_t *addr;
+	size_t size;
+} file_map_t;
+thread_local file_map_t FILE_MAPS[MAX_FILE_MAPS];
+thread_local int NUM_FILE_MAPS = 0;
 
 /* CPU State info */
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_BIT = TRUE; /* run bit */
-int INSTRUCTION_COUNT = 0;
+thread_local CPU_State CURRENT_STATE, NEXT_STATE;
+thread_local int RUN_BIT = TRUE; /* run bit */
+thread_local uint64_t INSTRUCTION_COUNT = 0;
+/* instructions go/operate may still execute (--max-insns) */
+thread_local uint64_t INSTRUCTION_BUDGET = UINT64_MAX;
 
 /* debug parameters */
-int show_assemble = FALSE, show_detail = FALSE;
-int dump_stdout = TRUE, dump_file = TRUE;
+thread_local int show_assemble = FALSE, show_detail = FALSE;
+thread_local int dump_stdout = TRUE, dump_file = TRUE;
+/* headless run (--batch/--run/--farm): no prompts or progress messages */
+int batch_mode = FALSE;
+/* simulating many programs at once (--farm): exceptions are not printed */
+int farm_mode = FALSE;
+FILE *command_file = stdin;
+
+/* execution engine used by go and run */
+typedef enum
+{
+	ENGINE_REFERENCE, /* process_instruction */
+	ENGINE_THREADED,  /* run_threaded */
+	ENGINE_JIT		  /* run_jit */
+} engine_t;
+const char *ENGINE_NAMES[] = {"reference", "threaded", "jit"};
+#define NUM_ENGINES (sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0]))
+int sim_engine = ENGINE_REFERENCE;
+
+/* go and operate stop before an instruction at a breakpoint */
+#define MAX_BREAKPOINTS 16
+thread_local uint32_t BREAKPOINTS[MAX_BREAKPOINTS];
+thread_local int NUM_BREAKPOINTS = 0;
+/* the last go or operate stopped at a breakpoint */
+thread_local int break_hit = FALSE;
+
+int is_breakpoint(uint32_t pc)
+{
+	for (int i = 0; i < NUM_BREAKPOINTS; i++)
+		if (BREAKPOINTS[i] == pc)
+			return TRUE;
+	return FALSE;
+}
+
+/* return the engine called name, -1 if there is none */
+int engine_by_name(const char *name)
+{
+	for (int i = 0; i < NUM_ENGINES; i++)
+		if (strcmp(name, ENGINE_NAMES[i]) == 0)
+			return i;
+	return -1;
+}
 
 /*
-Procedure: mem_read_32
-Purpose : Read a 32-bit word from memory
+Watchpoints: the page table entries of the pages holding a watched range are
+cleared and the pages are kept in WATCHED_PAGES instead, so accesses to them
+leave the fast paths of mem_read_32 and mem_write_32 as if they were unmapped,
+while accesses to any other page take the fast paths unchanged. The slow paths
+check the watches while an engine runs (watch_armed): a hit halts the machine
+after the instruction and execute reports it.
 */
-uint32_t mem_read_32(uint32_t address)
+#define MAX_WATCHES 16
+#define MAX_WATCHED_PAGES 64
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+typedef struct
+{
+	uint32_t start, len;
+	int kinds; /* WATCH_READ | WATCH_WRITE */
+} watch_t;
+thread_local watch_t WATCHES[MAX_WATCHES];
+thread_local int NUM_WATCHES = 0;
+typedef struct
+{
+	uint32_t page_no;
+	uint8_t *host;
+} watched_page_t;
+thread_local watched_page_t WATCHED_PAGES[MAX_WATCHED_PAGES];
+thread_local int NUM_WATCHED_PAGES = 0;
+thread_local int watch_model = FALSE, watch_armed = FALSE;
+/* the access of the current instruction which hit a watch (kind 0: none) */
+typedef struct
+{
+	int kind;
+	uint32_t address, old_value, new_value;
+} watch_hit_t;
+thread_local watch_hit_t WATCH_HIT;
+
+/*
+Regions need not start or end on a page boundary (text starts at 0x00400028).
+A page which a region only partly covers is kept out of the page table, in
+EDGE_PAGES, so that accesses to it take the slow paths, where each byte is
+checked against the bounds of the regions: outside them, reads give 0 and
+writes are dropped, as they were before the page table.
+*/
+#define MAX_EDGE_PAGES (2 * MEM_NREGIONS)
+thread_local watched_page_t EDGE_PAGES[MAX_EDGE_PAGES];
+thread_local int NUM_EDGE_PAGES = 0;
+
+/* whether address is in one of the regions */
+int in_region(uint32_t address)
 {
+	for (int i = 0; i < MEM_NREGIONS; i++)
+		if (address - MEM_REGIONS[i].start < MEM_REGIONS[i].size)
+			return TRUE;
+	return FALSE;
+}
+
+/* whether guest page page_no is only partly covered by a region */
+int edge_page(uint32_t page_no)
+{
+	uint64_t first = (uint64_t)page_no << MEM_PAGE_SHIFT, end = first + MEM_PAGE_SIZE;
 	for (int i = 0; i < MEM_NREGIONS; i++)
 	{
-		if (address >= MEM_REGIONS[i].start &&
-			address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size))
+		uint64_t start = MEM_REGIONS[i].start, stop = start + MEM_REGIONS[i].size;
+		if (start < end && stop > first)
+			return start > first || stop < end;
+	}
+	return FALSE;
+}
+
+/* back guest page page_no by the host page host */
+void map_page(uint32_t page_no, uint8_t *host)
+{
+	if (!edge_page(page_no))
+	{
+		mem_page_entry(page_no) = host;
+		return;
+	}
+	for (int i = 0; i < NUM_EDGE_PAGES; i++)
+		if (EDGE_PAGES[i].page_no == page_no)
 		{
-			uint32_t offset = address - MEM_REGIONS[i].start;
-			return (MEM_REGIONS[i].mem[offset + 3] << 24) |
-				   (MEM_REGIONS[i].mem[offset + 2] << 16) |
-				   (MEM_REGIONS[i].mem[offset + 1] << 8) |
-				   (MEM_REGIONS[i].mem[offset + 0] << 0);
+			EDGE_PAGES[i].host = host;
+			return;
 		}
+	EDGE_PAGES[NUM_EDGE_PAGES++] = {page_no, host};
+}
+
+/* the host page backing guest page page_no, watched, edge or not */
+uint8_t *host_page(uint32_t page_no)
+{
+	uint8_t *page = mem_page_entry(page_no);
+	for (int i = 0; page == NULL && i < NUM_WATCHED_PAGES; i++)
+		if (WATCHED_PAGES[i].page_no == page_no)
+			page = WATCHED_PAGES[i].host;
+	for (int i = 0; page == NULL && i < NUM_EDGE_PAGES; i++)
+		if (EDGE_PAGES[i].page_no == page_no)
+			page = EDGE_PAGES[i].host;
+	return page;
+}
+
+/* the host byte backing address, NULL if it is in no region */
+uint8_t *host_byte(uint32_t address)
+{
+	uint8_t *page = host_page(address >> MEM_PAGE_SHIFT);
+	if (page == NULL || (mem_page(address) == NULL && !in_region(address)))
+		return NULL;
+	return page + (address & MEM_PAGE_MASK);
+}
+
+/*
+Procedure : watch_access
+Purpose   : Check the access of the size bytes (1, 2 or 4) at address, holding
+			old_value before and new_value after it, against the watches: a
+			read hits a watched byte it reads, a write one that it changes
+*/
+void watch_access(uint32_t address, uint32_t size, uint32_t old_value, uint32_t new_value, int write)
+{
+	int hit = FALSE;
+	for (int i = 0; i < NUM_WATCHES; i++)
+		for (uint32_t k = 0; k < size; k++)
+			if (address + k - WATCHES[i].start < WATCHES[i].len &&
+				(write ? (WATCHES[i].kinds & WATCH_WRITE) && ((old_value ^ new_value) >> (8 * k) & 0xff)
+					   : (WATCHES[i].kinds & WATCH_READ)))
+				hit = TRUE;
+	if (hit && (write ? WATCH_HIT.kind != WATCH_WRITE : WATCH_HIT.kind == 0))
+		WATCH_HIT = {write ? WATCH_WRITE : WATCH_READ, address, old_value, new_value};
+	else if (!hit && write && WATCH_HIT.kind == WATCH_READ)
+		/* the read was the first half of a byte or halfword store */
+		WATCH_HIT.kind = 0;
+	else
+		return;
+	RUN_BIT = WATCH_HIT.kind == 0;
+	jit_watch(WATCH_HIT.kind != 0);
+}
+
+/*
+Procedure: mem_peek_32
+Purpose : Read a 32-bit word from memory, unseen by the watches (fetches, explanations)
+*/
+uint32_t mem_peek_32(uint32_t address)
+{
+	uint8_t *page = mem_page(address);
+	uint32_t offset = address & MEM_PAGE_MASK;
+	if (page != NULL && offset <= MEM_PAGE_SIZE - 4)
+		return (page[offset + 3] << 24) |
+			   (page[offset + 2] << 16) |
+			   (page[offset + 1] << 8) |
+			   (page[offset + 0] << 0);
+	/* unmapped, watched, an edge page, or the word crosses a page boundary */
+	uint32_t value = 0;
+	for (int k = 3; k >= 0; k--)
+	{
+		uint8_t *byte = host_byte(address + k);
+		value = (value << 8) | (byte ? *byte : 0);
+	}
+	return value;
+}
+/*
+Procedure: mem_read_32
+Purpose : Read a 32-bit word from memory
+*/
+uint32_t mem_read_32(uint32_t address)
+{
+	uint8_t *page = mem_page(address);
+	uint32_t offset = address & MEM_PAGE_MASK;
+	if (page != NULL && offset <= MEM_PAGE_SIZE - 4)
+		return (page[offset + 3] << 24) |
+			   (page[offset + 2] << 16) |
+			   (page[offset + 1] << 8) |
+			   (page[offset + 0] << 0);
+	uint32_t value = mem_peek_32(address);
+	if (watch_armed)
+		watch_access(address, 4, value, value, FALSE);
+	return value;
+}
+/*
+Procedure: mem_read_part
+Purpose : Read the word holding the size bytes (1, 2 or 4) a load reads at
+		  address, the watches seeing only those bytes read
+*/
+uint32_t mem_read_part(uint32_t address, uint32_t size)
+{
+	uint32_t word_address = address & ~3;
+	uint8_t *page = mem_page(word_address);
+	uint32_t offset = word_address & MEM_PAGE_MASK;
+	if (page != NULL)
+		return (page[offset + 3] << 24) |
+			   (page[offset + 2] << 16) |
+			   (page[offset + 1] << 8) |
+			   (page[offset + 0] << 0);
+	uint32_t value = mem_peek_32(word_address);
+	if (watch_armed)
+	{
+		uint32_t part = size == 4 ? value : (value >> (8 * (address & 003))) & ((1u << (8 * size)) - 1);
+		watch_access(address, size, part, part, FALSE);
 	}
-	return 0;
+	return value;
 }
 /*
 Procedure: mem_write_32
@@ -77,21 +315,209 @@ Purpose: Write a 32-bit word to memory
 */
 void mem_write_32(uint32_t address, uint32_t value)
 {
-	for (int i = 0; i < MEM_NREGIONS; i++)
+	uint8_t *page = mem_page(address);
+	uint32_t offset = address & MEM_PAGE_MASK;
+	if (cosim_recording)
+		cosim_write(address, value);
+	if (page != NULL && offset <= MEM_PAGE_SIZE - 4)
+	{
+		page[offset + 3] = (value >> 24) & 0xFF;
+		page[offset + 2] = (value >> 16) & 0xFF;
+		page[offset + 1] = (value >> 8) & 0xFF;
+		page[offset + 0] = (value >> 0) & 0xFF;
+	}
+	else
 	{
-		if (address >= MEM_REGIONS[i].start &&
-			address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size))
+		/* unmapped, watched, an edge page, or the word crosses a page boundary */
+		uint32_t old_value = watch_armed ? mem_peek_32(address) : 0;
+		for (int k = 0; k < 4; k++)
 		{
-			uint32_t offset = address - MEM_REGIONS[i].start;
-			MEM_REGIONS[i].mem[offset + 3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 1] = (value >> 8) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 0] = (value >> 0) & 0xFF;
-			return;
+			uint8_t *byte = host_byte(address + k);
+			if (byte != NULL)
+				*byte = (value >> (8 * k)) & 0xFF;
 		}
+		if (watch_armed)
+			watch_access(address, 4, old_value, value, TRUE);
+	}
+	/* any of the 4 bytes falls in the text segment */
+	if (address + 3 - MEM_REGIONS[REGION_TEXT].start < MEM_REGIONS[REGION_TEXT].size + 3)
+		invalidate_decoded(address);
+}
+/*
+Procedure: mem_load
+Purpose: Copy size bytes from src (zeros if src is NULL) to memory at address
+		 a page at a time, return FALSE if they are not all in memory (the
+		 bytes of an edge page outside its region are dropped); the decode
+		 cache is left to the caller
+*/
+int mem_load(uint32_t address, const uint8_t *src, uint32_t size)
+{
+	int all = TRUE;
+	while (size > 0)
+	{
+		uint8_t *page = host_page(address >> MEM_PAGE_SHIFT);
+		uint32_t offset = address & MEM_PAGE_MASK, n = MEM_PAGE_SIZE - offset;
+		if (page == NULL)
+			return FALSE;
+		if (n > size)
+			n = size;
+		if (in_region(address) && in_region(address + n - 1))
+		{
+			if (src)
+				memcpy(page + offset, src, n);
+			else
+				memset(page + offset, 0, n);
+		}
+		else
+			for (uint32_t k = 0; k < n; k++)
+			{
+				uint8_t *byte = host_byte(address + k);
+				if (byte != NULL)
+					*byte = src ? src[k] : 0;
+				else
+					all = FALSE;
+			}
+		if (src)
+			src += n;
+		address += n;
+		size -= n;
+	}
+	return all;
+}
+
+/*
+Procedure: mem_read
+Purpose: Copy size bytes of memory at address to dst a page at a time,
+		 return FALSE if they are not all in memory (the bytes of an edge
+		 page outside its region read as zeros)
+*/
+int mem_read(uint32_t address, uint8_t *dst, uint32_t size)
+{
+	int all = TRUE;
+	while (size > 0)
+	{
+		uint8_t *page = host_page(address >> MEM_PAGE_SHIFT);
+		uint32_t offset = address & MEM_PAGE_MASK, n = MEM_PAGE_SIZE - offset;
+		if (page == NULL)
+			return FALSE;
+		if (n > size)
+			n = size;
+		if (in_region(address) && in_region(address + n - 1))
+			memcpy(dst, page + offset, n);
+		else
+			for (uint32_t k = 0; k < n; k++)
+			{
+				uint8_t *byte = host_byte(address + k);
+				dst[k] = byte ? *byte : 0;
+				all &= byte != NULL;
+			}
+		dst += n;
+		address += n;
+		size -= n;
+	}
+	return all;
+}
+
+/*
+Procedure : watch_pages
+Purpose   : Take the mapped pages of the watched ranges out of the page table
+			(hide), or put all of them back
+*/
+void watch_pages(int hide)
+{
+	if (!hide)
+	{
+		for (int i = 0; i < NUM_WATCHED_PAGES; i++)
+			mem_page_entry(WATCHED_PAGES[i].page_no) = WATCHED_PAGES[i].host;
+		NUM_WATCHED_PAGES = 0;
+		return;
+	}
+	for (int i = 0; i < NUM_WATCHES; i++)
+	{
+		uint32_t last = (WATCHES[i].start + WATCHES[i].len - 1) >> MEM_PAGE_SHIFT;
+		for (uint32_t p = WATCHES[i].start >> MEM_PAGE_SHIFT; p <= last; p++)
+			if (mem_page_entry(p) != NULL)
+			{
+				WATCHED_PAGES[NUM_WATCHED_PAGES++] = {p, mem_page_entry(p)};
+				mem_page_entry(p) = NULL;
+			}
 	}
 }
 
+/*
+Procedure : watch_add
+Purpose   : Watch the len bytes from start for the accesses of kinds
+*/
+int watch_add(uint32_t start, uint32_t len, int kinds)
+{
+	if (len == 0 || start + (len - 1) < start)
+	{
+		printf("@ Error: Invalid watch range\n");
+		return FALSE;
+	}
+	if (NUM_WATCHES == MAX_WATCHES)
+	{
+		printf("@ Error: Too many watches\n");
+		return FALSE;
+	}
+	uint32_t first = start >> MEM_PAGE_SHIFT, last = (start + len - 1) >> MEM_PAGE_SHIFT;
+	if (last - first >= MAX_WATCHED_PAGES - NUM_WATCHED_PAGES)
+	{
+		printf("@ Error: Too many watched pages\n");
+		return FALSE;
+	}
+	WATCHES[NUM_WATCHES++] = {start, len, kinds};
+	watch_pages(TRUE);
+	watch_model = TRUE;
+	/* the loads of generated code only check for hits while there are watches */
+	jit_recompile();
+	return TRUE;
+}
+
+/*
+Procedure : watch_clear
+Purpose   : Remove all watches
+*/
+void watch_clear()
+{
+	watch_pages(FALSE);
+	NUM_WATCHES = 0;
+	watch_model = FALSE;
+	jit_recompile();
+}
+
+/*
+Procedure : watch_report
+Purpose   : Halt as an exception does for the access which hit a watch
+*/
+void watch_report()
+{
+	/* loads and stores are not branches, the engines stopped right after it */
+	uint32_t pc = CURRENT_STATE.PC - 4;
+	alert_exception(mem_peek_32(pc), WatchpointHit);
+	if (!farm_mode)
+	{
+		if (WATCH_HIT.kind == WATCH_WRITE)
+			printf("@ Watchpoint: PC %08x wrote [%08x], it changes from %08x to %08x\n",
+				   pc, WATCH_HIT.address, WATCH_HIT.old_value, WATCH_HIT.new_value);
+		else
+			printf("@ Watchpoint: PC %08x read [%08x]: %08x\n", pc, WATCH_HIT.address, WATCH_HIT.old_value);
+	}
+	WATCH_HIT.kind = 0;
+	jit_watch(FALSE);
+}
+
+/*
+Procedure : watch_list
+Purpose   : Print the watches
+*/
+void watch_list()
+{
+	static const char *const KINDS[] = {"", "r", "w", "rw"};
+	for (int i = 0; i < NUM_WATCHES; i++)
+		printf("@ Watch %d at %08x, %u bytes, %s\n", i, WATCHES[i].start, WATCHES[i].len, KINDS[WATCHES[i].kinds]);
+}
+
 /*
 Procedure : help
 Purpose   : Print out a list of commands
@@ -124,9 +550,62 @@ void help()
 	printf("\tset the value of register {reg} to {val}(hex)\n");
 	printf("\t{reg} can be pc/hi/lo/0/.../1f(hex)\n");
 
+	printf("e[ngine] [r|t|j]\n");
+	printf("\tshow or select the execution engine used by go/operate\n");
+	printf("\tr: reference (process_instruction)\n");
+	printf("\tt: threaded\n");
+	printf("\tj: JIT compiler to x86-64\n");
+
+	printf("b[reak] [{addr}|off]\n");
+	printf("\tlist the breakpoints, add one at {addr}(hex) or remove them all;\n");
+	printf("\tgo/operate stop before an instruction at a breakpoint (not with the pipeline model)\n");
+
+	printf("watch [{addr} [{len}] [r|w|rw]|off]\n");
+	printf("\tlist the watches, watch the {len}(dec, default 4) bytes from {addr}(hex) or remove them all;\n");
+	printf("\tgo/operate halt after a load (r) reading or a store (w, the default) changing them\n");
+
+	printf("reverse [on|off]\n");
+	printf("\tshow how far back history goes, or turn the undo log on (history restarts) / off\n");
+
+	printf("back [{num}|c]\n");
+	printf("\tstep back 1 or {num}(dec) instructions (the undo log must be on)\n");
+	printf("\tc: step back to the last breakpoint passed\n");
+
 	printf("r[ecover]\n");
 	printf("\tset RUN_BIT to TRUE\n");
 
+	printf("c[heckpoint] {file}\n");
+	printf("\tsave registers, RUN_BIT, instruction count and memory to {file}\n");
+
+	printf("restore {file}\n");
+	printf("\treplace the machine by the one saved in {file}\n");
+
+	printf("t[iming] [on|off]\n");
+	printf("\tshow cycles, CPI and stalls of the 5-stage pipeline model,\n");
+	printf("\tor turn the model on (statistics restart) / off\n");
+
+	printf("trace {file}|off\n");
+	printf("\ttrace the executed instructions to the binary {file} (simtrace explains it),\n");
+	printf("\tor stop tracing\n");
+
+	printf("cache [on|off]\n");
+	printf("\tshow hits, misses and miss classes of the cache model,\n");
+	printf("\tor turn the model on (caches emptied) / off\n");
+
+	printf("bpred [static|bimodal|gshare|tournament|tage|off]\n");
+	printf("\tshow the accuracy of the branch predictor and the worst branches,\n");
+	printf("\tor select a predictor (tables emptied) / turn prediction off\n");
+
+	printf("p[rofile] [on|off|{file}]\n");
+	printf("\tshow the hottest basic blocks and PCs (or write them to {file}),\n");
+	printf("\tor turn the profile on (counts restart) / off\n");
+
+	printf("mix\n");
+	printf("\tshow the dynamic instruction mix (also written to dumpsim by rdump)\n");
+
+	printf("m[emory]\n");
+	printf("\tshow the memory regions and the pages of them taking host memory\n");
+
 	printf("h[elp]\n");
 	printf("\tshow usage of commands\n");
 
@@ -147,22 +626,116 @@ void cycle()
 	INSTRUCTION_COUNT++;
 }
 
+/*
+Procedure : wall_time
+Purpose   : Seconds elapsed on a monotonic clock
+*/
+double wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+Procedure : execute
+Purpose   : Simulate at most num_cycles instructions with the selected engine,
+			return the number of instructions executed
+*/
+uint64_t execute(uint64_t num_cycles)
+{
+	uint64_t done = 0;
+	if (num_cycles > INSTRUCTION_BUDGET)
+		num_cycles = INSTRUCTION_BUDGET;
+	double start = wall_time();
+	break_hit = FALSE;
+	watch_armed = watch_model;
+	/* the shell may have changed the state since the trace last saw it */
+	if (trace_model && RUN_BIT)
+		trace_sync();
+	/* only process_instruction can explain what it executes */
+	if (show_assemble)
+	{
+		for (; done < num_cycles && RUN_BIT; done++)
+		{
+			if (NUM_BREAKPOINTS && done && (break_hit = is_breakpoint(CURRENT_STATE.PC)))
+				break;
+			cycle();
+		}
+	}
+	else if (pipeline_model)
+	{
+		/* the timing model needs to see every instruction */
+		done = run_pipeline(num_cycles);
+		INSTRUCTION_COUNT += done;
+	}
+	else if (cosim_model && !(cache_model || bpred_model || trace_model || reverse_model || NUM_BREAKPOINTS))
+	{
+		/* the engine checked against the reference; a hit would stop one of the two */
+		watch_armed = FALSE;
+		done = run_cosim(num_cycles, sim_engine == ENGINE_JIT ? run_jit : sim_engine == ENGINE_THREADED ? run_threaded : NULL);
+		INSTRUCTION_COUNT += done;
+	}
+	else if (sim_engine == ENGINE_REFERENCE || cache_model || bpred_model || trace_model || reverse_model ||
+			 NUM_BREAKPOINTS)
+	{
+		/* no NEXT_STATE to copy back after every instruction, the cache and branch
+		   models, the trace and the undo log only see what step_instruction executes;
+		   the instruction a run starts at does not stop it, so that it can go on */
+		if (NUM_BREAKPOINTS)
+		{
+			for (; done < num_cycles && RUN_BIT; done++)
+			{
+				if (done && (break_hit = is_breakpoint(CURRENT_STATE.PC)))
+					break;
+				step_instruction();
+			}
+		}
+		else
+		{
+			for (; done < num_cycles && RUN_BIT; done++)
+				step_instruction();
+		}
+		NEXT_STATE = CURRENT_STATE;
+		INSTRUCTION_COUNT += done;
+	}
+	else
+	{
+		done = sim_engine == ENGINE_JIT ? run_jit(num_cycles) : run_threaded(num_cycles);
+		INSTRUCTION_COUNT += done;
+	}
+	double elapsed = wall_time() - start;
+	watch_armed = FALSE;
+	/* what the guest printed comes before what the shell prints next */
+	syscall_flush();
+	if (WATCH_HIT.kind)
+		watch_report();
+	INSTRUCTION_BUDGET -= done;
+	if (done && !batch_mode)
+		printf("@ %llu instructions in %.3f s (%.2f MIPS, %s)\n\n",
+			   (unsigned long long)done, elapsed, done / elapsed * 1e-6,
+			   pipeline_model ? "pipeline model" : cache_model || bpred_model ? "cache/branch models" : trace_model ? "tracing" : reverse_model ? "undo log" : NUM_BREAKPOINTS ? "breakpoints" : cosim_model ? "co-simulation" : ENGINE_NAMES[sim_engine]);
+	return done;
+}
+
 /*
 Procedure : run n
 Purpose   : Simulate MIPS for n cycles
 */
-void run(int num_cycles)
+void run(uint64_t num_cycles)
 {
-	if (RUN_BIT == TRUE)
-		printf("@ Simulating for %d cycles...\n\n", num_cycles);
-	for (int i = 0; i < num_cycles; i++)
+	if (RUN_BIT == TRUE && !batch_mode)
+		printf("@ Simulating for %llu cycles...\n\n", (unsigned long long)num_cycles);
+	if (num_cycles > 0 && execute(num_cycles) < num_cycles && !batch_mode)
 	{
-		if (RUN_BIT == FALSE)
+		if (break_hit)
 		{
-			printf("@ Simulator is halted\n\n");
-			break;
+			printf("@ Breakpoint at %08x", CURRENT_STATE.PC);
+			print_symbol(CURRENT_STATE.PC);
+			printf("\n\n");
 		}
-		cycle();
+		else
+			printf("@ Simulator is halted\n\n");
 	}
 }
 
@@ -172,11 +745,17 @@ Purpose   : Simulate MIPS until HALTed
 */
 void go()
 {
-	if (RUN_BIT == TRUE)
+	if (RUN_BIT == TRUE && !batch_mode)
 		printf("@ Simulating...\n\n");
-	while (RUN_BIT)
-		cycle();
-	printf("@ Simulator is halted\n\n");
+	execute(UINT64_MAX);
+	if (break_hit && !batch_mode)
+	{
+		printf("@ Breakpoint at %08x", CURRENT_STATE.PC);
+		print_symbol(CURRENT_STATE.PC);
+		printf("\n\n");
+	}
+	else if (!batch_mode)
+		printf("@ Simulator is halted\n\n");
 }
 
 /*
@@ -216,7 +795,7 @@ void rdump(FILE *dumpsim_file)
 	{
 		printf("@ Current register/bus values :\n");
 		printf("-------------------------------------\n");
-		printf("Ins Count : %08x\n", INSTRUCTION_COUNT);
+		printf("Ins Count : %08llx\n", (unsigned long long)INSTRUCTION_COUNT);
 		printf("PC        : %08x\n", CURRENT_STATE.PC);
 		printf("HI        : %08x\n", CURRENT_STATE.HI);
 		printf("LO        : %08x\n", CURRENT_STATE.LO);
@@ -233,7 +812,7 @@ void rdump(FILE *dumpsim_file)
 	{
 		fprintf(dumpsim_file, "@ Current register/bus values :\n");
 		fprintf(dumpsim_file, "-------------------------------------\n");
-		fprintf(dumpsim_file, "Ins Count : %08x\n", INSTRUCTION_COUNT);
+		fprintf(dumpsim_file, "Ins Count : %08llx\n", (unsigned long long)INSTRUCTION_COUNT);
 		fprintf(dumpsim_file, "PC        : %08x\n", CURRENT_STATE.PC);
 		fprintf(dumpsim_file, "HI        : %08x\n", CURRENT_STATE.HI);
 		fprintf(dumpsim_file, "LO        : %08x\n", CURRENT_STATE.LO);
@@ -241,11 +820,34 @@ void rdump(FILE *dumpsim_file)
 		for (int k = 0; k < MIPS_REGS; k++)
 			fprintf(dumpsim_file, "$%d: %08x\n", k, CURRENT_STATE.REGS[k]);
 		fprintf(dumpsim_file, "-------------------------------------\n");
+		/* the mix of the instructions counted so far goes to the file only */
+		mix_print(dumpsim_file);
 	}
 }
 
+/*
+Procedure : memdump
+Purpose   : Show the regions and how many of their pages are resident.
+*/
+void memdump()
+{
+	uint32_t total = 0;
+	printf("@ Memory regions :\n");
+	printf("-------------------------------------\n");
+	printf("region  start     size      resident\n");
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		uint32_t pages = resident_pages(i);
+		printf("%-7s %08x  %08x  %u pages (%u KiB)\n", MEM_REGIONS[i].name, MEM_REGIONS[i].start,
+			   MEM_REGIONS[i].size, pages, pages * (MEM_PAGE_SIZE >> 10));
+		total += pages;
+	}
+	printf("total resident: %u pages (%u KiB)\n", total, total * (MEM_PAGE_SIZE >> 10));
+	printf("-------------------------------------\n");
+}
+
 int cmdbuf_pointer = 0, quit_process = FALSE;
-char command_buffer[64] = {' '};
+char command_buffer[256] = {' '};
 inline uint32_t ch2digit(char ch)
 {
 	if ('0' <= ch && ch <= '9')
@@ -257,9 +859,10 @@ inline uint32_t ch2digit(char ch)
 	else
 		return 0xffffffff;
 }
-uint32_t readnum(uint32_t base = 16)
+uint64_t readnum(uint32_t base = 16)
 {
-	uint32_t num = 0, tmp;
+	uint64_t num = 0;
+	uint32_t tmp;
 	while ((tmp = ch2digit(command_buffer[cmdbuf_pointer])) < base)
 	{
 		num = num * base + tmp;
@@ -279,21 +882,45 @@ char skip()
 		cmdbuf_pointer++;
 	return command_buffer[cmdbuf_pointer];
 }
+/* whether the word at the command buffer pointer is word */
+int is_word(const char *word)
+{
+	size_t len = strlen(word);
+	char next = command_buffer[cmdbuf_pointer + len];
+	return strncmp(command_buffer + cmdbuf_pointer, word, len) == 0 && (next == '\0' || is_space(next));
+}
+/* terminate the word at the command buffer pointer and return it */
+char *readword()
+{
+	char *word = command_buffer + cmdbuf_pointer;
+	while (command_buffer[cmdbuf_pointer] && !is_space(command_buffer[cmdbuf_pointer]))
+		cmdbuf_pointer++;
+	if (command_buffer[cmdbuf_pointer])
+		command_buffer[cmdbuf_pointer++] = '\0';
+	return word;
+}
 /*
 Procedure : get_command
-Purpose   : Read a command from standard input.
+Purpose   : Read a command from command_file (standard input by default).
 */
 void get_command(FILE *dumpsim_file)
 {
-	int start, stop, cycles;
+	int start, stop;
+	uint64_t cycles;
 	int register_no, register_value;
 	int hi_reg_value, lo_reg_value;
 
-	printf("\x1B[35mMIPS-SIM > \x1B[0m");
+	if (!batch_mode)
+		printf("\x1B[35mMIPS-SIM > \x1B[0m");
 	// read a line
-	if (scanf("%[^\n]", command_buffer + 1) == EOF)
-		exit(0);
-	getchar();
+	if (fscanf(command_file, "%254[^\n]", command_buffer + 1) == EOF)
+	{
+		if (!batch_mode)
+			exit(0);
+		quit_process = TRUE;
+		return;
+	}
+	fgetc(command_file);
 	cmdbuf_pointer = 0;
 	show_assemble = show_detail = FALSE;
 	dump_stdout = dump_file = TRUE;
@@ -435,99 +1062,871 @@ void get_command(FILE *dumpsim_file)
 		}
 		else
 			legal_command = FALSE;
+		/* history does not know of the change */
+		if (legal_command && reverse_model)
+			reverse_reset();
+		break;
+	}
+	case 'e':
+	{
+		char now = skip();
+		if (now == 'r')
+			sim_engine = ENGINE_REFERENCE;
+		else if (now == 't')
+			sim_engine = ENGINE_THREADED;
+		else if (now == 'j')
+			sim_engine = ENGINE_JIT;
+		else if (now)
+			legal_command = FALSE;
+		if (legal_command && !batch_mode)
+			printf("@ Engine: %s\n", ENGINE_NAMES[sim_engine]);
 		break;
 	}
+	case 'c':
+		if (is_word("cache"))
+		{
+			char now = skip();
+			if (is_word("on"))
+				cache_model = TRUE, cache_reset();
+			else if (is_word("off"))
+				cache_model = FALSE;
+			else if (now)
+				legal_command = FALSE;
+			if (legal_command && !now)
+				cache_report();
+			break;
+		}
+		if (skip())
+			legal_command = save_checkpoint(readword());
+		else
+			legal_command = FALSE;
+		break;
 	case 'r':
+		if (is_word("restore"))
+		{
+			if (skip())
+				legal_command = restore_checkpoint(readword());
+			else
+				legal_command = FALSE;
+			break;
+		}
+		if (is_word("reverse"))
+		{
+			char now = skip();
+			if (is_word("on"))
+				reverse_model = TRUE, reverse_reset();
+			else if (is_word("off"))
+				reverse_model = FALSE;
+			else if (now)
+				legal_command = FALSE;
+			if (legal_command && !now)
+				reverse_report();
+			break;
+		}
 		RUN_BIT = TRUE;
+		LAST_EXCEPTION = 0;
+		break;
+	case 't':
+	{
+		if (is_word("trace"))
+		{
+			if (!skip())
+				legal_command = FALSE;
+			else if (is_word("off"))
+				trace_close();
+			else
+				legal_command = trace_open(readword());
+			break;
+		}
+		char now = skip();
+		if (is_word("on"))
+			pipeline_model = TRUE, pipeline_reset();
+		else if (is_word("off"))
+			pipeline_model = FALSE;
+		else if (now)
+			legal_command = FALSE;
+		if (legal_command && !now)
+			pipeline_report();
+		break;
+	}
+	case 'b':
+		if (is_word("back"))
+		{
+			char now = skip();
+			uint64_t num = 1;
+			if (is_word("c"))
+			{
+				if (!reverse_model)
+					legal_command = FALSE;
+				else if (reverse_continue())
+				{
+					printf("@ Breakpoint at %08x", CURRENT_STATE.PC);
+					print_symbol(CURRENT_STATE.PC);
+					printf("\n");
+				}
+				else
+					printf("@ No breakpoint in history\n");
+				break;
+			}
+			if (ch2digit(now) < 10)
+				num = readnum(10);
+			if (!reverse_model || skip())
+				legal_command = FALSE;
+			else
+			{
+				num = reverse_back(num);
+				if (!batch_mode)
+					printf("@ Stepped back %llu instructions\n", (unsigned long long)num);
+			}
+			break;
+		}
+		if (is_word("break") || is_word("b"))
+		{
+			char now = skip();
+			if (is_word("off"))
+				NUM_BREAKPOINTS = 0;
+			else if (now && ch2digit(now) < 16 && NUM_BREAKPOINTS < MAX_BREAKPOINTS)
+				BREAKPOINTS[NUM_BREAKPOINTS++] = readnum(16);
+			else if (now)
+				legal_command = FALSE;
+			if (legal_command && !now)
+				for (int i = 0; i < NUM_BREAKPOINTS; i++)
+				{
+					printf("@ Breakpoint %d at %08x", i, BREAKPOINTS[i]);
+					print_symbol(BREAKPOINTS[i]);
+					printf("\n");
+				}
+			break;
+		}
+		if (is_word("bpred"))
+		{
+			char now = skip();
+			if (is_word("off"))
+				bpred_model = FALSE;
+			else if (now && bpred_config(readword()))
+				bpred_reset();
+			else if (now)
+				legal_command = FALSE;
+			if (legal_command && !now)
+				bpred_report();
+		}
+		else
+			legal_command = FALSE;
+		break;
+	case 'p':
+	{
+		char now = skip();
+		if (is_word("on") || is_word("off"))
+		{
+			profile_model = is_word("on");
+			mix_fold();
+			profile_reset();
+		}
+		else
+			legal_command = profile_report(now ? readword() : NULL);
+		break;
+	}
+	case 'm':
+		if (is_word("mix"))
+		{
+			if (skip())
+				legal_command = FALSE;
+			else
+				mix_print(stdout);
+		}
+		else if (skip())
+			legal_command = FALSE;
+		else
+			memdump();
+		break;
+	case 'w':
+	{
+		if (!is_word("watch"))
+		{
+			legal_command = FALSE;
+			break;
+		}
+		char now = skip();
+		if (is_word("off"))
+			watch_clear();
+		else if (now && ch2digit(now) < 16)
+		{
+			uint32_t start = readnum(16), len = 4;
+			int kinds = WATCH_WRITE;
+			if (ch2digit(skip()) < 10)
+			{
+				len = readnum(10);
+				skip();
+			}
+			if (is_word("r"))
+				kinds = WATCH_READ;
+			else if (is_word("rw"))
+				kinds = WATCH_READ | WATCH_WRITE;
+			else if (!is_word("w") && command_buffer[cmdbuf_pointer])
+				legal_command = FALSE;
+			if (legal_command && command_buffer[cmdbuf_pointer] && skip())
+				legal_command = FALSE;
+			if (legal_command)
+				watch_add(start, len, kinds);
+		}
+		else if (now)
+			legal_command = FALSE;
+		if (legal_command && !now)
+			watch_list();
 		break;
+	}
 	case 'h':
 		help();
 		break;
 	case 'q':
-		printf("@ Bye.\n");
+		if (!batch_mode)
+			printf("@ Bye.\n");
 		quit_process = TRUE;
 		return;
 	default:
 		legal_command = FALSE;
 		break;
 	}
-	if (!legal_command)
+	if (batch_mode)
+	{
+		if (!legal_command)
+			fprintf(stderr, "@ Invalid command: %s\n", command_buffer + 1);
+	}
+	else if (!legal_command)
 		printf("\x1B[31m@ Invalid command was given, use \"help\" to look up commands\n\x1B[0m");
 	else
 		printf("\x1B[32m@ Task finished\n\x1B[0m");
 }
 
+/*
+Procedure : config_region
+Purpose   : Place a memory region as given by "{name}={start}:{size}".
+*/
+int config_region(const char *spec)
+{
+	const char *eq = strchr(spec, '=');
+	if (eq == NULL)
+		return FALSE;
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		if (strlen(MEM_REGIONS[i].name) != (size_t)(eq - spec) ||
+			strncmp(MEM_REGIONS[i].name, spec, eq - spec) != 0)
+			continue;
+		char *end;
+		uint64_t start = strtoull(eq + 1, &end, 0);
+		if (*end != ':')
+			return FALSE;
+		uint64_t size = strtoull(end + 1, &end, 0);
+		size = (size + 3) & ~(uint64_t)3;
+		if (*end != '\0' || (start & 3) || size == 0 || start + size > 0x100000000ULL)
+			return FALSE;
+		MEM_REGIONS[i].start = start;
+		MEM_REGIONS[i].size = size;
+		return TRUE;
+	}
+	return FALSE;
+}
+
 /*
 Procedure : init_memory
-Purpose   : Allocate and zero memory.
+Purpose   : Allocate and zero memory, and map it into the page table.
+			Regions are anonymous mappings, a page only takes host memory
+			once it is written (demand-zero).
 */
 void init_memory()
 {
+	for (int i = 0; i < PT_ENTRIES; i++)
+		PAGE_TABLE[i] = EMPTY_PAGE_TABLE;
+	NUM_EDGE_PAGES = 0;
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		/* host memory covers whole pages so that each guest page maps to one host page */
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		size_t bytes = (size_t)(last - first + 1) << MEM_PAGE_SHIFT;
+		void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED)
+		{
+			printf("@ Error: Can't allocate memory region %s\n", MEM_REGIONS[i].name);
+			exit(-1);
+		}
+		uint8_t *base = (uint8_t *)mem;
+		MEM_REGIONS[i].mem = base + (MEM_REGIONS[i].start & MEM_PAGE_MASK);
+		for (uint32_t p = first; p <= last; p++)
+		{
+			uint8_t **table = PAGE_TABLE[p >> 10];
+			if (table == EMPTY_PAGE_TABLE)
+			{
+				table = PAGE_TABLE[p >> 10] = new uint8_t *[PT_ENTRIES];
+				memset(table, 0, PT_ENTRIES * sizeof(uint8_t *));
+			}
+			if (host_page(p) != NULL)
+			{
+				printf("@ Error: Memory region %s overlaps another region\n", MEM_REGIONS[i].name);
+				exit(-1);
+			}
+			map_page(p, base + ((size_t)(p - first) << MEM_PAGE_SHIFT));
+		}
+	}
+	reset_decoded();
+}
+
+/*
+Procedure : free_memory
+Purpose   : Release the memory of the regions and the page table.
+*/
+void free_memory()
+{
+	/* the watched pages go with the others */
+	watch_pages(FALSE);
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		if (MEM_REGIONS[i].mem != NULL)
+			munmap(MEM_REGIONS[i].mem - (MEM_REGIONS[i].start & MEM_PAGE_MASK),
+				   (size_t)(last - first + 1) << MEM_PAGE_SHIFT);
+		MEM_REGIONS[i].mem = NULL;
+	}
+	for (int i = 0; i < PT_ENTRIES; i++)
+	{
+		if (PAGE_TABLE[i] != EMPTY_PAGE_TABLE)
+			delete[] PAGE_TABLE[i];
+		PAGE_TABLE[i] = EMPTY_PAGE_TABLE;
+	}
+	NUM_EDGE_PAGES = 0;
+	for (int i = 0; i < NUM_FILE_MAPS; i++)
+		munmap(FILE_MAPS[i].addr, FILE_MAPS[i].size);
+	NUM_FILE_MAPS = 0;
+}
+
+/*
+Procedure : region_residency
+Purpose   : Mark the pages of region i that take host memory, i.e. the written
+			pages of its own mapping and the touched pages mapped from files
+			(guest pages are assumed to be host pages, 4 KiB)
+*/
+void region_residency(int i, unsigned char *resident)
+{
+	uint32_t first, last;
+	region_pages(i, &first, &last);
+	uint8_t *base = MEM_REGIONS[i].mem - (MEM_REGIONS[i].start & MEM_PAGE_MASK);
+	if (mincore(base, (size_t)(last - first + 1) << MEM_PAGE_SHIFT, resident) != 0)
+		memset(resident, 1, last - first + 1);
+	for (uint32_t p = first; p <= last; p++)
+	{
+		uint8_t *page = host_page(p);
+		if (page != base + ((size_t)(p - first) << MEM_PAGE_SHIFT) && mincore(page, MEM_PAGE_SIZE, &resident[p - first]) != 0)
+			resident[p - first] = 1;
+		resident[p - first] &= 1;
+	}
+}
+
+/*
+Procedure : resident_pages
+Purpose   : Count the guest pages of region i (all regions if i < 0) that take host memory
+*/
+uint32_t resident_pages(int i)
+{
+	if (i < 0)
+	{
+		uint32_t total = 0;
+		for (int k = 0; k < MEM_NREGIONS; k++)
+			total += resident_pages(k);
+		return total;
+	}
+	uint32_t first, last, count = 0;
+	region_pages(i, &first, &last);
+	unsigned char *resident = new unsigned char[last - first + 1];
+	region_residency(i, resident);
+	for (uint32_t p = 0; p <= last - first; p++)
+		count += resident[p];
+	delete[] resident;
+	return count;
+}
+
+/*
+checkpoint file: a header, the page index and the stored pages.
+The page index has one entry per page of every region in order, 0 for a page
+of zeros (not stored) or k for the k-th stored page. Stored pages start at the
+first page boundary after the index, so that the file can be mapped directly.
+*/
+#define CHECKPOINT_MAGIC "MIPSCKP2"
+typedef struct
+{
+	char magic[8];
+	CPU_State state;
+	uint64_t instruction_count;
+	int32_t run_bit;
+	uint32_t last_exception;
+	uint32_t num_regions;
+	struct
+	{
+		uint32_t start, size;
+	} regions[MEM_NREGIONS];
+	uint32_t num_pages;	 /* entries of the page index */
+	uint32_t num_stored; /* pages stored after the index */
+	uint32_t heap_start, heap_break;
+} checkpoint_header_t;
+
+inline size_t checkpoint_data_offset(uint32_t num_pages)
+{
+	size_t bytes = sizeof(checkpoint_header_t) + (size_t)num_pages * sizeof(uint32_t);
+	return (bytes + MEM_PAGE_MASK) & ~(size_t)MEM_PAGE_MASK;
+}
+
+/* the regions of a checkpoint neither wrap nor overlap, and the page index has an entry for each of their pages */
+int checkpoint_regions_valid(const checkpoint_header_t *header)
+{
+	uint64_t num_pages = 0;
 	for (int i = 0; i < MEM_NREGIONS; i++)
 	{
-		MEM_REGIONS[i].mem = new uint8_t[MEM_REGIONS[i].size];
-		memset(MEM_REGIONS[i].mem, 0, MEM_REGIONS[i].size);
+		uint64_t start = header->regions[i].start, end = start + header->regions[i].size;
+		if (start == end || end > ((uint64_t)1 << 32))
+			return FALSE;
+		for (int j = 0; j < i; j++)
+			if (start < (uint64_t)header->regions[j].start + header->regions[j].size && header->regions[j].start < end)
+				return FALSE;
+		num_pages += ((end - 1) >> MEM_PAGE_SHIFT) - (start >> MEM_PAGE_SHIFT) + 1;
 	}
+	return num_pages == header->num_pages;
 }
 
+/*
+Procedure : save_checkpoint
+Purpose   : Write the machine state and the non-zero pages of memory to a file
+*/
+int save_checkpoint(const char *filename)
+{
+	checkpoint_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.state = CURRENT_STATE;
+	header.instruction_count = INSTRUCTION_COUNT;
+	header.run_bit = RUN_BIT;
+	header.last_exception = LAST_EXCEPTION;
+	header.heap_start = HEAP_START;
+	header.heap_break = HEAP_BREAK;
+	header.num_regions = MEM_NREGIONS;
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		header.regions[i].start = MEM_REGIONS[i].start;
+		header.regions[i].size = MEM_REGIONS[i].size;
+		header.num_pages += last - first + 1;
+	}
+	uint32_t *index = new uint32_t[header.num_pages];
+	for (int i = 0, k = 0; i < MEM_NREGIONS; i++)
+	{
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		uint8_t *base = MEM_REGIONS[i].mem - (MEM_REGIONS[i].start & MEM_PAGE_MASK);
+		unsigned char *resident = new unsigned char[last - first + 1];
+		region_residency(i, resident);
+		for (uint32_t p = first; p <= last; p++, k++)
+		{
+			/* a page of the region's own mapping that was never written is zero */
+			uint8_t *page = host_page(p);
+			int zero = (!resident[p - first] && page == base + ((size_t)(p - first) << MEM_PAGE_SHIFT)) ||
+					   (page[0] == 0 && memcmp(page, page + 1, MEM_PAGE_SIZE - 1) == 0);
+			index[k] = zero ? 0 : ++header.num_stored;
+		}
+		delete[] resident;
+	}
+
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL)
+	{
+		printf("@ Error: Can't create checkpoint file %s\n", filename);
+		delete[] index;
+		return FALSE;
+	}
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+			 fwrite(index, sizeof(uint32_t), header.num_pages, file) == header.num_pages &&
+			 fseek(file, checkpoint_data_offset(header.num_pages), SEEK_SET) == 0;
+	for (int i = 0, k = 0; ok && i < MEM_NREGIONS; i++)
+	{
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		for (uint32_t p = first; ok && p <= last; p++, k++)
+			if (index[k] != 0)
+				ok = fwrite(host_page(p), MEM_PAGE_SIZE, 1, file) == 1;
+	}
+	ok = (fclose(file) == 0) && ok;
+	if (!ok)
+		printf("@ Error: Can't write checkpoint file %s\n", filename);
+	else if (!batch_mode)
+		printf("@ Checkpoint written to %s (%u of %u pages stored)\n", filename, header.num_stored, header.num_pages);
+	delete[] index;
+	return ok;
+}
+
+/*
+Procedure : restore_checkpoint
+Purpose   : Replace the machine by the one saved in a checkpoint file. The
+			stored pages are mapped copy-on-write straight from the file, so
+			only pages that are touched are ever read.
+*/
+int restore_checkpoint(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("@ Error: Can't open checkpoint file %s\n", filename);
+		if (fd >= 0)
+			close(fd);
+		return FALSE;
+	}
+	checkpoint_header_t header;
+	int ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+			 memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+			 header.num_regions == MEM_NREGIONS && checkpoint_regions_valid(&header) &&
+			 checkpoint_data_offset(header.num_pages) + (size_t)header.num_stored * MEM_PAGE_SIZE <= (size_t)st.st_size;
+	void *map = ok ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("@ Error: %s is not a valid checkpoint file\n", filename);
+		return FALSE;
+	}
+
+	free_memory();
+	for (int i = 0; i < MEM_NREGIONS; i++)
+	{
+		MEM_REGIONS[i].start = header.regions[i].start;
+		MEM_REGIONS[i].size = header.regions[i].size;
+	}
+	init_memory();
+	FILE_MAPS[NUM_FILE_MAPS++] = {(uint8_t *)map, (size_t)st.st_size};
+	const uint32_t *index = (const uint32_t *)((uint8_t *)map + sizeof(header));
+	uint8_t *data = (uint8_t *)map + checkpoint_data_offset(header.num_pages);
+	for (int i = 0, k = 0; i < MEM_NREGIONS; i++)
+	{
+		uint32_t first, last;
+		region_pages(i, &first, &last);
+		for (uint32_t p = first; p <= last; p++, k++)
+			if (index[k] != 0 && index[k] <= header.num_stored)
+				map_page(p, data + (size_t)(index[k] - 1) * MEM_PAGE_SIZE);
+	}
+	watch_pages(TRUE);
+
+	CURRENT_STATE = NEXT_STATE = header.state;
+	INSTRUCTION_COUNT = header.instruction_count;
+	RUN_BIT = header.run_bit;
+	LAST_EXCEPTION = header.last_exception;
+	/* the files the guest opened are not saved, it starts without them */
+	syscall_reset(header.heap_start, header.heap_break);
+	/* the mix counts from the restored state on, history starts there */
+	mix_reset();
+	if (reverse_model)
+		reverse_reset();
+	if (!batch_mode)
+		printf("@ Restored %s (%u of %u pages stored)\n", filename, header.num_stored, header.num_pages);
+	return TRUE;
+}
+
+/* bytes of the text (and data) segment the program files loaded so far fill */
+thread_local uint32_t TEXT_LOADED = 0, DATA_LOADED = 0;
+thread_local int NUM_PROGRAMS = 0;
+
 /*
 Procedure : load_program
-Purpose   : Load program and service routines into mem.
+Purpose   : Load program and service routines into mem: an ELF executable
+			where its headers say, a raw image or an assembly source (.s)
+			after the text and data loaded before; the first program sets
+			the PC
 */
-void load_program(char *program_filename)
+int load_program(char *program_filename)
 {
+	double start = wall_time();
+	mem_region_t *text = &MEM_REGIONS[REGION_TEXT], *data = &MEM_REGIONS[REGION_DATA];
+	uint32_t entry = text->start + TEXT_LOADED;
+
+	const char *extension = strrchr(program_filename, '.');
+	if (extension && strcmp(extension, ".s") == 0)
+	{
+		uint32_t text_end, data_end;
+		if (!assemble_program(program_filename, text->start + TEXT_LOADED, data->start + DATA_LOADED, &entry,
+							  &text_end, &data_end))
+			return FALSE;
+		TEXT_LOADED = (text_end - text->start + 3) & ~3u;
+		DATA_LOADED = (data_end - data->start + 3) & ~3u;
+		reset_decoded();
+		if (NUM_PROGRAMS++ == 0)
+			CURRENT_STATE.PC = entry;
+		if (!batch_mode)
+			printf("@ Assembled %s, entry %08x, in %.3f ms.\n\n", program_filename, entry,
+				   (wall_time() - start) * 1e3);
+		return TRUE;
+	}
+
 	/* Open program file. */
-	FILE *prog = fopen(program_filename, "rb");
-	if (prog == NULL)
+	int fd = open(program_filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
 	{
 		printf("@ Error: Can't open program file %s\n", program_filename);
-		exit(-1);
+		if (fd >= 0)
+			close(fd);
+		return FALSE;
 	}
 
-	/* Read in the program. */
-	int offset = 0, word;
-	while (TRUE)
+	unsigned char magic[SELFMAG];
+	if (pread(fd, magic, SELFMAG, 0) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0)
 	{
-		if (!(int)fread(&word, sizeof(word), 1, prog))
-			break;
-		mem_write_32(MEM_TEXT_START + offset, word);
-		offset += 4;
+		void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		close(fd);
+		if (image == MAP_FAILED)
+		{
+			printf("@ Error: Can't map program file %s\n", program_filename);
+			return FALSE;
+		}
+		uint32_t text_end = text->start + TEXT_LOADED, data_end = data->start + DATA_LOADED;
+		int loaded = load_elf(program_filename, (uint8_t *)image, st.st_size, &entry, &text_end, &data_end);
+		munmap(image, st.st_size);
+		if (!loaded)
+			return FALSE;
+		/* raw images and sources loaded after it follow its text and data */
+		TEXT_LOADED = (text_end - text->start + 3) & ~3u;
+		DATA_LOADED = (data_end - data->start + 3) & ~3u;
+		reset_decoded();
+		if (NUM_PROGRAMS++ == 0)
+			CURRENT_STATE.PC = entry;
+		if (!batch_mode)
+			printf("@ Loaded ELF program %s, entry %08x, in %.3f ms.\n\n", program_filename, entry,
+				   (wall_time() - start) * 1e3);
+		return TRUE;
+	}
+
+	/*
+	A raw image is loaded at the start of the text segment, or after the
+	images loaded before. If the text segment starts at a page boundary, the
+	pages of the first image are mapped copy-on-write into the page table;
+	otherwise the whole words of the image are copied in at once.
+	*/
+	size_t bytes = st.st_size & ~(size_t)3;
+	if (bytes > text->size - TEXT_LOADED)
+	{
+		printf("@ Warning: %s is larger than the rest of the text segment, only %u bytes are loaded\n",
+			   program_filename, text->size - TEXT_LOADED);
+		bytes = text->size - TEXT_LOADED;
+	}
+	int mapped = (text->start & MEM_PAGE_MASK) == 0 && TEXT_LOADED == 0 && bytes == (size_t)st.st_size &&
+				 NUM_FILE_MAPS < MAX_FILE_MAPS;
+	if (bytes > 0)
+	{
+		void *image = mmap(NULL, bytes, PROT_READ | (mapped ? PROT_WRITE : 0),
+						   MAP_PRIVATE | (mapped ? 0 : MAP_POPULATE), fd, 0);
+		if (image == MAP_FAILED)
+		{
+			printf("@ Error: Can't map program file %s\n", program_filename);
+			close(fd);
+			return FALSE;
+		}
+		if (mapped)
+		{
+			/* the rest of the last page reads as zeros */
+			FILE_MAPS[NUM_FILE_MAPS++] = {(uint8_t *)image, bytes};
+			for (size_t offset = 0; offset < bytes; offset += MEM_PAGE_SIZE)
+				map_page((text->start + offset) >> MEM_PAGE_SHIFT, (uint8_t *)image + offset);
+		}
+		else
+		{
+			mem_load(text->start + TEXT_LOADED, (uint8_t *)image, bytes);
+			munmap(image, bytes);
+		}
+		TEXT_LOADED += bytes;
+		reset_decoded();
 	}
+	close(fd);
 
-	CURRENT_STATE.PC = MEM_TEXT_START;
-	printf("@ Read %d words from program into memory.\n\n", offset / 4);
-	fclose(prog);
+	if (NUM_PROGRAMS++ == 0)
+		CURRENT_STATE.PC = entry;
+	if (!batch_mode)
+		printf("@ Read %d words from program into memory in %.3f ms.\n\n",
+			   (int)(bytes / 4), (wall_time() - start) * 1e3);
+	return TRUE;
 }
 
 /*
 Procedure : initialize
 Purpose   : Load machine language program and set up initial state of the machine.
 */
-void initialize(char *program_filename, int num_prog_files)
+int initialize(char *program_files[], int num_prog_files)
 {
 	init_memory();
+	TEXT_LOADED = DATA_LOADED = 0;
+	NUM_PROGRAMS = 0;
+	symbols_reset();
 	for (int i = 0; i < num_prog_files; i++)
-	{
-		load_program(program_filename);
-		while (*program_filename++ != '\0')
-			;
-	}
+		if (!load_program(program_files[i]))
+			return FALSE;
+	/* the heap starts after the data of the programs */
+	uint32_t heap_start = MEM_REGIONS[REGION_DATA].start + DATA_LOADED;
+	syscall_reset(heap_start, heap_start);
 	NEXT_STATE = CURRENT_STATE;
 	RUN_BIT = TRUE;
+	mix_reset();
+	/* a new machine starts with cold caches */
+	if (cache_model)
+		cache_reset();
+	if (bpred_model)
+		bpred_reset();
+	return TRUE;
+}
+
+/* Procedure : usage */
+void usage(char *prog_name)
+{
+	printf("@ Error: usage: %s [options] <program_file_1> <program_file_2> ...\n", prog_name);
+	printf("\t--mem {region}={start}:{size}\tplace region text/data/stack/kdata/ktext\n");
+	printf("\t--engine reference|threaded|jit\tselect the execution engine\n");
+	printf("\t--batch {script}\t\trun the commands in {script} without console output\n");
+	printf("\t--run\t\t\t\trun until halted without console output\n");
+	printf("\t--max-insns {num}\t\texecute at most {num}(dec) instructions\n");
+	printf("\t--pipeline\t\t\ttime the execution with the 5-stage pipeline model\n");
+	printf("\t--cache {cache}={size}:{ways}:{line}[:lru|plru|random[:wb|wt]],...\n");
+	printf("\t\t\t\t\tsimulate the caches l1i/l1d/l2 (\"default\": 16k:4:32 L1s)\n");
+	printf("\t--bpred static|bimodal|gshare|tournament|tage[:{bits}]\n");
+	printf("\t\t\t\t\tpredict the branches with tables of 2^{bits} entries\n");
+	printf("\t--profile {file}\t\tcount the executions of every PC, write the hot spots\n");
+	printf("\t\t\t\t\tto {file} when the session ends\n");
+	printf("\t--reverse\t\t\tkeep an undo log, so that back can step back\n");
+	printf("\t--trace {file}\t\t\ttrace the executed instructions to the binary {file}\n");
+	printf("\t--cosim insn|block|{num}\tcheck the engine against the reference every instruction,\n");
+	printf("\t\t\t\t\tbasic block or {num} instructions, stop where they diverge\n");
+	printf("\t--asm-cache {dir}\t\tkeep the images of assembled .s programs in {dir}\n");
+	printf("\t--restore {file}\t\tstart from a checkpoint instead of program files\n");
+	printf("\t--checkpoint {file}\t\tsave a checkpoint when the session ends\n");
+	printf("\t--farm [--jobs {num}]\t\trun every program file (@{list}: the files listed in {list})\n");
+	printf("\t\t\t\t\ton its own on {num} threads and print a summary\n");
+	printf("\tin batch mode the registers are dumped at exit, the exit status is\n");
+	printf("\t%d: halted by syscall (exit2: its status), %d: exception, %d: still running (budget exhausted)\n",
+		   EXIT_HALTED, EXIT_EXCEPTION, EXIT_RUNNING);
+	exit(1);
 }
 
+/*
+Procedure : batch_status
+Purpose   : Dump the final registers of a batch run and return its exit status
+*/
+int batch_status(FILE *dumpsim_file)
+{
+	dump_stdout = dump_file = TRUE;
+	if (pipeline_model)
+		pipeline_report();
+	if (cache_model)
+		cache_report();
+	if (bpred_model)
+		bpred_report();
+	rdump(dumpsim_file);
+	if (LAST_EXCEPTION)
+		return EXIT_EXCEPTION;
+	/* a guest halting with exit2 gives its own status */
+	return RUN_BIT ? EXIT_RUNNING : EXIT_STATUS & 0xff;
+}
+
+#ifndef NO_SHELL_MAIN
 /* Procedure : main */
 int main(int argc, char *argv[])
 {
 	/* Error Checking */
-	if (argc < 2)
+	int argi = 1, run_only = FALSE, farm_jobs = 0;
+	char *restore_file = NULL, *checkpoint_file = NULL, *profile_file = NULL, *trace_file = NULL;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++)
 	{
-		printf("@ Error: usage: %s <program_file_1> <program_file_2> ...\n", argv[0]);
-		exit(1);
+		if (strcmp(argv[argi], "--mem") == 0 && argi + 1 < argc)
+		{
+			if (!config_region(argv[++argi]))
+			{
+				printf("@ Error: Bad memory region %s\n", argv[argi]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[argi], "--engine") == 0 && argi + 1 < argc)
+		{
+			if ((sim_engine = engine_by_name(argv[++argi])) < 0)
+				usage(argv[0]);
+		}
+		else if (strcmp(argv[argi], "--batch") == 0 && argi + 1 < argc)
+		{
+			if ((command_file = fopen(argv[++argi], "r")) == NULL)
+			{
+				printf("@ Error: Can't open command script %s\n", argv[argi]);
+				exit(1);
+			}
+			batch_mode = TRUE;
+		}
+		else if (strcmp(argv[argi], "--run") == 0)
+			batch_mode = run_only = TRUE;
+		else if (strcmp(argv[argi], "--max-insns") == 0 && argi + 1 < argc)
+			INSTRUCTION_BUDGET = strtoull(argv[++argi], NULL, 10);
+		else if (strcmp(argv[argi], "--farm") == 0)
+			farm_mode = batch_mode = TRUE;
+		else if (strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc)
+			farm_jobs = atoi(argv[++argi]);
+		else if (strcmp(argv[argi], "--pipeline") == 0)
+			pipeline_model = TRUE;
+		else if (strcmp(argv[argi], "--cache") == 0 && argi + 1 < argc)
+		{
+			if (!cache_config(argv[++argi]))
+			{
+				printf("@ Error: Bad cache configuration %s\n", argv[argi]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[argi], "--bpred") == 0 && argi + 1 < argc)
+		{
+			if (!bpred_config(argv[++argi]))
+			{
+				printf("@ Error: Bad branch predictor %s\n", argv[argi]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[argi], "--profile") == 0 && argi + 1 < argc)
+		{
+			profile_file = argv[++argi];
+			profile_model = TRUE;
+		}
+		else if (strcmp(argv[argi], "--reverse") == 0)
+			reverse_model = TRUE;
+		else if (strcmp(argv[argi], "--trace") == 0 && argi + 1 < argc)
+			trace_file = argv[++argi];
+		else if (strcmp(argv[argi], "--cosim") == 0 && argi + 1 < argc)
+		{
+			if (!cosim_config(argv[++argi]))
+			{
+				printf("@ Error: Bad co-simulation interval %s\n", argv[argi]);
+				exit(1);
+			}
+		}
+		else if (strcmp(argv[argi], "--asm-cache") == 0 && argi + 1 < argc)
+			asm_cache_dir = argv[++argi];
+		else if (strcmp(argv[argi], "--restore") == 0 && argi + 1 < argc)
+			restore_file = argv[++argi];
+		else if (strcmp(argv[argi], "--checkpoint") == 0 && argi + 1 < argc)
+			checkpoint_file = argv[++argi];
+		else
+			usage(argv[0]);
 	}
-	printf("@ MIPS Simulator Start\n\n");
+	if ((argi >= argc) == (restore_file == NULL) || (run_only && command_file != stdin) ||
+		(farm_mode && (run_only || command_file != stdin || restore_file || checkpoint_file || trace_file || reverse_model ||
+					   pipeline_model || cache_model || bpred_model || profile_file)) ||
+		(cosim_model && (farm_mode || pipeline_model || cache_model || bpred_model || trace_file || reverse_model)))
+		usage(argv[0]);
+	if (farm_mode)
+		return run_farm(argv + argi, argc - argi, farm_jobs);
+	if (!batch_mode)
+		printf("@ MIPS Simulator Start\n\n");
 
-	initialize(argv[1], argc - 1);
+	if (restore_file ? !restore_checkpoint(restore_file) : !initialize(argv + argi, argc - argi))
+		exit(-1);
+	if (trace_file && !trace_open(trace_file))
+		exit(-1);
+	if (reverse_model)
+		reverse_reset();
 
 	FILE *dumpsim_file = fopen("dumpsim", "w");
 	if (dumpsim_file == NULL)
@@ -536,7 +1935,18 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	while (!quit_process)
-		get_command(dumpsim_file);
+	if (run_only)
+		go();
+	else
+		while (!quit_process)
+			get_command(dumpsim_file);
+	if (checkpoint_file && !save_checkpoint(checkpoint_file))
+		exit(-1);
+	if (profile_file && !profile_report(profile_file))
+		exit(-1);
+	trace_close();
+	int status = batch_mode ? batch_status(dumpsim_file) : 0;
 	fclose(dumpsim_file);
+	return status;
 }
+#endif
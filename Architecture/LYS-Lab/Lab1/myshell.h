@@ -6,11 +6,51 @@
 #define _SIM_SHELL_H_
 
 #include <cstdint>
+#include <cstdio>
 
 #define FALSE 0
 #define TRUE 1
 #define MIPS_REGS 32
 
+/* memory layout */
+#define MEM_DATA_START 0x10000000
+#define MEM_DATA_SIZE 0x00100000
+// #define MEM_TEXT_START 0x00400000 原始定义
+#define MEM_TEXT_START 0x00400028
+#define MEM_TEXT_SIZE 0x00100000
+#define MEM_STACK_START 0x7ff00000
+#define MEM_STACK_SIZE 0x00100000
+#define MEM_KDATA_START 0x90000000
+#define MEM_KDATA_SIZE 0x00100000
+#define MEM_KTEXT_START 0x80000000
+#define MEM_KTEXT_SIZE 0x00100000
+
+/* guest memory is mapped in pages of 4 KiB */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+
+typedef struct
+{
+  const char *name;
+  uint32_t start, size;
+  uint8_t *mem;
+} mem_region_t;
+
+enum
+{
+  REGION_TEXT,
+  REGION_DATA,
+  REGION_STACK,
+  REGION_KDATA,
+  REGION_KTEXT,
+  MEM_NREGIONS
+};
+extern thread_local mem_region_t MEM_REGIONS[MEM_NREGIONS];
+// software page table (see myshell.cpp), also walked by the code the JIT emits
+#define PT_ENTRIES 1024
+extern thread_local uint8_t **PAGE_TABLE[PT_ENTRIES];
+
 typedef struct CPU_State_Struct
 {
   uint32_t PC;              /* program counter */
@@ -18,17 +58,135 @@ typedef struct CPU_State_Struct
   uint32_t HI, LO;          /* special regs for mult/div. */
 } CPU_State;
 
+/*
+Everything describing one simulated machine is thread_local, so that the
+farm (--farm) can run one simulation per thread.
+*/
 /* CPU State info */
-extern CPU_State CURRENT_STATE, NEXT_STATE;
-extern int RUN_BIT; /* run bit */
+extern thread_local CPU_State CURRENT_STATE, NEXT_STATE;
+extern thread_local int RUN_BIT; /* run bit */
+extern thread_local uint64_t INSTRUCTION_COUNT, INSTRUCTION_BUDGET;
+extern thread_local uint32_t LAST_EXCEPTION; /* error code of the last exception, 0 if none */
+
+/* exit status of a batch run */
+#define EXIT_HALTED 0
+#define EXIT_ERROR 1
+#define EXIT_EXCEPTION 2
+#define EXIT_RUNNING 3
 
 /* debug parameters */
-extern int show_assemble, show_detail;
-extern int dump_stdout, dump_file;
+extern thread_local int show_assemble, show_detail;
+extern thread_local int dump_stdout, dump_file;
+extern int batch_mode, farm_mode;
+
+/* execution engine used by go and run */
+extern const char *ENGINE_NAMES[];
+extern int sim_engine;
+
+int initialize(char *program_files[], int num_prog_files);
+void init_memory();
+void free_memory();
+uint32_t resident_pages(int region);
+int save_checkpoint(const char *filename);
+int restore_checkpoint(const char *filename);
+void cycle();
+uint64_t execute(uint64_t num_cycles);
+double wall_time();
+int run_farm(char *program_files[], int num_prog_files, int num_threads);
 
 uint32_t mem_read_32(uint32_t address);
+uint32_t mem_read_part(uint32_t address, uint32_t size);
+uint32_t mem_peek_32(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+int mem_load(uint32_t address, const uint8_t *src, uint32_t size);
+int mem_read(uint32_t address, uint8_t *dst, uint32_t size);
+
+void reset_decoded();
+void invalidate_decoded(uint32_t address);
+
+/* ELF32 executables and their symbols */
+int load_elf(const char *filename, const uint8_t *image, size_t size, uint32_t *entry, uint32_t *text_end,
+             uint32_t *data_end);
+void add_symbols(const char *const *names, const uint32_t *values, uint32_t num);
+void symbols_reset();
+void print_symbol(uint32_t address);
+
+/* programs in assembly (.s), assembled as they are loaded */
+extern char *asm_cache_dir;
+int assemble_program(const char *filename, uint32_t text_origin, uint32_t data_origin, uint32_t *entry,
+                     uint32_t *text_end, uint32_t *data_end);
+
+/* SPIM system calls: the guest's heap and buffered output */
+extern thread_local uint32_t HEAP_START, HEAP_BREAK;
+extern thread_local uint32_t EXIT_STATUS; /* $a0 of exit2 */
+void syscall_reset(uint32_t heap_start, uint32_t heap_break);
+void syscall_flush();
+
+/* pipeline timing model (--pipeline) */
+typedef struct
+{
+  uint64_t instructions, cycles;
+  uint64_t load_use_stalls, muldiv_stalls, branch_stalls;
+} pipeline_stats_t;
+extern int pipeline_model;
+extern thread_local pipeline_stats_t PIPELINE_STATS;
+void pipeline_reset();
+uint64_t run_pipeline(uint64_t max_ins);
+void pipeline_report();
+
+/* cache hierarchy model (--cache) */
+extern int cache_model;
+int cache_config(const char *spec);
+void cache_reset();
+void cache_fetch(uint32_t address);
+void cache_data(uint32_t address, int write);
+void cache_report();
+
+/* branch prediction (--bpred) */
+extern int bpred_model;
+int bpred_config(const char *spec);
+void bpred_reset();
+void bpred_report();
+
+/* execution profile (--profile) */
+extern int profile_model;
+void profile_reset();
+int profile_report(const char *filename);
+
+/* dynamic instruction mix */
+void mix_reset();
+void mix_fold();
+void mix_print(FILE *file);
+
+/* binary execution trace (--trace), decoded by simtrace */
+extern int trace_model;
+int trace_open(const char *filename);
+void trace_close();
+void trace_sync();
+
+/* reverse execution (--reverse) and breakpoints */
+extern int reverse_model;
+void reverse_reset();
+uint64_t reverse_back(uint64_t num);
+int reverse_continue();
+void reverse_report();
+void reverse_barrier();
+int is_breakpoint(uint32_t pc);
+
+/* watchpoints */
+extern thread_local int watch_model;
+
+/* lockstep co-simulation of the engine against the reference (--cosim) */
+#define COSIM_BLOCK 0xffffffffu /* cosim_interval of basic blocks */
+extern int cosim_model, cosim_recording, cosim_silent;
+extern uint32_t cosim_interval;
+int cosim_config(const char *spec);
+void cosim_write(uint32_t address, uint32_t value);
+uint64_t run_cosim(uint64_t max_ins, uint64_t (*candidate)(uint64_t));
 
 void process_instruction();
+void step_instruction();
+uint64_t run_threaded(uint64_t max_ins);
+uint64_t run_jit(uint64_t max_ins);
 void explain_instruction(uint32_t ins_address, uint32_t err, uint32_t verbose);
 #endif
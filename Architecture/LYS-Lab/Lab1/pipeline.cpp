@@ -0,0 +1,258 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   5-stage pipeline timing model                             */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+The instructions are executed by step_instruction as usual, the model only
+works out when each of them would pass through a classic IF/ID/EX/MEM/WB
+pipeline with full forwarding. An instruction enters EX one cycle after the
+previous one, later if
+- an operand is not ready yet: the result of a load can only be forwarded
+  from MEM/WB, one cycle too late for the next instruction (load-use stall),
+  HI/LO are ready only when MULT/DIV is done,
+- the multiply/divide unit, which is not pipelined, is still busy,
+- the previous instruction was a jump or a taken branch: branches are
+  predicted not taken and resolved in EX, J/JAL in ID, the instructions
+  fetched after them are squashed.
+*/
+
+#define PIPE_MULT_LATENCY 12 // cycles until HI/LO hold the product
+#define PIPE_DIV_LATENCY 35  // cycles until HI/LO hold quotient and remainder
+#define PIPE_JUMP_PENALTY 1  // squashed by J/JAL
+#define PIPE_BRANCH_PENALTY 2 // squashed by a taken branch or JR/JALR
+
+// operands, results and kinds of instructions
+enum
+{
+    SRC_RS = 1,
+    SRC_RT = 2,
+    SRC_STORE = 4, // rt, needed in MEM only
+    SRC_HI = 8,
+    SRC_LO = 16
+};
+enum
+{
+    DST_NONE,
+    DST_RD,
+    DST_RT,
+    DST_31,
+    DST_HILO
+};
+enum
+{
+    K_ALU,
+    K_LOAD,
+    K_MULT,
+    K_DIV,
+    K_BRANCH,
+    K_JUMP,
+    K_JUMP_REG
+};
+typedef struct
+{
+    uint8_t src, dst, kind;
+} pipe_class_t;
+
+int pipeline_model = FALSE;
+thread_local pipeline_stats_t PIPELINE_STATS;
+
+// cycle in which each register / HI and LO can be used in EX, in which the
+// multiply/divide unit is free, and in which the last instruction was in EX
+thread_local uint64_t reg_ready[MIPS_REGS], hilo_ready, muldiv_free, last_ex;
+thread_local uint32_t fetch_bubbles;
+thread_local pipe_class_t pipe_classes[OP_COUNT];
+
+pipe_class_t pipe_class(int opid)
+{
+    switch (opid)
+    {
+    case OP_SLL:
+    case OP_SRL:
+    case OP_SRA:
+        return {SRC_RT, DST_RD, K_ALU};
+    case OP_JR:
+        return {SRC_RS, DST_NONE, K_JUMP_REG};
+    case OP_JALR:
+        return {SRC_RS, DST_RD, K_JUMP_REG};
+    case OP_MFHI:
+        return {SRC_HI, DST_RD, K_ALU};
+    case OP_MFLO:
+        return {SRC_LO, DST_RD, K_ALU};
+    case OP_MTHI:
+    case OP_MTLO:
+        return {SRC_RS, DST_HILO, K_ALU};
+    case OP_MULT:
+    case OP_MULTU:
+        return {SRC_RS | SRC_RT, DST_HILO, K_MULT};
+    case OP_DIV:
+    case OP_DIVU:
+        return {SRC_RS | SRC_RT, DST_HILO, K_DIV};
+    case OP_SLLV:
+    case OP_SRLV:
+    case OP_SRAV:
+    case OP_ADD:
+    case OP_ADDU:
+    case OP_SUB:
+    case OP_SUBU:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_NOR:
+    case OP_SLT:
+    case OP_SLTU:
+        return {SRC_RS | SRC_RT, DST_RD, K_ALU};
+    case OP_J:
+        return {0, DST_NONE, K_JUMP};
+    case OP_JAL:
+        return {0, DST_31, K_JUMP};
+    case OP_BLTZ:
+    case OP_BGEZ:
+    case OP_BLEZ:
+    case OP_BGTZ:
+        return {SRC_RS, DST_NONE, K_BRANCH};
+    case OP_BLTZAL:
+    case OP_BGEZAL:
+        return {SRC_RS, DST_31, K_BRANCH};
+    case OP_BEQ:
+    case OP_BNE:
+        return {SRC_RS | SRC_RT, DST_NONE, K_BRANCH};
+    case OP_ADDI:
+    case OP_ADDIU:
+    case OP_SLTI:
+    case OP_SLTIU:
+    case OP_ANDI:
+    case OP_ORI:
+    case OP_XORI:
+        return {SRC_RS, DST_RT, K_ALU};
+    case OP_LUI:
+        return {0, DST_RT, K_ALU};
+    case OP_LB:
+    case OP_LH:
+    case OP_LW:
+    case OP_LBU:
+    case OP_LHU:
+        return {SRC_RS, DST_RT, K_LOAD};
+    case OP_SB:
+    case OP_SH:
+    case OP_SW:
+        return {SRC_RS | SRC_STORE, DST_NONE, K_ALU};
+    default:
+        return {0, DST_NONE, K_ALU};
+    }
+}
+
+/*
+Procedure : pipeline_reset
+Purpose   : Start timing with an empty pipeline
+*/
+void pipeline_reset()
+{
+    memset(&PIPELINE_STATS, 0, sizeof(PIPELINE_STATS));
+    memset(reg_ready, 0, sizeof(reg_ready));
+    hilo_ready = muldiv_free = fetch_bubbles = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        pipe_classes[op] = pipe_class(op);
+    // the first instruction is fetched in cycle 1 and reaches EX in cycle 3
+    last_ex = 2;
+}
+
+// account for the instruction d which has just been executed
+inline void pipeline_time(const decoded_ins_t *d, int redirected)
+{
+    pipe_class_t c = pipe_classes[d->opid];
+    uint64_t ex = last_ex + 1 + fetch_bubbles, ready = ex, need;
+    PIPELINE_STATS.branch_stalls += fetch_bubbles;
+    fetch_bubbles = 0;
+
+    // operands forwarded to EX (store data to MEM, one cycle later)
+    if ((c.src & SRC_RS) && (need = reg_ready[d->rs]) > ready)
+        ready = need;
+    if ((c.src & SRC_RT) && (need = reg_ready[d->rt]) > ready)
+        ready = need;
+    if ((c.src & SRC_STORE) && (need = reg_ready[d->rt]) > ready + 1)
+        ready = need - 1;
+    PIPELINE_STATS.load_use_stalls += ready - ex;
+    ex = ready;
+    if ((c.src & (SRC_HI | SRC_LO)) && hilo_ready > ex)
+    {
+        PIPELINE_STATS.muldiv_stalls += hilo_ready - ex;
+        ex = hilo_ready;
+    }
+    if ((c.kind == K_MULT || c.kind == K_DIV) && muldiv_free > ex)
+    {
+        PIPELINE_STATS.muldiv_stalls += muldiv_free - ex;
+        ex = muldiv_free;
+    }
+
+    switch (c.dst)
+    {
+    case DST_RD:
+        reg_ready[d->rd] = ex + (c.kind == K_LOAD ? 2 : 1);
+        break;
+    case DST_RT:
+        reg_ready[d->rt] = ex + (c.kind == K_LOAD ? 2 : 1);
+        break;
+    case DST_31:
+        reg_ready[31] = ex + 1;
+        break;
+    case DST_HILO:
+        hilo_ready = ex + (c.kind == K_MULT ? PIPE_MULT_LATENCY : c.kind == K_DIV ? PIPE_DIV_LATENCY : 1);
+        if (c.kind != K_ALU)
+            muldiv_free = hilo_ready;
+        break;
+    }
+    reg_ready[0] = 0;
+
+    if (c.kind == K_JUMP)
+        fetch_bubbles = PIPE_JUMP_PENALTY;
+    else if ((c.kind == K_BRANCH && redirected) || c.kind == K_JUMP_REG)
+        fetch_bubbles = PIPE_BRANCH_PENALTY;
+    last_ex = ex;
+    PIPELINE_STATS.instructions++;
+    // the instruction leaves WB two cycles after EX
+    PIPELINE_STATS.cycles = ex + 2;
+}
+
+/*
+Procedure : run_pipeline
+Purpose   : Execute at most max_ins instructions or until halted with the
+            timing model, return the number of instructions executed
+*/
+uint64_t run_pipeline(uint64_t max_ins)
+{
+    uint64_t count = 0;
+    if (PIPELINE_STATS.instructions == 0)
+        pipeline_reset();
+    for (; count < max_ins && RUN_BIT; count++)
+    {
+        uint32_t pc = CURRENT_STATE.PC;
+        const decoded_ins_t *d = step_decoded();
+        pipeline_time(d, CURRENT_STATE.PC != pc + 4);
+    }
+    NEXT_STATE = CURRENT_STATE;
+    return count;
+}
+
+/*
+Procedure : pipeline_report
+Purpose   : Print cycles, CPI and the stall cycles of the timed instructions
+*/
+void pipeline_report()
+{
+    pipeline_stats_t *s = &PIPELINE_STATS;
+    printf("@ Pipeline timing :\n");
+    printf("-------------------------------------\n");
+    printf("Instructions : %llu\n", (unsigned long long)s->instructions);
+    printf("Cycles       : %llu\n", (unsigned long long)s->cycles);
+    printf("CPI          : %.3f\n", s->instructions ? (double)s->cycles / s->instructions : 0.0);
+    printf("Stalls       : load-use %llu, mul/div %llu, branch %llu\n",
+           (unsigned long long)s->load_use_stalls, (unsigned long long)s->muldiv_stalls,
+           (unsigned long long)s->branch_stalls);
+    printf("-------------------------------------\n");
+}
@@ -0,0 +1,171 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   execution profile                                         */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+The engines do not count every instruction: each of them records the runs of
+straight-line code it executes, a run [from, to) adding 1 to the delta of
+from and -1 to the delta of to (profile_run). The reference path records
+every instruction as a run of its own, the threaded engine a run per taken
+branch or jump, the JIT one per execution of a compiled block (counted by
+the block, collected by jit_collect). The number of executions of a PC is
+then the sum of the deltas up to it, and a basic block is a sequence of PCs
+executed equally often without a branch or jump but at its end.
+The counts are always kept, the instruction mix is computed from them;
+profile_model only makes the report available.
+*/
+
+#define PROFILE_HOT_BLOCKS 10
+#define PROFILE_HOT_PCS 20
+
+int profile_model = FALSE;
+// per text word, and one more for runs ending at the end of the text
+thread_local int64_t *profile_delta = NULL;
+
+/*
+Procedure : profile_reset
+Purpose   : Start counting from zero for the current text segment
+            (the counts so far must have been folded into the mix)
+*/
+void profile_reset()
+{
+    free(profile_delta);
+    // calloc leaves the pages of code which never runs untouched
+    profile_delta = (int64_t *)calloc(decoded_size / 4 + 1, sizeof(int64_t));
+    if (profile_delta == NULL)
+    {
+        printf("@ Error: Can't allocate the profile\n");
+        exit(-1);
+    }
+    // compiled blocks count into the array they were compiled with
+    jit_reset();
+}
+
+// whether the instruction at address ends a basic block
+int ends_block(uint32_t address)
+{
+    decoded_ins_t d;
+    decode_instruction(mem_read_32(address), &d);
+    return d.handler == H_R_Jump || d.handler == H_R_SYSCALL || d.handler == H_J_Jump ||
+           d.handler == H_I_Branch || d.handler == H_Unknown;
+}
+
+// the disassembly of the instruction at address
+void print_instruction(uint32_t address)
+{
+    decoded_ins_t d;
+    decode_instruction(mem_read_32(address), &d);
+    if (d.opid == OP_UNKNOWN)
+        printf("unknown %08x\n", d.ins);
+    else
+        explain_instruction(address, NoError, FALSE);
+}
+
+typedef struct
+{
+    uint32_t first, last; // word indices
+    uint64_t executions;
+} profile_block_t;
+
+/*
+Procedure : profile_report
+Purpose   : Print the hottest basic blocks with their disassembly and the
+            hottest PCs, to filename (stdout if NULL)
+*/
+int profile_report(const char *filename)
+{
+    if (!profile_model)
+        return FALSE;
+    jit_collect();
+    // explain_instruction prints to stdout, point it at the file meanwhile
+    int saved_stdout = -1;
+    if (filename)
+    {
+        FILE *file = fopen(filename, "w");
+        if (file == NULL)
+        {
+            printf("@ Error: Can't open profile file %s\n", filename);
+            return FALSE;
+        }
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        dup2(fileno(file), STDOUT_FILENO);
+        fclose(file);
+    }
+
+    uint32_t words = decoded_size / 4;
+    std::vector<uint64_t> counts(words);
+    std::vector<profile_block_t> blocks;
+    int64_t sum = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < words; i++)
+    {
+        sum += profile_delta[i];
+        counts[i] = sum;
+        total += sum;
+        if (sum == 0)
+            continue;
+        profile_block_t *last = blocks.empty() ? NULL : &blocks.back();
+        if (last && last->last == i - 1 && last->executions == (uint64_t)sum &&
+            !ends_block(decoded_start + 4 * (i - 1)))
+            last->last = i;
+        else
+            blocks.push_back({i, i, (uint64_t)sum});
+    }
+
+    printf("@ Profile : %llu instructions in the text, %zu basic blocks\n",
+           (unsigned long long)total, blocks.size());
+    printf("-------------------------------------\n");
+    std::sort(blocks.begin(), blocks.end(), [](const profile_block_t &a, const profile_block_t &b)
+              { uint64_t wa = a.executions * (a.last - a.first + 1), wb = b.executions * (b.last - b.first + 1);
+                return wa != wb ? wa > wb : a.first < b.first; });
+    for (size_t k = 0; k < blocks.size() && k < PROFILE_HOT_BLOCKS; k++)
+    {
+        profile_block_t *b = &blocks[k];
+        uint64_t insns = b->executions * (b->last - b->first + 1);
+        printf("block %08x-%08x", decoded_start + 4 * b->first, decoded_start + 4 * b->last);
+        print_symbol(decoded_start + 4 * b->first);
+        printf(": %llu executions, %llu instructions (%.2f%%)\n", (unsigned long long)b->executions,
+               (unsigned long long)insns, 100.0 * insns / total);
+        for (uint32_t i = b->first; i <= b->last; i++)
+        {
+            printf("    %08x: ", decoded_start + 4 * i);
+            print_instruction(decoded_start + 4 * i);
+        }
+    }
+
+    printf("-------------------------------------\n");
+    printf("PC        executions  %%       instruction\n");
+    std::vector<uint32_t> hot;
+    for (uint32_t i = 0; i < words; i++)
+        if (counts[i])
+            hot.push_back(i);
+    std::sort(hot.begin(), hot.end(), [&counts](uint32_t a, uint32_t b)
+              { return counts[a] != counts[b] ? counts[a] > counts[b] : a < b; });
+    for (size_t k = 0; k < hot.size() && k < PROFILE_HOT_PCS; k++)
+    {
+        uint32_t i = hot[k];
+        printf("%08x  %-10llu  %6.2f%%  ", decoded_start + 4 * i,
+               (unsigned long long)counts[i], 100.0 * counts[i] / total);
+        print_instruction(decoded_start + 4 * i);
+    }
+    printf("-------------------------------------\n");
+
+    if (saved_stdout >= 0)
+    {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    return TRUE;
+}
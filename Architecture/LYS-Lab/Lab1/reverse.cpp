@@ -0,0 +1,352 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   reverse execution                                         */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+Before an instruction executes, undo_record writes what it is about to
+overwrite to a ring of undo entries: its PC, the old value of the register
+it writes (or of HI and LO), and the old word at the address it stores to.
+Popping entries steps the machine back one instruction at a time.
+
+The ring only covers the last UNDO_LOG_SIZE instructions. Further back the
+machine returns to a snapshot: every SNAPSHOT_INTERVAL instructions the CPU
+state is saved, and the first store to a page after a snapshot saves the
+page as it was then. Writing back the pages of the snapshots from the
+newest down to one of them restores the memory of that one; from there the
+instructions are replayed up to the target, at most one interval of them.
+
+Execution is deterministic, so replay reproduces history as long as the
+shell does not change the machine; doing so (set, restore) clears history.
+So does a system call doing I/O, which can be neither undone nor replayed:
+history then starts again after it.
+*/
+
+// a ring small enough to stay in the host caches: recording is a stream of writes
+#define UNDO_LOG_SIZE (1 << 16)      // instructions, a power of 2
+#define SNAPSHOT_INTERVAL (1 << 15)  // instructions, at most UNDO_LOG_SIZE
+#define MAX_SNAPSHOTS 4096           // how far back: 128M instructions
+#define MAX_SNAPSHOT_PAGES (1 << 14) // pages all snapshots keep: 64 MiB
+#define GUEST_PAGES (1 << (32 - MEM_PAGE_SHIFT))
+
+typedef struct
+{
+    uint32_t pc, zero;      // and $0 before the fetch cleared it
+    uint32_t value, lo;     // old value of the register written, or HI and LO
+    uint32_t address, word; // old word at the address stored to
+    int8_t dest;            // register written, DEST_HILO, -1 if none
+    uint8_t store;
+} undo_entry_t;
+
+typedef struct
+{
+    uint64_t count; // INSTRUCTION_COUNT when taken
+    CPU_State state;
+    uint32_t serial;            // stamp of the pages saved by this snapshot
+    std::vector<uint32_t> pages; // guest page numbers, and their contents
+    std::vector<uint32_t> words; // when the snapshot was taken
+} snapshot_t;
+
+int reverse_model = FALSE;
+undo_entry_t *undo_log = NULL;
+uint32_t undo_head = 0, undo_used = 0; // the newest entry is before undo_head
+uint64_t undo_now;                     // INSTRUCTION_COUNT of the next instruction
+std::deque<snapshot_t> snapshots;
+// per guest page, the serial of the snapshot which saved it
+uint32_t *page_serial = NULL;
+uint32_t next_serial = 1;
+size_t snapshot_pages = 0;
+int history_cut = FALSE; // history starts again at the next instruction
+
+void take_snapshot()
+{
+    snapshots.push_back(snapshot_t());
+    snapshot_t *s = &snapshots.back();
+    s->count = undo_now;
+    s->state = CURRENT_STATE;
+    s->serial = next_serial++;
+    // the oldest snapshots go first, the newest one always stays
+    while (snapshots.size() > MAX_SNAPSHOTS || (snapshots.size() > 1 && snapshot_pages > MAX_SNAPSHOT_PAGES))
+    {
+        snapshot_pages -= snapshots.front().pages.size();
+        snapshots.pop_front();
+    }
+}
+
+// make the newest snapshot the one which saves pages from now on,
+// with a new serial as the stamps of the dropped ones are left behind
+void restamp_snapshot()
+{
+    snapshot_t *s = &snapshots.back();
+    s->serial = next_serial++;
+    for (uint32_t page : s->pages)
+        page_serial[page] = s->serial;
+}
+
+void drop_snapshots_after(uint64_t count)
+{
+    int dropped = FALSE;
+    while (!snapshots.empty() && snapshots.back().count > count)
+    {
+        snapshot_pages -= snapshots.back().pages.size();
+        snapshots.pop_back();
+        dropped = TRUE;
+    }
+    if (dropped && !snapshots.empty())
+        restamp_snapshot();
+}
+
+/*
+Procedure : reverse_reset
+Purpose   : Start history at the current state
+*/
+void reverse_reset()
+{
+    if (undo_log == NULL)
+    {
+        undo_log = (undo_entry_t *)malloc(UNDO_LOG_SIZE * sizeof(undo_entry_t));
+        // calloc leaves the stamps of pages which are never stored to untouched
+        page_serial = (uint32_t *)calloc(GUEST_PAGES, sizeof(uint32_t));
+    }
+    undo_head = undo_used = 0;
+    undo_now = INSTRUCTION_COUNT;
+    history_cut = FALSE;
+    snapshots.clear();
+    snapshot_pages = 0;
+    take_snapshot();
+}
+
+/*
+Procedure : reverse_barrier
+Purpose   : Start history again after the instruction being executed
+*/
+void reverse_barrier()
+{
+    history_cut = TRUE;
+}
+
+// history starts at the current state, with undo_now kept
+void cut_history()
+{
+    history_cut = FALSE;
+    undo_used = 0;
+    snapshots.clear();
+    snapshot_pages = 0;
+    take_snapshot();
+}
+
+/*
+Procedure : undo_record
+Purpose   : Log what the instruction d at CURRENT_STATE.PC will overwrite,
+            zero is $0 before it was fetched
+*/
+void undo_record(const decoded_ins_t *d, uint32_t zero)
+{
+    if (history_cut)
+        cut_history();
+    if (snapshots.empty() || undo_now - snapshots.back().count >= SNAPSHOT_INTERVAL)
+        take_snapshot();
+    undo_entry_t *e = &undo_log[undo_head];
+    undo_head = (undo_head + 1) & (UNDO_LOG_SIZE - 1);
+    if (undo_used < UNDO_LOG_SIZE)
+        undo_used++;
+    undo_now++;
+    e->pc = CURRENT_STATE.PC;
+    e->zero = zero;
+    e->dest = dest_register(d);
+    if (e->dest == DEST_HILO)
+        e->value = CURRENT_STATE.HI, e->lo = CURRENT_STATE.LO;
+    else if (e->dest >= 0)
+        e->value = CURRENT_STATE.REGS[e->dest];
+    e->store = d->opid == OP_SB || d->opid == OP_SH || d->opid == OP_SW;
+    if (!e->store)
+        return;
+    e->address = (CURRENT_STATE.REGS[d->rs] + d->imm) & ~3;
+    e->word = mem_peek_32(e->address);
+    // the first store to the page since the snapshot saves it
+    snapshot_t *s = &snapshots.back();
+    uint32_t page = e->address >> MEM_PAGE_SHIFT;
+    if (page_serial[page] != s->serial)
+    {
+        page_serial[page] = s->serial;
+        s->pages.push_back(page);
+        for (uint32_t a = page << MEM_PAGE_SHIFT; a != (page + 1) << MEM_PAGE_SHIFT; a += 4)
+            s->words.push_back(mem_peek_32(a));
+        snapshot_pages++;
+    }
+}
+
+// the machine is running at every state history goes back to
+void resume_running()
+{
+    NEXT_STATE = CURRENT_STATE;
+    RUN_BIT = TRUE;
+    LAST_EXCEPTION = NoError;
+}
+
+// step back one instruction with the newest undo entry
+void undo_one()
+{
+    undo_head = (undo_head - 1) & (UNDO_LOG_SIZE - 1);
+    undo_used--;
+    undo_now--;
+    INSTRUCTION_COUNT--;
+    const undo_entry_t *e = &undo_log[undo_head];
+    if (e->store)
+        mem_write_32(e->address, e->word);
+    if (e->dest == DEST_HILO)
+        CURRENT_STATE.HI = e->value, CURRENT_STATE.LO = e->lo;
+    else if (e->dest >= 0)
+        CURRENT_STATE.REGS[e->dest] = e->value;
+    CURRENT_STATE.REGS[0] = e->zero;
+    CURRENT_STATE.PC = e->pc;
+    if (!snapshots.empty() && snapshots.back().count > undo_now)
+        drop_snapshots_after(undo_now);
+}
+
+// write back the pages s saved
+void write_back(const snapshot_t *s)
+{
+    for (size_t i = 0; i < s->pages.size(); i++)
+        for (uint32_t k = 0; k < MEM_PAGE_SIZE / 4; k++)
+            mem_write_32((s->pages[i] << MEM_PAGE_SHIFT) + 4 * k, s->words[i * (MEM_PAGE_SIZE / 4) + k]);
+}
+
+// return to the newest snapshot taken at or before count
+void restore_snapshot(uint64_t count)
+{
+    // the pages go back newest first, so each ends as the oldest snapshot saved it
+    while (snapshots.back().count > count)
+    {
+        write_back(&snapshots.back());
+        snapshot_pages -= snapshots.back().pages.size();
+        snapshots.pop_back();
+    }
+    snapshot_t *s = &snapshots.back();
+    write_back(s);
+    snapshot_pages -= s->pages.size();
+    s->pages.clear();
+    s->words.clear();
+    s->serial = next_serial++;
+    // the undo entries older than the snapshot stay valid
+    uint64_t newer = undo_now - s->count;
+    undo_used = newer < undo_used ? undo_used - newer : 0;
+    undo_head = (undo_head - newer) & (UNDO_LOG_SIZE - 1);
+    undo_now = INSTRUCTION_COUNT = s->count;
+    CURRENT_STATE = s->state;
+    resume_running();
+}
+
+// execute up to count again, noting in *hit the last count at a breakpoint
+void replay(uint64_t count, uint64_t *hit)
+{
+    // the trace already holds these instructions
+    int tracing = trace_model;
+    trace_model = FALSE;
+    uint64_t done = 0;
+    for (; undo_now < count && RUN_BIT; done++)
+    {
+        if (hit && is_breakpoint(CURRENT_STATE.PC))
+            *hit = undo_now;
+        step_instruction();
+    }
+    trace_model = tracing;
+    INSTRUCTION_COUNT += done;
+}
+
+// the oldest count history reaches
+uint64_t reverse_oldest()
+{
+    uint64_t oldest = undo_now - undo_used;
+    return snapshots.empty() ? oldest : std::min(oldest, snapshots.front().count);
+}
+
+// return to the state at count, which history reaches
+void reverse_to(uint64_t count)
+{
+    if (undo_now - count <= undo_used)
+        while (undo_now > count)
+            undo_one();
+    else
+    {
+        restore_snapshot(count);
+        replay(count, NULL);
+    }
+    resume_running();
+}
+
+/*
+Procedure : reverse_back
+Purpose   : Step back at most num instructions, return how many
+*/
+uint64_t reverse_back(uint64_t num)
+{
+    if (undo_now != INSTRUCTION_COUNT)
+        return 0;
+    if (history_cut)
+        cut_history();
+    uint64_t oldest = reverse_oldest();
+    uint64_t target = undo_now - oldest < num ? oldest : undo_now - num;
+    uint64_t back = undo_now - target;
+    if (back)
+        reverse_to(target);
+    return back;
+}
+
+/*
+Procedure : reverse_continue
+Purpose   : Step back to the last state at a breakpoint, or as far as
+            history goes; return whether a breakpoint was found
+*/
+int reverse_continue()
+{
+    if (undo_now != INSTRUCTION_COUNT)
+        return FALSE;
+    if (history_cut)
+        cut_history();
+    while (undo_now > reverse_oldest())
+    {
+        if (undo_used)
+        {
+            undo_one();
+            resume_running();
+            if (is_breakpoint(CURRENT_STATE.PC))
+                return TRUE;
+            continue;
+        }
+        // beyond the undo log: replay from the snapshot before, remembering
+        // the last breakpoint passed, which the undo log then reaches
+        uint64_t end = undo_now, hit = end;
+        restore_snapshot(end - 1);
+        uint64_t start = undo_now;
+        replay(end, &hit);
+        reverse_to(hit < end ? hit : start);
+        if (hit < end)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+Procedure : reverse_report
+Purpose   : Print how far history goes back
+*/
+void reverse_report()
+{
+    if (!reverse_model)
+    {
+        printf("@ Reverse execution is off\n");
+        return;
+    }
+    printf("@ History : %llu instructions back (%u in the undo log), %zu snapshots saving %zu pages\n",
+           (unsigned long long)(undo_now - reverse_oldest()), undo_used, snapshots.size(), snapshot_pages);
+}
@@ -1,66 +1,35 @@
 #include <cstdio>
+#include <cstdlib>
 #include "myshell.h"
+#include "sim.h"
 
 // the word which was stored where the memory was lately updated
-uint32_t mem_before_write = 0;
+thread_local uint32_t mem_before_write = 0;
+thread_local uint32_t LAST_EXCEPTION = NoError;
 
-/*get certain bits in the instruction*/
-// fetch the instruction
-inline uint32_t getInstruction()
-{
-    CURRENT_STATE.REGS[0] = 0;
-    NEXT_STATE = CURRENT_STATE;
-    NEXT_STATE.PC += 4;
-    return mem_read_32(CURRENT_STATE.PC);
-}
-// 6-bit operation code (31:26)
-inline uint32_t get_op(uint32_t ins) { return (ins >> 26) & (0x3f); }
-// 5-bit source register specifier (25:21)
-inline uint32_t get_rs(uint32_t ins) { return (ins >> 21) & (0x1f); }
-// 5-bit target (source/destination) or branch condition (20:16)
-inline uint32_t get_rt(uint32_t ins) { return (ins >> 16) & (0x1f); }
-// 5-bit destination register specifier (15:11)
-inline uint32_t get_rd(uint32_t ins) { return (ins >> 11) & (0x1f); }
-// 5-bit shift amount (10:6)
-inline uint32_t get_shamt(uint32_t ins) { return (ins >> 6) & (0x1f); }
-// 6-bit function field (5:0)
-inline uint32_t get_funct(uint32_t ins) { return (ins) & (0x3f); }
-// 16-bit immediate, branch displacement or address displacement (15:0)
-inline uint32_t get_immediate(uint32_t ins) { return (ins) & (0xffff); }
-// 26-bit jump target address (25:0)
-inline uint32_t get_target(uint32_t ins) { return (ins) & (0x3ffffff); }
-
-// sign extend 8-bit num
-inline uint32_t extend_sign_8(uint32_t num) { return num | ((num & (1 << 7)) ? 0xffffff00 : 0); }
-// sign extend 16-bit num
-inline uint32_t extend_sign_16(uint32_t num) { return num | ((num & (1 << 15)) ? 0xffff0000 : 0); }
-// extract byte
-inline uint32_t extract_byte(uint32_t num, uint32_t pos)
-{
-    if ((pos & 0x01) == 0)
-        num &= 0xffffff00;
-    if ((pos & 0x02) == 0)
-        num &= 0xffff00ff;
-    if ((pos & 0x04) == 0)
-        num &= 0xff00ffff;
-    if ((pos & 0x08) == 0)
-        num &= 0x00ffffff;
-    return num;
-}
+/*
+The handlers write register results to *DEST_STATE and the PC of the next
+instruction to NEXT_PC. process_instruction stages the results in NEXT_STATE
+so that they can be explained against CURRENT_STATE; step_instruction writes
+them straight into CURRENT_STATE. All checks of a handler come before its
+first write, so a faulting instruction changes nothing but NEXT_PC, which
+alert_exception sets back to the PC of the instruction.
+*/
+thread_local CPU_State *DEST_STATE = NULL;
+thread_local uint32_t NEXT_PC;
 
 /*Exception*/
-typedef enum
-{
-    NoError,
-    UnknownError,
-    UnknownInstruction,
-    UnalignedAddress,
-    Overflow
-} ErrorCode;
-inline void alert_exception(uint32_t ins, uint32_t err)
+void alert_exception(uint32_t ins, uint32_t err)
 {
     if (err == NoError)
         return;
+    LAST_EXCEPTION = err;
+    NEXT_PC = CURRENT_STATE.PC;
+    RUN_BIT = FALSE;
+    // the farm reports exceptions in its summary instead, and the
+    // co-simulation's pass of the reference has nothing to report
+    if (farm_mode || cosim_silent)
+        return;
     printf("\x1B[31m");
     switch (err)
     {
@@ -73,83 +42,419 @@ inline void alert_exception(uint32_t ins, uint32_t err)
     case Overflow:
         printf("Overflow During Calculation: ");
         break;
+    case WatchpointHit:
+        printf("Watchpoint Hit: ");
+        break;
+    case Divergence:
+        printf("Co-simulation Divergence: ");
+        break;
     default:
         printf("Unknown Error: ");
         break;
     }
-    printf("Ins-%08x, Err-%08x\n", ins, err);
-    NEXT_STATE.PC = CURRENT_STATE.PC;
-    RUN_BIT = FALSE;
+    printf("Ins-%08x, Err-%08x", ins, err);
+    print_symbol(CURRENT_STATE.PC);
+    printf("\n");
     printf("\x1B[0m");
 }
 
+/*Predecode*/
+// decode cache of the text segment, one entry per word, filled on first fetch
+thread_local decoded_ins_t *decoded_text = NULL;
+thread_local uint32_t decoded_start = 0, decoded_size = 0;
+// holds instructions fetched from outside the text segment
+thread_local decoded_ins_t decoded_temp;
+
+// the OpID of an instruction whose handler and code are decoded
+uint8_t decode_opid(const decoded_ins_t *d)
+{
+    switch (d->handler)
+    {
+    case H_R_Shift:
+        switch (d->code)
+        {
+        case SLL:
+            return OP_SLL;
+        case SRL:
+            return OP_SRL;
+        case SRA:
+            return OP_SRA;
+        case SLLV:
+            return OP_SLLV;
+        case SRLV:
+            return OP_SRLV;
+        case SRAV:
+            return OP_SRAV;
+        }
+        break;
+    case H_R_Jump:
+        if (d->code == JR)
+            return OP_JR;
+        if (d->code == JALR)
+            return OP_JALR;
+        break;
+    case H_R_SYSCALL:
+        return OP_SYSCALL;
+    case H_R_HILO:
+        switch (d->code)
+        {
+        case MFHI:
+            return OP_MFHI;
+        case MTHI:
+            return OP_MTHI;
+        case MFLO:
+            return OP_MFLO;
+        case MTLO:
+            return OP_MTLO;
+        }
+        break;
+    case H_R_MulDiv:
+        switch (d->code)
+        {
+        case MULT:
+            return OP_MULT;
+        case MULTU:
+            return OP_MULTU;
+        case DIV:
+            return OP_DIV;
+        case DIVU:
+            return OP_DIVU;
+        }
+        break;
+    case H_R_ALC:
+        switch (d->code)
+        {
+        case ADD:
+            return OP_ADD;
+        case ADDU:
+            return OP_ADDU;
+        case SUB:
+            return OP_SUB;
+        case SUBU:
+            return OP_SUBU;
+        case AND:
+            return OP_AND;
+        case OR:
+            return OP_OR;
+        case XOR:
+            return OP_XOR;
+        case NOR:
+            return OP_NOR;
+        case SLT:
+            return OP_SLT;
+        case SLTU:
+            return OP_SLTU;
+        }
+        break;
+    case H_J_Jump:
+        return d->code == JAL ? OP_JAL : OP_J;
+    case H_I_Branch:
+        if (d->code == 001)
+        {
+            switch (d->rt)
+            {
+            case BLTZ:
+                return OP_BLTZ;
+            case BGEZ:
+                return OP_BGEZ;
+            case BLTZAL:
+                return OP_BLTZAL;
+            case BGEZAL:
+                return OP_BGEZAL;
+            }
+            break;
+        }
+        switch (d->code)
+        {
+        case BEQ:
+            return OP_BEQ;
+        case BNE:
+            return OP_BNE;
+        case BLEZ:
+            return OP_BLEZ;
+        case BGTZ:
+            return OP_BGTZ;
+        }
+        break;
+    case H_I_ALC:
+        switch (d->code)
+        {
+        case ADDI:
+            return OP_ADDI;
+        case ADDIU:
+            return OP_ADDIU;
+        case SLTI:
+            return OP_SLTI;
+        case SLTIU:
+            return OP_SLTIU;
+        case ANDI:
+            return OP_ANDI;
+        case ORI:
+            return OP_ORI;
+        case XORI:
+            return OP_XORI;
+        case LUI:
+            return OP_LUI;
+        }
+        break;
+    case H_I_Load:
+        switch (d->code)
+        {
+        case LB:
+            return OP_LB;
+        case LH:
+            return OP_LH;
+        case LW:
+            return OP_LW;
+        case LBU:
+            return OP_LBU;
+        case LHU:
+            return OP_LHU;
+        }
+        break;
+    case H_I_Store:
+        switch (d->code)
+        {
+        case SB:
+            return OP_SB;
+        case SH:
+            return OP_SH;
+        case SW:
+            return OP_SW;
+        }
+        break;
+    }
+    return OP_UNKNOWN;
+}
+void decode_instruction(uint32_t ins, decoded_ins_t *d)
+{
+    uint32_t op = get_op(ins), funct = get_funct(ins), imm = get_immediate(ins);
+    d->ins = ins;
+    d->rs = get_rs(ins), d->rt = get_rt(ins), d->rd = get_rd(ins);
+    d->shamt = get_shamt(ins);
+    d->imm = extend_sign_16(imm);
+    d->handler = H_Unknown;
+    if (op == 000)
+    {
+        // R type
+        d->code = funct;
+        switch (funct & 070)
+        {
+        case 000:
+            d->handler = H_R_Shift;
+            break;
+        case 010:
+            d->handler = (funct == SYSCALL) ? H_R_SYSCALL : H_R_Jump;
+            break;
+        case 020:
+            d->handler = H_R_HILO;
+            break;
+        case 030:
+            d->handler = H_R_MulDiv;
+            break;
+        case 040:
+        case 050:
+            d->handler = H_R_ALC;
+            break;
+        }
+    }
+    else
+    {
+        d->code = op;
+        switch (op & 070)
+        {
+        case 000:
+        {
+            if (op == J || op == JAL)
+            {
+                d->handler = H_J_Jump;
+                d->imm = get_target(ins) << 2;
+            }
+            else
+                d->handler = H_I_Branch;
+            break;
+        }
+        case 010:
+            d->handler = H_I_ALC;
+            if (op == ANDI || op == ORI || op == XORI || op == LUI)
+                d->imm = imm;
+            break;
+        case 040:
+            d->handler = H_I_Load;
+            break;
+        case 050:
+            d->handler = H_I_Store;
+            break;
+        }
+    }
+    d->opid = decode_opid(d);
+    d->dispatch = d->opid;
+}
+// (re)allocate an empty decode cache for the current text segment
+void reset_decoded()
+{
+    // the mix keeps the counts of the instructions of the old text
+    mix_fold();
+    free(decoded_text);
+    decoded_start = MEM_REGIONS[REGION_TEXT].start;
+    decoded_size = MEM_REGIONS[REGION_TEXT].size;
+    // calloc leaves the pages of a large cache untouched until first fetch
+    decoded_text = (decoded_ins_t *)calloc(decoded_size / 4, sizeof(decoded_ins_t));
+    jit_reset();
+    profile_reset();
+}
+// drop the decoded entries covering the word written at address
+void invalidate_decoded(uint32_t address)
+{
+    uint32_t offset = address - decoded_start;
+    for (int k = 0; k < 2; k++, offset += 3)
+    {
+        if (offset < decoded_size)
+        {
+            decoded_text[offset >> 2].handler = H_Undecoded;
+            decoded_text[offset >> 2].opid = decoded_text[offset >> 2].dispatch = OP_UNDECODED;
+        }
+    }
+    // the word before no longer starts a pair with it
+    offset = address - decoded_start;
+    if (offset - 4 < decoded_size)
+        decoded_text[(offset >> 2) - 1].dispatch = decoded_text[(offset >> 2) - 1].opid;
+    jit_invalidate(address);
+}
+
 /*
-the unique ID for every instruction:
-funct for R type instructions,
-op for most I type instructions and all J type instructions,
-rt for BLTZ, BGEZ, BLTZAL, BGEZAL (though they are I type instructions, their op are the same - 0x01)
+Superinstruction fusion: an entry of the decode cache starting an idiom of
+two instructions gets the FuseID of the pair as its dispatch ID, and the
+threaded engine executes both with one handler, saving a dispatch. The
+second entry keeps its own dispatch ID, so that a branch to it executes it
+alone, and a write to it splits the pair (invalidate_decoded). Only pairs
+that can raise no exception are fused, and in none of them the first
+instruction writes $0, whose value the second would read.
 */
-typedef enum
+// the FuseID of the pair a, b, or a->opid if it is none
+uint32_t fuse_pair(const decoded_ins_t *a, const decoded_ins_t *b)
 {
-    /*funct*/
-    JALR = 011,
-    JR = 010, // Jump
-    SLL = 000,
-    SRL = 002,
-    SRA = 003,
-    SLLV = 004,
-    SRLV = 006,
-    SRAV = 007, // Shift
-    ADD = 040,
-    ADDU = 041,
-    SUB = 042,
-    SUBU = 043,
-    AND = 044,
-    OR = 045,
-    XOR = 046,
-    NOR = 047,
-    SLT = 052,
-    SLTU = 053, // Arithmetic & Logic & Compare
-    MULT = 030,
-    MULTU = 031,
-    DIV = 032,
-    DIVU = 033, // Mul & Div
-    MFHI = 020,
-    MTHI = 021,
-    MFLO = 022,
-    MTLO = 023,    // HI & LO
-    SYSCALL = 014, // System
-
-    /*op*/
-    J = 002,
-    JAL = 003, // Jump
-    LB = 040,
-    LH = 041,
-    LW = 043,
-    LBU = 044,
-    LHU = 045, // Load
-    SB = 050,
-    SH = 051,
-    SW = 053, // Store
-    BEQ = 004,
-    BNE = 005,
-    BLEZ = 006,
-    BGTZ = 007, // Branch
-    ADDI = 010,
-    ADDIU = 011,
-    SLTI = 012,
-    SLTIU = 013,
-    ANDI = 014,
-    ORI = 015,
-    XORI = 016,
-    LUI = 017, // Arithmetic & Logic & Compare
+    switch (a->opid)
+    {
+    case OP_LUI:
+        if (a->rt != 0 && b->opid == OP_ORI && b->rs == a->rt)
+            return FUSE_LUI_ORI;
+        break;
+    case OP_SLT:
+    case OP_SLTU:
+    case OP_SLTI:
+    case OP_SLTIU:
+    {
+        uint32_t x = a->opid <= OP_SLTU ? a->rd : a->rt;
+        if (x != 0 && (b->opid == OP_BEQ || b->opid == OP_BNE) &&
+            ((b->rs == x && b->rt == 0) || (b->rs == 0 && b->rt == x)))
+            return a->opid == OP_SLT ? FUSE_SLT_BRANCH : a->opid == OP_SLTU ? FUSE_SLTU_BRANCH
+                   : a->opid == OP_SLTI ? FUSE_SLTI_BRANCH : FUSE_SLTIU_BRANCH;
+        break;
+    }
+    case OP_MULT:
+    case OP_MULTU:
+        if (b->opid == OP_MFLO)
+            return a->opid == OP_MULT ? FUSE_MULT_MFLO : FUSE_MULTU_MFLO;
+        break;
+    }
+    return a->opid;
+}
+inline int may_fuse(uint32_t opid)
+{
+    return opid == OP_LUI || (OP_SLT <= opid && opid <= OP_SLTU) || (OP_SLTI <= opid && opid <= OP_SLTIU) ||
+           opid == OP_MULT || opid == OP_MULTU;
+}
+void decode_text(uint32_t pc, decoded_ins_t *d)
+{
+    // the instructions from d on which may start a pair are decoded up to the
+    // first one which may not or whose next is decoded, then fused backwards
+    decoded_ins_t *last = d, *end = decoded_text + decoded_size / 4;
+    decode_instruction(mem_peek_32(pc), d);
+    while (may_fuse(last->opid) && last + 1 < end && last[1].opid == OP_UNDECODED)
+    {
+        last++;
+        decode_instruction(mem_peek_32(pc + 4 * (last - d)), last);
+    }
+    for (decoded_ins_t *e = last; e >= d; e--)
+        if (e + 1 < end && e[1].opid != OP_UNDECODED)
+            e->dispatch = fuse_pair(e, e + 1);
+}
+// the register d writes, DEST_HILO for HI and LO, -1 if none
+int dest_register(const decoded_ins_t *d)
+{
+    switch (d->opid)
+    {
+    case OP_SLL:
+    case OP_SRL:
+    case OP_SRA:
+    case OP_SLLV:
+    case OP_SRLV:
+    case OP_SRAV:
+    case OP_JALR:
+    case OP_MFHI:
+    case OP_MFLO:
+    case OP_ADD:
+    case OP_ADDU:
+    case OP_SUB:
+    case OP_SUBU:
+    case OP_AND:
+    case OP_OR:
+    case OP_XOR:
+    case OP_NOR:
+    case OP_SLT:
+    case OP_SLTU:
+        return d->rd;
+    case OP_ADDI:
+    case OP_ADDIU:
+    case OP_SLTI:
+    case OP_SLTIU:
+    case OP_ANDI:
+    case OP_ORI:
+    case OP_XORI:
+    case OP_LUI:
+    case OP_LB:
+    case OP_LH:
+    case OP_LW:
+    case OP_LBU:
+    case OP_LHU:
+        return d->rt;
+    case OP_JAL:
+    case OP_BLTZAL:
+    case OP_BGEZAL:
+        return 31;
+    case OP_SYSCALL:
+        return 2;
+    case OP_MTHI:
+    case OP_MTLO:
+    case OP_MULT:
+    case OP_MULTU:
+    case OP_DIV:
+    case OP_DIVU:
+        return DEST_HILO;
+    default:
+        return -1;
+    }
+}
 
-    /*rt*/
-    BLTZ = 000,
-    BGEZ = 001,
-    BLTZAL = 020,
-    BGEZAL = 021, // Branch
-} InstructionID;
+// fetch the instruction
+inline const decoded_ins_t *getInstruction()
+{
+    CURRENT_STATE.REGS[0] = 0;
+    NEXT_PC = CURRENT_STATE.PC + 4;
+    uint32_t pc = CURRENT_STATE.PC, offset = pc - decoded_start;
+    if (cache_model)
+        cache_fetch(pc);
+    if (offset < decoded_size && (offset & 003) == 0)
+    {
+        decoded_ins_t *d = &decoded_text[offset >> 2];
+        if (d->handler == H_Undecoded)
+            decode_text(pc, d);
+        return d;
+    }
+    decode_instruction(mem_peek_32(pc), &decoded_temp);
+    return &decoded_temp;
+}
 
 /*Process Instruction*/
 // R type
@@ -162,8 +467,8 @@ ErrorCode process_R_Jump(uint32_t funct, uint32_t rs, uint32_t rd)
         return UnknownInstruction;
     else if (CURRENT_STATE.REGS[rs] & 003)
         return UnalignedAddress;
-    NEXT_STATE.PC = CURRENT_STATE.REGS[rs];
-    NEXT_STATE.REGS[rd] = tmp;
+    NEXT_PC = CURRENT_STATE.REGS[rs];
+    DEST_STATE->REGS[rd] = tmp;
     return NoError;
 }
 ErrorCode process_R_Shift(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd, uint32_t shamt)
@@ -174,11 +479,11 @@ ErrorCode process_R_Shift(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd,
         shamt = CURRENT_STATE.REGS[rs] & 0x1f;
     funct &= 003;
     if (funct == 0)
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] << shamt;
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rt] << shamt;
     else if (funct == 2)
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rt] >> shamt;
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rt] >> shamt;
     else if (funct == 3)
-        NEXT_STATE.REGS[rd] = extend_sign_16(CURRENT_STATE.REGS[rt] >> shamt);
+        DEST_STATE->REGS[rd] = extend_sign_16(CURRENT_STATE.REGS[rt] >> shamt);
     else
         return UnknownInstruction;
     return NoError;
@@ -189,29 +494,29 @@ ErrorCode process_R_ALC(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd)
     {
     case ADD:
     case ADDU:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt];
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rs] + CURRENT_STATE.REGS[rt];
         break;
     case SUB:
     case SUBU:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rs] - CURRENT_STATE.REGS[rt];
         break;
     case AND:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] & CURRENT_STATE.REGS[rt];
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rs] & CURRENT_STATE.REGS[rt];
         break;
     case OR:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt];
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt];
         break;
     case XOR:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.REGS[rs] ^ CURRENT_STATE.REGS[rt];
+        DEST_STATE->REGS[rd] = CURRENT_STATE.REGS[rs] ^ CURRENT_STATE.REGS[rt];
         break;
     case NOR:
-        NEXT_STATE.REGS[rd] = ~(CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt]);
+        DEST_STATE->REGS[rd] = ~(CURRENT_STATE.REGS[rs] | CURRENT_STATE.REGS[rt]);
         break;
     case SLT:
-        NEXT_STATE.REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs] < (int32_t)CURRENT_STATE.REGS[rt]);
+        DEST_STATE->REGS[rd] = ((int32_t)CURRENT_STATE.REGS[rs] < (int32_t)CURRENT_STATE.REGS[rt]);
         break;
     case SLTU:
-        NEXT_STATE.REGS[rd] = (CURRENT_STATE.REGS[rs] < CURRENT_STATE.REGS[rt]);
+        DEST_STATE->REGS[rd] = (CURRENT_STATE.REGS[rs] < CURRENT_STATE.REGS[rt]);
         break;
     default:
         return UnknownInstruction;
@@ -228,27 +533,27 @@ ErrorCode process_R_MulDiv(uint32_t funct, uint32_t rs, uint32_t rt)
     case 0:
     {
         int64_t prod = (int64_t)((int32_t)CURRENT_STATE.REGS[rs]) * (int32_t)CURRENT_STATE.REGS[rt];
-        NEXT_STATE.HI = (prod >> 32) & 0xffffffff;
-        NEXT_STATE.LO = (prod) & 0xffffffff;
+        DEST_STATE->HI = (prod >> 32) & 0xffffffff;
+        DEST_STATE->LO = (prod) & 0xffffffff;
         break;
     }
     case 1:
     {
         uint64_t prod = (uint64_t)CURRENT_STATE.REGS[rs] * CURRENT_STATE.REGS[rt];
-        NEXT_STATE.HI = (prod >> 32) & 0xffffffff;
-        NEXT_STATE.LO = (prod) & 0xffffffff;
+        DEST_STATE->HI = (prod >> 32) & 0xffffffff;
+        DEST_STATE->LO = (prod) & 0xffffffff;
         break;
     }
     case 2:
     {
-        NEXT_STATE.HI = (int32_t)CURRENT_STATE.REGS[rs] % (int32_t)CURRENT_STATE.REGS[rt];
-        NEXT_STATE.LO = (int32_t)CURRENT_STATE.REGS[rs] / (int32_t)CURRENT_STATE.REGS[rt];
+        DEST_STATE->HI = (int32_t)CURRENT_STATE.REGS[rs] % (int32_t)CURRENT_STATE.REGS[rt];
+        DEST_STATE->LO = (int32_t)CURRENT_STATE.REGS[rs] / (int32_t)CURRENT_STATE.REGS[rt];
         break;
     }
     case 3:
     {
-        NEXT_STATE.HI = CURRENT_STATE.REGS[rs] % CURRENT_STATE.REGS[rt];
-        NEXT_STATE.LO = CURRENT_STATE.REGS[rs] / CURRENT_STATE.REGS[rt];
+        DEST_STATE->HI = CURRENT_STATE.REGS[rs] % CURRENT_STATE.REGS[rt];
+        DEST_STATE->LO = CURRENT_STATE.REGS[rs] / CURRENT_STATE.REGS[rt];
         break;
     }
     }
@@ -262,16 +567,16 @@ ErrorCode process_R_HILO(uint32_t funct, uint32_t rs, uint32_t rd)
     switch (funct)
     {
     case 0:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.HI;
+        DEST_STATE->REGS[rd] = CURRENT_STATE.HI;
         break;
     case 1:
-        NEXT_STATE.HI = CURRENT_STATE.REGS[rs];
+        DEST_STATE->HI = CURRENT_STATE.REGS[rs];
         break;
     case 2:
-        NEXT_STATE.REGS[rd] = CURRENT_STATE.LO;
+        DEST_STATE->REGS[rd] = CURRENT_STATE.LO;
         break;
     case 3:
-        NEXT_STATE.LO = CURRENT_STATE.REGS[rs];
+        DEST_STATE->LO = CURRENT_STATE.REGS[rs];
         break;
     }
     return NoError;
@@ -279,34 +584,35 @@ ErrorCode process_R_HILO(uint32_t funct, uint32_t rs, uint32_t rd)
 ErrorCode process_R_SYSCALL(uint32_t funct)
 {
     if (funct == 014)
-    {
-        NEXT_STATE.REGS[2] = 0x0A;
-        RUN_BIT = FALSE;
-        return NoError;
-    }
+        return system_call();
     else
         return UnknownInstruction;
 }
 // J type
-ErrorCode process_J_Jump(uint32_t op, uint32_t targt)
+// targt_addr: 26-bit target already shifted left by 2
+ErrorCode process_J_Jump(uint32_t op, uint32_t targt_addr)
 {
-    uint32_t target_address = (CURRENT_STATE.PC & 0xf0000000) | ((targt * 4) & 0x0fffffff);
-    NEXT_STATE.PC = target_address;
+    uint32_t target_address = (CURRENT_STATE.PC & 0xf0000000) | targt_addr;
+    NEXT_PC = target_address;
     if (op == JAL)
-        NEXT_STATE.REGS[31] = CURRENT_STATE.PC + 4;
+        DEST_STATE->REGS[31] = CURRENT_STATE.PC + 4;
     else if (op != J)
         return UnknownInstruction;
     return NoError;
 }
-// I type
+// I type (imm: immediate already extended as the instruction requires)
 ErrorCode process_I_Load(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
 {
     if ((op & 070) != 040 || (op & 003) == 002 || (op & 007) == 007)
         return UnknownInstruction;
-    uint32_t src_address = CURRENT_STATE.REGS[rs] + extend_sign_16(imm);
+    uint32_t src_address = CURRENT_STATE.REGS[rs] + imm;
     if (((op & 003) == 003 && (src_address & 003)) || ((op & 003) == 001 && (src_address & 001)))
         return UnalignedAddress;
-    uint32_t src_word = mem_read_32(src_address / 4 * 4);
+    if (cache_model)
+        cache_data(src_address, FALSE);
+    uint32_t src_word = mem_read_part(src_address, (op & 003) == 003 ? 4 : (op & 003) + 1);
+    if (trace_model)
+        trace_memory(src_address, src_word, FALSE);
     if (src_address & 002)
         src_word >>= 16;
     if (src_address & 001)
@@ -323,16 +629,18 @@ ErrorCode process_I_Load(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
         if ((op & 004) == 000)
             src_word = extend_sign_8(src_word);
     }
-    NEXT_STATE.REGS[rt] = src_word;
+    DEST_STATE->REGS[rt] = src_word;
     return NoError;
 }
 ErrorCode process_I_Store(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
 {
     if ((op & 070) != 050 || (op & 004) || (op & 003) == 002)
         return UnknownInstruction;
-    uint32_t des_address = CURRENT_STATE.REGS[rs] + extend_sign_16(imm);
+    uint32_t des_address = CURRENT_STATE.REGS[rs] + imm;
     if (((op & 003) == 003 && (des_address & 003)) || ((op & 003) == 001 && (des_address & 001)))
         return UnalignedAddress;
+    if (cache_model)
+        cache_data(des_address, TRUE);
     uint32_t des_word = CURRENT_STATE.REGS[rt], org_word = mem_read_32(des_address / 4 * 4);
     mem_before_write = des_word;
     uint32_t des_pos = 0x0f, org_pos = 0x00;
@@ -354,21 +662,25 @@ ErrorCode process_I_Store(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
     org_pos = 0x0f ^ des_pos;
     des_word = des_word | extract_byte(org_word, org_pos);
     mem_write_32(des_address / 4 * 4, des_word);
+    if (trace_model)
+        trace_memory(des_address, des_word, TRUE);
     return NoError;
 }
 ErrorCode process_I_Branch(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
 {
-    uint32_t target_branch = CURRENT_STATE.PC + 4 + extend_sign_16(imm) * 4;
+    uint32_t target_branch = CURRENT_STATE.PC + 4 + imm * 4;
     if (op == 001)
     {
         if (rt & 0x0e)
             return UnknownInstruction;
+        // read the condition first, $31 may be written in place
+        uint32_t negative = CURRENT_STATE.REGS[rs] & 0x80000000;
         if (rt & 0x10)
-            NEXT_STATE.REGS[31] = CURRENT_STATE.PC + 4;
-        if ((rt & 0x01) && (CURRENT_STATE.REGS[rs] & 0x80000000) == 0)
-            NEXT_STATE.PC = target_branch;
-        else if ((rt & 0x01) == 0 && (CURRENT_STATE.REGS[rs] & 0x80000000))
-            NEXT_STATE.PC = target_branch;
+            DEST_STATE->REGS[31] = CURRENT_STATE.PC + 4;
+        if ((rt & 0x01) && negative == 0)
+            NEXT_PC = target_branch;
+        else if ((rt & 0x01) == 0 && negative)
+            NEXT_PC = target_branch;
         return NoError;
     }
     if ((op & 070) != 000 || (op & 004) == 0)
@@ -381,7 +693,7 @@ ErrorCode process_I_Branch(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
     if (op & 001)
         branch_flag = !branch_flag;
     if (branch_flag)
-        NEXT_STATE.PC = target_branch;
+        NEXT_PC = target_branch;
     return NoError;
 }
 ErrorCode process_I_ALC(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
@@ -391,25 +703,25 @@ ErrorCode process_I_ALC(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
     {
     case ADDI:
     case ADDIU:
-        NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] + extend_sign_16(imm);
+        DEST_STATE->REGS[rt] = CURRENT_STATE.REGS[rs] + imm;
         break;
     case ANDI:
-        NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] & imm;
+        DEST_STATE->REGS[rt] = CURRENT_STATE.REGS[rs] & imm;
         break;
     case ORI:
-        NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] | imm;
+        DEST_STATE->REGS[rt] = CURRENT_STATE.REGS[rs] | imm;
         break;
     case XORI:
-        NEXT_STATE.REGS[rt] = CURRENT_STATE.REGS[rs] ^ imm;
+        DEST_STATE->REGS[rt] = CURRENT_STATE.REGS[rs] ^ imm;
         break;
     case SLTI:
-        NEXT_STATE.REGS[rt] = ((int32_t)CURRENT_STATE.REGS[rs] < (int32_t)extend_sign_16(imm));
+        DEST_STATE->REGS[rt] = ((int32_t)CURRENT_STATE.REGS[rs] < (int32_t)imm);
         break;
     case SLTIU:
-        NEXT_STATE.REGS[rt] = (CURRENT_STATE.REGS[rs] < extend_sign_16(imm));
+        DEST_STATE->REGS[rt] = (CURRENT_STATE.REGS[rs] < imm);
         break;
     case LUI:
-        NEXT_STATE.REGS[rt] = imm << 16;
+        DEST_STATE->REGS[rt] = imm << 16;
         break;
     default:
         return UnknownInstruction;
@@ -417,81 +729,90 @@ ErrorCode process_I_ALC(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm)
     return NoError;
 }
 // general
+// let the models which follow the reference path see an executed instruction
+inline void observe_instruction(const decoded_ins_t *d)
+{
+    INSN_MIX.taken[d->opid] += is_branch(d->opid) & (NEXT_PC != CURRENT_STATE.PC + 4);
+    profile_run(CURRENT_STATE.PC, CURRENT_STATE.PC + 4);
+    if (bpred_model)
+        bpred_update(d, CURRENT_STATE.PC, NEXT_PC);
+}
+inline uint32_t dispatch_instruction(const decoded_ins_t *d)
+{
+    switch (d->handler)
+    {
+    case H_R_Shift:
+        return process_R_Shift(d->code, d->rs, d->rt, d->rd, d->shamt);
+    case H_R_Jump:
+        return process_R_Jump(d->code, d->rs, d->rd);
+    case H_R_SYSCALL:
+        return process_R_SYSCALL(d->code);
+    case H_R_HILO:
+        return process_R_HILO(d->code, d->rs, d->rd);
+    case H_R_MulDiv:
+        return process_R_MulDiv(d->code, d->rs, d->rt);
+    case H_R_ALC:
+        return process_R_ALC(d->code, d->rs, d->rt, d->rd);
+    case H_J_Jump:
+        return process_J_Jump(d->code, d->imm);
+    case H_I_Branch:
+        return process_I_Branch(d->code, d->rs, d->rt, d->imm);
+    case H_I_ALC:
+        return process_I_ALC(d->code, d->rs, d->rt, d->imm);
+    case H_I_Load:
+        return process_I_Load(d->code, d->rs, d->rt, d->imm);
+    case H_I_Store:
+        return process_I_Store(d->code, d->rs, d->rt, d->imm);
+    default:
+        return UnknownInstruction;
+    }
+}
 void process_instruction()
 {
     /* execute one instruction here. You should use CURRENT_STATE and modify
      * values in NEXT_STATE. You can call mem_read_32() and mem_write_32() to
      * access memory. */
-    uint32_t ins = getInstruction();
-    uint32_t op = get_op(ins);
-    uint32_t rs = get_rs(ins), rt = get_rt(ins), rd = get_rd(ins);
-    uint32_t shamt = get_shamt(ins), funct = get_funct(ins);
-    uint32_t imm = get_immediate(ins), targt = get_target(ins);
-    uint32_t err = NoError;
-
-    if (op == 000)
-    {
-        // R type
-        switch (funct & 070)
-        {
-        case 000:
-            err = process_R_Shift(funct, rs, rt, rd, shamt);
-            break;
-        case 010:
-        {
-            if (funct == SYSCALL)
-                err = process_R_SYSCALL(funct);
-            else
-                err = process_R_Jump(funct, rs, rd);
-            break;
-        }
-        case 020:
-            err = process_R_HILO(funct, rs, rd);
-            break;
-        case 030:
-            err = process_R_MulDiv(funct, rs, rt);
-            break;
-        case 040:
-        case 050:
-            err = process_R_ALC(funct, rs, rt, rd);
-            break;
-        default:
-            err = UnknownInstruction;
-            break;
-        }
-    }
-    else
-    {
-        switch (op & 070)
-        {
-        case 000:
-        {
-            if (op == J || op == JAL)
-                err = process_J_Jump(op, targt);
-            else
-                err = process_I_Branch(op, rs, rt, imm);
-            break;
-        }
-        case 010:
-            err = process_I_ALC(op, rs, rt, imm);
-            break;
-        case 040:
-            err = process_I_Load(op, rs, rt, imm);
-            break;
-        case 050:
-            err = process_I_Store(op, rs, rt, imm);
-            break;
-        default:
-            err = UnknownInstruction;
-            break;
-        }
-    }
-    // printf("@debug in sim.cpp: ins=%08x\n", ins);
+    uint32_t zero = CURRENT_STATE.REGS[0]; // a write to $0 shows until the next fetch
+    const decoded_ins_t *d = getInstruction();
+    if (reverse_model)
+        undo_record(d, zero);
+    NEXT_STATE = CURRENT_STATE;
+    DEST_STATE = &NEXT_STATE;
+    uint32_t err = dispatch_instruction(d);
+    // printf("@debug in sim.cpp: ins=%08x\n", d->ins);
     if (err != NoError)
-        alert_exception(ins, err);
+        alert_exception(d->ins, err);
+    else
+        observe_instruction(d);
+    if (trace_model)
+        trace_instruction(d, err);
+    NEXT_STATE.PC = NEXT_PC;
     if (show_assemble)
         explain_instruction(CURRENT_STATE.PC, err, show_detail);
 }
+// execute one instruction directly on CURRENT_STATE, NEXT_STATE is left untouched,
+// return the decoded instruction
+const decoded_ins_t *step_decoded()
+{
+    uint32_t zero = CURRENT_STATE.REGS[0]; // a write to $0 shows until the next fetch
+    const decoded_ins_t *d = getInstruction();
+    if (reverse_model)
+        undo_record(d, zero);
+    DEST_STATE = &CURRENT_STATE;
+    uint32_t err = dispatch_instruction(d);
+    if (err != NoError)
+        alert_exception(d->ins, err);
+    else
+        observe_instruction(d);
+    if (trace_model)
+        trace_instruction(d, err);
+    CURRENT_STATE.PC = NEXT_PC;
+    return d;
+}
+void step_instruction()
+{
+    step_decoded();
+}
 
 /*Explain Instruction*/
 // R type
@@ -809,12 +1130,16 @@ void explain_R_SYSCALL(uint32_t funct, uint32_t verbose)
 {
     if (funct == SYSCALL)
     {
-        printf("SYSCALL\n");
+        uint32_t v0 = CURRENT_STATE.REGS[2], effects;
+        const char *service = syscall_service(v0, &effects);
+        printf("SYSCALL service=%u (%s)\n", v0, service ? service : "unknown");
         if (verbose)
         {
-            printf("\t$2 <- %08x: $2 changes from %08x to %08x\n",
-                   0x0A, CURRENT_STATE.REGS[2], NEXT_STATE.REGS[2]);
-            printf("\tRUN_BIT <- FALSE\n");
+            if (effects & SERVICE_RESULT)
+                printf("\t$2 <- (%s: %08x): $2 changes from %08x to %08x\n",
+                       service ? service : "unknown", NEXT_STATE.REGS[2], v0, NEXT_STATE.REGS[2]);
+            if (effects & SERVICE_HALT)
+                printf("\tRUN_BIT <- FALSE\n");
         }
     }
 }
@@ -847,7 +1172,7 @@ void explain_I_Load(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm, uint32_
 {
     uint32_t src_address = CURRENT_STATE.REGS[rs] + extend_sign_16(imm);
     uint32_t src_word_address = src_address / 4 * 4;
-    uint32_t src_word = mem_read_32(src_word_address);
+    uint32_t src_word = mem_peek_32(src_word_address);
     switch (op)
     {
     case LB:
@@ -921,7 +1246,7 @@ void explain_I_Store(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm, uint32
 {
     uint32_t des_address = CURRENT_STATE.REGS[rs] + extend_sign_16(imm);
     uint32_t des_word_address = des_address / 4 * 4;
-    uint32_t des_word = mem_read_32(des_word_address);
+    uint32_t des_word = mem_peek_32(des_word_address);
     switch (op)
     {
     case SB:
@@ -1171,7 +1496,7 @@ void explain_instruction(uint32_t ins_address, uint32_t err, uint32_t verbose =
         return;
     if (ins_address != CURRENT_STATE.PC || err != NoError)
         verbose = 0;
-    uint32_t ins = mem_read_32(ins_address);
+    uint32_t ins = mem_peek_32(ins_address);
     uint32_t op = get_op(ins);
     uint32_t rs = get_rs(ins), rt = get_rt(ins), rd = get_rd(ins);
     uint32_t shamt = get_shamt(ins), funct = get_funct(ins);
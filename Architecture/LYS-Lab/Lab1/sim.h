@@ -0,0 +1,334 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   instruction encoding shared by the execution engines      */
+/***************************************************************/
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <cstdint>
+
+/*get certain bits in the instruction*/
+// 6-bit operation code (31:26)
+inline uint32_t get_op(uint32_t ins) { return (ins >> 26) & (0x3f); }
+// 5-bit source register specifier (25:21)
+inline uint32_t get_rs(uint32_t ins) { return (ins >> 21) & (0x1f); }
+// 5-bit target (source/destination) or branch condition (20:16)
+inline uint32_t get_rt(uint32_t ins) { return (ins >> 16) & (0x1f); }
+// 5-bit destination register specifier (15:11)
+inline uint32_t get_rd(uint32_t ins) { return (ins >> 11) & (0x1f); }
+// 5-bit shift amount (10:6)
+inline uint32_t get_shamt(uint32_t ins) { return (ins >> 6) & (0x1f); }
+// 6-bit function field (5:0)
+inline uint32_t get_funct(uint32_t ins) { return (ins) & (0x3f); }
+// 16-bit immediate, branch displacement or address displacement (15:0)
+inline uint32_t get_immediate(uint32_t ins) { return (ins) & (0xffff); }
+// 26-bit jump target address (25:0)
+inline uint32_t get_target(uint32_t ins) { return (ins) & (0x3ffffff); }
+
+// sign extend 8-bit num
+inline uint32_t extend_sign_8(uint32_t num) { return num | ((num & (1 << 7)) ? 0xffffff00 : 0); }
+// sign extend 16-bit num
+inline uint32_t extend_sign_16(uint32_t num) { return num | ((num & (1 << 15)) ? 0xffff0000 : 0); }
+// extract byte
+inline uint32_t extract_byte(uint32_t num, uint32_t pos)
+{
+    if ((pos & 0x01) == 0)
+        num &= 0xffffff00;
+    if ((pos & 0x02) == 0)
+        num &= 0xffff00ff;
+    if ((pos & 0x04) == 0)
+        num &= 0xff00ffff;
+    if ((pos & 0x08) == 0)
+        num &= 0x00ffffff;
+    return num;
+}
+
+/*Exception*/
+typedef enum
+{
+    NoError,
+    UnknownError,
+    UnknownInstruction,
+    UnalignedAddress,
+    Overflow,
+    WatchpointHit,
+    Divergence
+} ErrorCode;
+void alert_exception(uint32_t ins, uint32_t err);
+// the word which was stored where the memory was lately updated
+extern thread_local uint32_t mem_before_write;
+// where the handlers write their results (see sim.cpp)
+extern thread_local CPU_State *DEST_STATE;
+extern thread_local uint32_t NEXT_PC;
+
+/*
+the unique ID for every instruction:
+funct for R type instructions,
+op for most I type instructions and all J type instructions,
+rt for BLTZ, BGEZ, BLTZAL, BGEZAL (though they are I type instructions, their op are the same - 0x01)
+*/
+typedef enum
+{
+    /*funct*/
+    JALR = 011,
+    JR = 010, // Jump
+    SLL = 000,
+    SRL = 002,
+    SRA = 003,
+    SLLV = 004,
+    SRLV = 006,
+    SRAV = 007, // Shift
+    ADD = 040,
+    ADDU = 041,
+    SUB = 042,
+    SUBU = 043,
+    AND = 044,
+    OR = 045,
+    XOR = 046,
+    NOR = 047,
+    SLT = 052,
+    SLTU = 053, // Arithmetic & Logic & Compare
+    MULT = 030,
+    MULTU = 031,
+    DIV = 032,
+    DIVU = 033, // Mul & Div
+    MFHI = 020,
+    MTHI = 021,
+    MFLO = 022,
+    MTLO = 023,    // HI & LO
+    SYSCALL = 014, // System
+
+    /*op*/
+    J = 002,
+    JAL = 003, // Jump
+    LB = 040,
+    LH = 041,
+    LW = 043,
+    LBU = 044,
+    LHU = 045, // Load
+    SB = 050,
+    SH = 051,
+    SW = 053, // Store
+    BEQ = 004,
+    BNE = 005,
+    BLEZ = 006,
+    BGTZ = 007, // Branch
+    ADDI = 010,
+    ADDIU = 011,
+    SLTI = 012,
+    SLTIU = 013,
+    ANDI = 014,
+    ORI = 015,
+    XORI = 016,
+    LUI = 017, // Arithmetic & Logic & Compare
+
+    /*rt*/
+    BLTZ = 000,
+    BGEZ = 001,
+    BLTZAL = 020,
+    BGEZAL = 021, // Branch
+} InstructionID;
+
+// the handler which executes a decoded instruction
+typedef enum
+{
+    H_Undecoded, // entry of the decode cache is not filled yet
+    H_Unknown,
+    H_R_Shift,
+    H_R_Jump,
+    H_R_SYSCALL,
+    H_R_HILO,
+    H_R_MulDiv,
+    H_R_ALC,
+    H_J_Jump,
+    H_I_Branch,
+    H_I_ALC,
+    H_I_Load,
+    H_I_Store
+} HandlerID;
+// dense ID of every instruction, used to index handler tables
+typedef enum
+{
+    OP_UNDECODED, // entry of the decode cache is not filled yet
+    OP_UNKNOWN,
+    OP_SLL,
+    OP_SRL,
+    OP_SRA,
+    OP_SLLV,
+    OP_SRLV,
+    OP_SRAV,
+    OP_JR,
+    OP_JALR,
+    OP_SYSCALL,
+    OP_MFHI,
+    OP_MTHI,
+    OP_MFLO,
+    OP_MTLO,
+    OP_MULT,
+    OP_MULTU,
+    OP_DIV,
+    OP_DIVU,
+    OP_ADD,
+    OP_ADDU,
+    OP_SUB,
+    OP_SUBU,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_NOR,
+    OP_SLT,
+    OP_SLTU,
+    OP_J,
+    OP_JAL,
+    OP_BLTZ,
+    OP_BGEZ,
+    OP_BLTZAL,
+    OP_BGEZAL,
+    OP_BEQ,
+    OP_BNE,
+    OP_BLEZ,
+    OP_BGTZ,
+    OP_ADDI,
+    OP_ADDIU,
+    OP_SLTI,
+    OP_SLTIU,
+    OP_ANDI,
+    OP_ORI,
+    OP_XORI,
+    OP_LUI,
+    OP_LB,
+    OP_LH,
+    OP_LW,
+    OP_LBU,
+    OP_LHU,
+    OP_SB,
+    OP_SH,
+    OP_SW,
+    OP_COUNT
+} OpID;
+// superinstructions: pairs of common idioms which the threaded engine executes
+// with one handler, numbered after the OpIDs (see fuse_pair)
+typedef enum
+{
+    FUSE_LUI_ORI = OP_COUNT, // lui rX, hi; ori rY, rX, lo
+    FUSE_SLT_BRANCH,         // slt rX, ...; beq/bne rX, $0 (or $0, rX)
+    FUSE_SLTU_BRANCH,
+    FUSE_SLTI_BRANCH,
+    FUSE_SLTIU_BRANCH,
+    FUSE_MULT_MFLO, // mult ...; mflo rY
+    FUSE_MULTU_MFLO,
+    DISPATCH_COUNT
+} FuseID;
+/*
+an instruction with all fields extracted:
+handler is its HandlerID and code the InstructionID (funct for R type, op
+otherwise), opid its OpID (OP_UNDECODED until the entry is filled), and
+dispatch the FuseID of the pair it starts if fuse_pair fuses it with the next
+one, else opid; imm is sign extended (zero extended for ANDI, ORI, XORI, LUI),
+and for J type it holds the 26-bit target already shifted left by 2
+*/
+typedef struct
+{
+    uint32_t ins;
+    uint32_t imm;
+    uint8_t handler, code, opid;
+    uint8_t rs, rt, rd, shamt;
+    uint8_t dispatch;
+} decoded_ins_t;
+
+// dynamic instruction mix per OpID: the instructions retired before the execution
+// counts last restarted (the rest follow from the counts, see mix.cpp), and the
+// taken conditional branches (leaving the fall-through path) counted by the engines
+typedef struct
+{
+    uint64_t executed[OP_COUNT], taken[OP_COUNT];
+    uint64_t fused; // pairs executed as superinstructions
+} insn_mix_t;
+extern thread_local insn_mix_t INSN_MIX;
+inline int is_branch(uint32_t opid)
+{
+    return opid - OP_BLTZ <= OP_BGTZ - OP_BLTZ;
+}
+
+// decode cache of the text segment, one entry per word, filled on first fetch
+extern thread_local decoded_ins_t *decoded_text;
+extern thread_local uint32_t decoded_start, decoded_size;
+
+void decode_instruction(uint32_t ins, decoded_ins_t *d);
+// decode the entry d of the decode cache at pc, and fuse it with the next one
+void decode_text(uint32_t pc, decoded_ins_t *d);
+// the handlers of the reference path (see dispatch_instruction), reading CURRENT_STATE
+// and writing DEST_STATE and NEXT_PC
+ErrorCode process_R_Jump(uint32_t funct, uint32_t rs, uint32_t rd);
+ErrorCode process_R_Shift(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd, uint32_t shamt);
+ErrorCode process_R_ALC(uint32_t funct, uint32_t rs, uint32_t rt, uint32_t rd);
+ErrorCode process_R_MulDiv(uint32_t funct, uint32_t rs, uint32_t rt);
+ErrorCode process_R_HILO(uint32_t funct, uint32_t rs, uint32_t rd);
+ErrorCode process_R_SYSCALL(uint32_t funct);
+// the service $v0 names (see syscall.cpp)
+ErrorCode system_call();
+// what a service does besides its I/O: writes its result to $v0, stops the machine
+#define SERVICE_RESULT 0x01
+#define SERVICE_HALT 0x02
+const char *syscall_service(uint32_t v0, uint32_t *effects);
+ErrorCode process_J_Jump(uint32_t op, uint32_t targt_addr);
+ErrorCode process_I_Load(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm);
+ErrorCode process_I_Store(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm);
+ErrorCode process_I_Branch(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm);
+ErrorCode process_I_ALC(uint32_t op, uint32_t rs, uint32_t rt, uint32_t imm);
+// the register d writes, DEST_HILO for HI and LO, -1 if none
+#define DEST_HILO 32
+int dest_register(const decoded_ins_t *d);
+// step_instruction, returning the instruction it executed
+const decoded_ins_t *step_decoded();
+// predict and train with a control transfer (--bpred)
+void bpred_update(const decoded_ins_t *d, uint32_t pc, uint32_t next_pc);
+
+// execution counts, read by the profile (--profile) and the instruction mix:
+// the engines record runs of straight-line code [from, to) of the text
+// segment, see profile.cpp
+extern thread_local int64_t *profile_delta;
+inline void profile_run(uint32_t from, uint32_t to)
+{
+    uint32_t offset = from - decoded_start;
+    if (offset < decoded_size && (offset & 003) == 0)
+    {
+        profile_delta[offset >> 2]++;
+        profile_delta[(to - decoded_start) >> 2]--;
+    }
+}
+
+// binary execution trace (--trace), see trace.cpp
+#define TRACE_MAGIC "MIPSTRC"
+typedef struct
+{
+    char magic[8];
+    uint32_t num_regions;
+    struct
+    {
+        uint32_t start, size;
+    } regions[MEM_NREGIONS];
+} trace_header_t;
+// flags of a record
+#define TR_DEST 0x01      // written register and its value
+#define TR_HILO 0x02      // HI and LO
+#define TR_MEMORY 0x04    // address and word loaded / stored
+#define TR_STORE 0x08     // the access is a store
+#define TR_NEXT 0x10      // next PC, if not PC + 4
+#define TR_EXCEPTION 0x20 // error code
+#define TR_SYNC 0x40      // CPU_State, instead of an instruction
+#define TRACE_MAX_RECORD 32
+void trace_memory(uint32_t address, uint32_t word, int store);
+void trace_instruction(const decoded_ins_t *d, uint32_t err);
+
+// reverse execution (--reverse), see reverse.cpp
+void undo_record(const decoded_ins_t *d, uint32_t zero);
+
+// generated code of the JIT depends on the text segment
+void jit_collect();
+void jit_reset();
+void jit_invalidate(uint32_t address);
+void jit_watch(int hit);
+void jit_recompile();
+#endif
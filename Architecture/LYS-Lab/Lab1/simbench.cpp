@@ -0,0 +1,406 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   simbench: microbenchmarks of the simulator's hot paths    */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+simbench times the hot paths of the reference engine one at a time, on a
+machine of its own: the memory reads of every region, decoding, each
+process_* handler, the stores (read-modify-write with extract_byte), and
+cycle() with its copies of CPU_State. A repetition is a batch of
+BATCH_SIZE operations; the repetitions of all benchmarks are interleaved
+in rounds, so that a slow spell of the host spreads over all of them,
+and in every round a few warm-up repetitions go before the timed ones.
+The median and the 99th percentile of the time per operation are
+reported. --save writes the medians to a baseline file; --baseline
+compares the medians with one and fails if any is slower than the
+tolerance allows.
+*/
+
+#define BATCH_SIZE 4096
+#define ROUNDS 20
+#define WARMUP_REPS 20 // per round
+#define DEFAULT_REPS 2000
+#define DEFAULT_TOLERANCE 20 // percent
+#define MAX_BENCHES 64
+
+// results of the operations, so that the compiler keeps them
+volatile uint32_t sink;
+
+// the instructions decoding is timed with, a bit of every format
+const uint32_t SAMPLE_CODE[16] = {
+    0x25080001, // addiu $t0, $t0, 1
+    0x01284821, // addu  $t1, $t1, $t0
+    0x8d090004, // lw    $t1, 4($t0)
+    0xad090008, // sw    $t1, 8($t0)
+    0x1500fffc, // bne   $t0, $0, -4
+    0x00084080, // sll   $t0, $t0, 2
+    0x3c081000, // lui   $t0, 0x1000
+    0x0810000a, // j     0x00400028
+    0x01090018, // mult  $t0, $t1
+    0x00004012, // mflo  $t0
+    0x03e00008, // jr    $ra
+    0x0c10000a, // jal   0x00400028
+    0x2908000a, // slti  $t0, $t0, 10
+    0x91090003, // lbu   $t1, 3($t0)
+    0xa1090001, // sb    $t1, 1($t0)
+    0x0000000c, // syscall
+};
+
+// the loop cycle() and step_instruction() execute
+const uint32_t LOOP_CODE[3] = {
+    0x25080001, // addiu $t0, $t0, 1
+    0x01284821, // addu  $t1, $t1, $t0
+    0x0810000a, // j     0x00400028
+};
+
+// the registers the handlers read: $t0-$t7 operands, $s0 the data segment,
+// $ra a return address
+void reset_state()
+{
+    memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+    for (int r = 8; r < 16; r++)
+        CURRENT_STATE.REGS[r] = 0x9e3779b9 * r;
+    CURRENT_STATE.REGS[16] = MEM_DATA_START;
+    CURRENT_STATE.REGS[31] = MEM_TEXT_START;
+    CURRENT_STATE.PC = MEM_TEXT_START;
+    NEXT_STATE = CURRENT_STATE;
+    DEST_STATE = &NEXT_STATE;
+    NEXT_PC = CURRENT_STATE.PC + 4;
+}
+
+// memory reads, over 16 KiB from the first page wholly in a region (a page
+// the region only partly covers takes the slow path)
+void read_region(int region, uint32_t n)
+{
+    uint32_t start = (MEM_REGIONS[region].start + MEM_PAGE_MASK) & ~MEM_PAGE_MASK, s = 0;
+    for (uint32_t i = 0; i < n; i++)
+        s += mem_read_32(start + (i & 4095) * 4);
+    sink = s;
+}
+void bench_read_text(uint32_t n) { read_region(REGION_TEXT, n); }
+void bench_read_data(uint32_t n) { read_region(REGION_DATA, n); }
+void bench_read_stack(uint32_t n) { read_region(REGION_STACK, n); }
+void bench_read_kdata(uint32_t n) { read_region(REGION_KDATA, n); }
+void bench_read_ktext(uint32_t n) { read_region(REGION_KTEXT, n); }
+
+// decoding
+void bench_get_fields(uint32_t n)
+{
+    uint32_t s = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t ins = SAMPLE_CODE[i & 15];
+        s += get_op(ins) ^ get_rs(ins) ^ get_rt(ins) ^ get_rd(ins) ^ get_shamt(ins) ^ get_funct(ins) ^
+             get_immediate(ins) ^ get_target(ins);
+    }
+    sink = s;
+}
+void bench_decode_instruction(uint32_t n)
+{
+    decoded_ins_t d;
+    uint32_t s = 0;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        decode_instruction(SAMPLE_CODE[i & 15], &d);
+        s += d.opid;
+    }
+    sink = s;
+}
+
+// the handlers, the operands cycling through $t0-$t7
+void bench_R_Shift(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        process_R_Shift(i & 7, 8 + (i & 7), 9 + (i & 3), 8 + (i >> 3 & 7), i & 31);
+    sink = NEXT_STATE.REGS[8];
+}
+void bench_R_Jump(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        process_R_Jump(i & 1 ? JR : JALR, 31, 8 + (i & 7));
+    sink = NEXT_PC;
+}
+void bench_R_SYSCALL(uint32_t n)
+{
+    // exit, the service which does no I/O
+    CURRENT_STATE.REGS[2] = 10;
+    for (uint32_t i = 0; i < n; i++)
+        process_R_SYSCALL(SYSCALL);
+    RUN_BIT = TRUE;
+    sink = NEXT_STATE.REGS[2];
+}
+void bench_R_HILO(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        process_R_HILO(MFHI + (i & 3), 8 + (i & 7), 8 + (i >> 3 & 7));
+    sink = NEXT_STATE.HI;
+}
+void bench_R_MulDiv(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        process_R_MulDiv(MULT + (i & 3), 8 + (i & 7), 8 + (i >> 3 & 7));
+    sink = NEXT_STATE.LO;
+}
+void bench_R_ALC(uint32_t n)
+{
+    static const uint32_t FUNCTS[8] = {ADDU, SUBU, AND, OR, XOR, NOR, SLT, SLTU};
+    for (uint32_t i = 0; i < n; i++)
+        process_R_ALC(FUNCTS[i & 7], 8 + (i & 7), 8 + (i >> 3 & 7), 8 + (i >> 6 & 7));
+    sink = NEXT_STATE.REGS[8];
+}
+void bench_J_Jump(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        process_J_Jump(i & 1 ? JAL : J, (i & 0xffff) << 2);
+    sink = NEXT_PC;
+}
+void bench_I_Branch(uint32_t n)
+{
+    static const uint32_t OPS[4] = {BEQ, BNE, BLEZ, BGTZ};
+    for (uint32_t i = 0; i < n; i++)
+        process_I_Branch(OPS[i & 3], 8 + (i & 7), 8 + (i >> 3 & 7), i & 0xff);
+    sink = NEXT_PC;
+}
+void bench_I_ALC(uint32_t n)
+{
+    static const uint32_t OPS[8] = {ADDIU, SLTI, SLTIU, ANDI, ORI, XORI, LUI, ADDIU};
+    for (uint32_t i = 0; i < n; i++)
+        process_I_ALC(OPS[i & 7], 8 + (i & 7), 8 + (i >> 3 & 7), i & 0xffff);
+    sink = NEXT_STATE.REGS[8];
+}
+void bench_I_Load(uint32_t n)
+{
+    static const uint32_t OPS[4] = {LW, LB, LBU, LW};
+    for (uint32_t i = 0; i < n; i++)
+        process_I_Load(OPS[i & 3], 16, 8 + (i & 7), (i & 4095) * 4);
+    sink = NEXT_STATE.REGS[8];
+}
+// stores of each width, the narrow ones merging into the word they hit
+void store_width(uint32_t op, uint32_t n)
+{
+    uint32_t step = op == SW ? 4 : op == SH ? 2 : 1;
+    for (uint32_t i = 0; i < n; i++)
+        process_I_Store(op, 16, 8 + (i & 7), (i & 4095) * step);
+    sink = mem_before_write;
+}
+void bench_store_sw(uint32_t n) { store_width(SW, n); }
+void bench_store_sh(uint32_t n) { store_width(SH, n); }
+void bench_store_sb(uint32_t n) { store_width(SB, n); }
+
+// the two copies of CPU_State cycle() makes around every instruction
+void bench_state_copy(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+    {
+        NEXT_STATE = CURRENT_STATE;
+        __asm__ volatile("" ::: "memory");
+        CURRENT_STATE = NEXT_STATE;
+        __asm__ volatile("" ::: "memory");
+    }
+    sink = CURRENT_STATE.PC;
+}
+// whole instructions of LOOP_CODE, with and without the copies
+void bench_cycle(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        cycle();
+    sink = CURRENT_STATE.REGS[9];
+}
+void bench_step_instruction(uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        step_instruction();
+    sink = CURRENT_STATE.REGS[9];
+}
+
+typedef struct
+{
+    const char *name;
+    void (*run)(uint32_t n);
+} bench_t;
+
+const bench_t BENCHES[] = {
+    {"mem_read_32.text", bench_read_text},
+    {"mem_read_32.data", bench_read_data},
+    {"mem_read_32.stack", bench_read_stack},
+    {"mem_read_32.kdata", bench_read_kdata},
+    {"mem_read_32.ktext", bench_read_ktext},
+    {"decode.get_fields", bench_get_fields},
+    {"decode.decode_instruction", bench_decode_instruction},
+    {"process_R_Shift", bench_R_Shift},
+    {"process_R_Jump", bench_R_Jump},
+    {"process_R_SYSCALL", bench_R_SYSCALL},
+    {"process_R_HILO", bench_R_HILO},
+    {"process_R_MulDiv", bench_R_MulDiv},
+    {"process_R_ALC", bench_R_ALC},
+    {"process_J_Jump", bench_J_Jump},
+    {"process_I_Branch", bench_I_Branch},
+    {"process_I_ALC", bench_I_ALC},
+    {"process_I_Load", bench_I_Load},
+    {"process_I_Store.sw", bench_store_sw},
+    {"process_I_Store.sh", bench_store_sh},
+    {"process_I_Store.sb", bench_store_sb},
+    {"cycle.state_copy", bench_state_copy},
+    {"cycle", bench_cycle},
+    {"step_instruction", bench_step_instruction},
+};
+#define NUM_BENCHES (int)(sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+typedef struct
+{
+    char name[64];
+    double median;
+} baseline_t;
+
+/*
+Procedure : read_baseline
+Purpose   : Read the lines "{benchmark} {median ns}" of filename, return
+            how many, -1 if it can't be read
+*/
+int read_baseline(const char *filename, baseline_t *baseline)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        printf("@ Error: Can't open baseline file %s\n", filename);
+        return -1;
+    }
+    int num = 0;
+    char line[256];
+    while (num < MAX_BENCHES && fgets(line, sizeof(line), file))
+        if (line[0] != '#' && sscanf(line, "%63s %lf", baseline[num].name, &baseline[num].median) == 2)
+            num++;
+    fclose(file);
+    return num;
+}
+
+/*
+Procedure : time_round
+Purpose   : Warm up b, then add the nanoseconds per operation of reps
+            repetitions to ns
+*/
+void time_round(const bench_t *b, int reps, std::vector<double> *ns)
+{
+    reset_state();
+    for (int r = 0; r < WARMUP_REPS; r++)
+        b->run(BATCH_SIZE);
+    for (int r = 0; r < reps; r++)
+    {
+        double start = wall_time();
+        b->run(BATCH_SIZE);
+        ns->push_back((wall_time() - start) * 1e9 / BATCH_SIZE);
+    }
+}
+
+void print_usage(char *prog_name)
+{
+    printf("Usage: %s [options] [{benchmark} ...]\n", prog_name);
+    printf("\ttime the hot paths of the simulator, all of them or those whose\n");
+    printf("\tnames start with one of the arguments\n");
+    printf("\t--reps {num}\t\ttimed repetitions of %d operations (default %d)\n", BATCH_SIZE, DEFAULT_REPS);
+    printf("\t--save {file}\t\twrite the medians to a baseline file\n");
+    printf("\t--baseline {file}\tcompare with a baseline, fail on a regression\n");
+    printf("\t--tolerance {pct}\tslowdown of a median counted as a regression (default %d)\n", DEFAULT_TOLERANCE);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int argi = 1, reps = DEFAULT_REPS;
+    double tolerance = DEFAULT_TOLERANCE;
+    char *save_file = NULL, *baseline_file = NULL;
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++)
+    {
+        if (strcmp(argv[argi], "--reps") == 0 && argi + 1 < argc && atoi(argv[argi + 1]) > 0)
+            reps = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "--save") == 0 && argi + 1 < argc)
+            save_file = argv[++argi];
+        else if (strcmp(argv[argi], "--baseline") == 0 && argi + 1 < argc)
+            baseline_file = argv[++argi];
+        else if (strcmp(argv[argi], "--tolerance") == 0 && argi + 1 < argc)
+            tolerance = atof(argv[++argi]);
+        else
+            print_usage(argv[0]);
+    }
+
+    baseline_t baseline[MAX_BENCHES];
+    int num_baseline = 0;
+    if (baseline_file && (num_baseline = read_baseline(baseline_file, baseline)) < 0)
+        exit(1);
+    FILE *save = NULL;
+    if (save_file)
+    {
+        if ((save = fopen(save_file, "w")) == NULL)
+        {
+            printf("@ Error: Can't open baseline file %s\n", save_file);
+            exit(1);
+        }
+        fprintf(save, "# simbench medians, ns per operation\n");
+    }
+
+    // every region resident, the text holding the loop
+    init_memory();
+    for (int i = 0; i < MEM_NREGIONS; i++)
+        for (uint32_t k = 0; k < 4096; k++)
+            mem_write_32(MEM_REGIONS[i].start + k * 4, k);
+    for (int k = 0; k < 3; k++)
+        mem_write_32(MEM_TEXT_START + k * 4, LOOP_CODE[k]);
+
+    std::vector<const bench_t *> selected;
+    for (int i = 0; i < NUM_BENCHES; i++)
+    {
+        int match = argi == argc;
+        for (int k = argi; k < argc; k++)
+            match |= strncmp(BENCHES[i].name, argv[k], strlen(argv[k])) == 0;
+        if (match)
+            selected.push_back(&BENCHES[i]);
+    }
+    std::vector<std::vector<double>> ns(selected.size());
+    for (int round = 0; round < ROUNDS; round++)
+        for (size_t i = 0; i < selected.size(); i++)
+            time_round(selected[i], (reps * (round + 1) / ROUNDS) - (reps * round / ROUNDS), &ns[i]);
+
+    int regressions = 0;
+    printf("@ Microbenchmarks : %d repetitions of %d operations in %d rounds, each after %d warm-up repetitions\n",
+           reps, BATCH_SIZE, ROUNDS, WARMUP_REPS);
+    printf("-------------------------------------\n");
+    printf("benchmark                  median ns  p99 ns     baseline   change\n");
+    for (size_t i = 0; i < selected.size(); i++)
+    {
+        const bench_t *b = selected[i];
+        std::sort(ns[i].begin(), ns[i].end());
+        double median = ns[i][reps / 2], p99 = ns[i][(size_t)reps * 99 / 100];
+        printf("%-26s %-10.2f %-10.2f", b->name, median, p99);
+        if (save)
+            fprintf(save, "%s %.3f\n", b->name, median);
+        for (int k = 0; k < num_baseline; k++)
+        {
+            if (strcmp(baseline[k].name, b->name) != 0)
+                continue;
+            double change = (median / baseline[k].median - 1) * 100;
+            printf(" %-10.2f %+.1f%%", baseline[k].median, change);
+            if (change > tolerance)
+            {
+                printf("  REGRESSION");
+                regressions++;
+            }
+            break;
+        }
+        printf("\n");
+    }
+    printf("-------------------------------------\n");
+    if (save)
+        fclose(save);
+    if (baseline_file)
+        printf("@ %d regressions beyond %.0f%% of %s\n", regressions, tolerance, baseline_file);
+    return regressions ? 1 : 0;
+}
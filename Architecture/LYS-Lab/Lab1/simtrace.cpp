@@ -0,0 +1,139 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   simtrace: explain a binary execution trace offline        */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+simtrace replays a trace written by sim --trace (see trace.cpp) on a
+machine of its own: memory holds the instructions and the words the trace
+saw, and every record turns CURRENT_STATE into NEXT_STATE as the simulator
+did, so that explain_instruction prints what "go a v" printed.
+*/
+
+FILE *input;
+
+int read_byte()
+{
+    int b = getc_unlocked(input);
+    if (b == EOF)
+    {
+        printf("@ Error: The trace is truncated\n");
+        exit(1);
+    }
+    return b;
+}
+uint32_t read_varint()
+{
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint32_t b = read_byte();
+        v |= (b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return v;
+    }
+}
+uint32_t read_word32()
+{
+    uint32_t w;
+    if (fread(&w, 4, 1, input) != 1)
+    {
+        printf("@ Error: The trace is truncated\n");
+        exit(1);
+    }
+    return w;
+}
+
+/*
+Procedure : replay_instruction
+Purpose   : Explain the instruction record with the given flags, which
+            was executed at CURRENT_STATE.PC
+*/
+void replay_instruction(uint32_t flags, int verbose)
+{
+    uint32_t pc = CURRENT_STATE.PC, ins = read_word32();
+    mem_write_32(pc, ins);
+    CURRENT_STATE.REGS[0] = 0;
+    NEXT_STATE = CURRENT_STATE;
+    NEXT_STATE.PC = pc + 4;
+    if (flags & TR_DEST)
+    {
+        uint32_t dest = read_byte();
+        NEXT_STATE.REGS[dest & 31] = read_varint();
+    }
+    if (flags & TR_HILO)
+    {
+        NEXT_STATE.HI = read_varint();
+        NEXT_STATE.LO = read_varint();
+    }
+    if (flags & TR_MEMORY)
+    {
+        uint32_t address = read_varint(), word = read_varint();
+        // a load recorded the word it read, a store the word it left
+        mem_write_32(address / 4 * 4, word);
+        if (flags & TR_STORE)
+            mem_before_write = CURRENT_STATE.REGS[get_rt(ins)];
+    }
+    if (flags & TR_NEXT)
+        NEXT_STATE.PC = read_varint();
+    uint32_t err = NoError;
+    if (flags & TR_EXCEPTION)
+    {
+        err = read_byte();
+        alert_exception(ins, err);
+    }
+    explain_instruction(pc, err, verbose);
+    CURRENT_STATE = NEXT_STATE;
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = TRUE, argi = 1;
+    if (argi < argc && strcmp(argv[argi], "--brief") == 0)
+        verbose = FALSE, argi++;
+    if (argi + 1 != argc)
+    {
+        printf("Usage: %s [--brief] {trace}\n", argv[0]);
+        printf("\texplain the instructions of a trace written by sim --trace,\n");
+        printf("\twith their details unless --brief\n");
+        exit(1);
+    }
+    if ((input = fopen(argv[argi], "rb")) == NULL)
+    {
+        printf("@ Error: Can't open trace file %s\n", argv[argi]);
+        exit(1);
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, input) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.num_regions != MEM_NREGIONS)
+    {
+        printf("@ Error: %s is not a trace\n", argv[argi]);
+        exit(1);
+    }
+    for (int i = 0; i < MEM_NREGIONS; i++)
+        MEM_REGIONS[i].start = header.regions[i].start, MEM_REGIONS[i].size = header.regions[i].size;
+    init_memory();
+
+    int flags;
+    while ((flags = getc_unlocked(input)) != EOF)
+    {
+        if (flags & TR_SYNC)
+        {
+            if (fread(&CURRENT_STATE, sizeof(CPU_State), 1, input) != 1)
+            {
+                printf("@ Error: The trace is truncated\n");
+                exit(1);
+            }
+            continue;
+        }
+        replay_instruction(flags, verbose);
+    }
+    fclose(input);
+    return 0;
+}
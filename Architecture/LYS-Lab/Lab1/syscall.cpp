@@ -0,0 +1,432 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   system calls                                              */
+/***************************************************************/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+SYSCALL performs the SPIM/MARS service numbered by $v0:
+
+     1 print_int     $a0                 5 read_int     -> $v0
+     4 print_string  $a0 address         8 read_string  $a0 buffer, $a1 length
+    11 print_char    $a0                12 read_char    -> $v0 (-1 at the end)
+     9 sbrk          $a0 bytes -> $v0 the old break (-1 if the heap is full)
+    10 exit                             17 exit2        $a0 status
+    13 open          $a0 name, $a1 flags (0 read, 1 write, 2 both, +8 append),
+                     $a2 mode -> $v0 descriptor (-1 on error)
+    14 read          $a0 descriptor, $a1 buffer, $a2 length -> $v0 bytes read
+    15 write         $a0 descriptor, $a1 buffer, $a2 length -> $v0 bytes written
+    16 close         $a0 descriptor
+
+Any other number halts the machine with $v0 = 10, as every syscall did before
+(mytest.s relies on it). The status exit2 passes is the exit status of a
+batch run and shows in the farm summary.
+
+What the guest writes to a descriptor, its standard output and error
+included, collects in a buffer of SYSCALL_BUFFER_SIZE bytes, written out when
+it fills, when the descriptor is closed, before the guest reads its standard
+input (which it shares with the shell through stdio) and whenever execution
+stops (see execute), so that a guest printing line by line makes few host
+writes. The heap grows from the end of the data loaded up to the end of the
+data region. Data the services copy in or out of memory is not seen by the
+watchpoints, and as its effects can't be undone, reverse execution does not
+go back past a service doing I/O.
+*/
+
+#define SYSCALL_BUFFER_SIZE (1 << 20)
+#define SYSCALL_MAX_FILES 16 // guest descriptors, 0-2 being stdin, stdout and stderr
+#define SYSCALL_CHUNK 4096   // bytes copied between the host and memory at a time
+
+typedef enum
+{
+    SYS_PRINT_INT = 1,
+    SYS_PRINT_STRING = 4,
+    SYS_READ_INT = 5,
+    SYS_READ_STRING = 8,
+    SYS_SBRK = 9,
+    SYS_EXIT = 10,
+    SYS_PRINT_CHAR = 11,
+    SYS_READ_CHAR = 12,
+    SYS_OPEN = 13,
+    SYS_READ = 14,
+    SYS_WRITE = 15,
+    SYS_CLOSE = 16,
+    SYS_EXIT2 = 17
+} syscall_t;
+
+// what a guest descriptor is open for, 0 if it is not open
+#define FILE_READ 1
+#define FILE_WRITE 2
+
+typedef struct
+{
+    int fd; // host descriptor
+    int mode;
+    uint8_t *out; // written by the guest, not yet by the host
+    uint32_t used;
+} guest_file_t;
+
+thread_local guest_file_t GUEST_FILES[SYSCALL_MAX_FILES] = {
+    {0, FILE_READ, NULL, 0}, {1, FILE_WRITE, NULL, 0}, {2, FILE_WRITE, NULL, 0}};
+thread_local uint32_t HEAP_START = MEM_DATA_START, HEAP_BREAK = MEM_DATA_START;
+thread_local uint32_t EXIT_STATUS = 0; // $a0 of exit2, 0 after exit
+
+void file_flush(guest_file_t *f)
+{
+    // the shell prints through stdio, what it printed first comes out first
+    if (f->fd == 1 || f->fd == 2)
+        fflush(f->fd == 1 ? stdout : stderr);
+    for (uint32_t done = 0; done < f->used;)
+    {
+        ssize_t n = write(f->fd, f->out + done, f->used - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    f->used = 0;
+}
+
+void file_write(guest_file_t *f, const void *data, uint32_t size)
+{
+    if (f->out == NULL)
+        f->out = (uint8_t *)malloc(SYSCALL_BUFFER_SIZE);
+    if (f->used + size > SYSCALL_BUFFER_SIZE)
+        file_flush(f);
+    if (size > SYSCALL_BUFFER_SIZE)
+    {
+        for (uint32_t done = 0; done < size;)
+        {
+            ssize_t n = write(f->fd, (const uint8_t *)data + done, size - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return;
+    }
+    memcpy(f->out + f->used, data, size);
+    f->used += size;
+    // explained instructions and the output of the guest stay in order
+    if (show_assemble)
+        file_flush(f);
+}
+
+// the guest file of descriptor fd if it is open for mode, NULL if not
+guest_file_t *guest_file(uint32_t fd, int mode)
+{
+    return fd < SYSCALL_MAX_FILES && (GUEST_FILES[fd].mode & mode) ? &GUEST_FILES[fd] : NULL;
+}
+
+/*
+Procedure : syscall_flush
+Purpose   : Write out what the guest wrote to its descriptors
+*/
+void syscall_flush()
+{
+    for (int i = 0; i < SYSCALL_MAX_FILES; i++)
+        if (GUEST_FILES[i].used)
+            file_flush(&GUEST_FILES[i]);
+}
+
+/*
+Procedure : syscall_reset
+Purpose   : Close the files the guest opened and start its heap at
+            heap_start, with the break at heap_break
+*/
+void syscall_reset(uint32_t heap_start, uint32_t heap_break)
+{
+    syscall_flush();
+    for (int i = 3; i < SYSCALL_MAX_FILES; i++)
+        if (GUEST_FILES[i].mode)
+        {
+            close(GUEST_FILES[i].fd);
+            GUEST_FILES[i].mode = 0;
+        }
+    HEAP_START = heap_start;
+    HEAP_BREAK = heap_break;
+    EXIT_STATUS = 0;
+}
+
+// before the guest reads its standard input, it sees what it wrote
+void read_stdin()
+{
+    syscall_flush();
+    fflush(stdout);
+}
+
+// copy size bytes from the host to memory at address, return FALSE if they are not all in memory
+int guest_store(uint32_t address, const uint8_t *src, uint32_t size)
+{
+    if (!mem_load(address, src, size))
+        return FALSE;
+    const mem_region_t *text = &MEM_REGIONS[REGION_TEXT];
+    if (address + size > text->start && address < text->start + text->size)
+        for (uint32_t a = address & ~3u; a < address + size; a += 4)
+            invalidate_decoded(a);
+    return TRUE;
+}
+
+// append the NUL-terminated string at address to f, up to the end of memory
+void write_string(guest_file_t *f, uint32_t address)
+{
+    uint8_t chunk[SYSCALL_CHUNK];
+    for (;;)
+    {
+        uint32_t n = std::min<uint32_t>(MEM_PAGE_SIZE - (address & MEM_PAGE_MASK), SYSCALL_CHUNK);
+        if (!mem_read(address, chunk, n))
+            return;
+        uint8_t *end = (uint8_t *)memchr(chunk, 0, n);
+        file_write(f, chunk, end ? end - chunk : n);
+        if (end)
+            return;
+        address += n;
+    }
+}
+
+// read_string: a line of at most length - 1 characters from stdin, NUL-terminated
+void read_string(uint32_t address, int32_t length)
+{
+    if (length <= 0)
+        return;
+    read_stdin();
+    // the guest picks length: copy the line to memory a chunk at a time
+    uint8_t chunk[SYSCALL_CHUNK];
+    uint32_t n = 0;
+    int ch = 0;
+    for (int32_t left = length - 1; left > 0 && ch != '\n' && (ch = getchar()) != EOF; left--)
+    {
+        chunk[n++] = ch;
+        if (n == SYSCALL_CHUNK)
+        {
+            guest_store(address, chunk, n);
+            address += n, n = 0;
+        }
+    }
+    chunk[n++] = 0;
+    guest_store(address, chunk, n);
+}
+
+// open: the lowest free guest descriptor for the file at name, -1 on error
+uint32_t open_file(uint32_t name, uint32_t flags, uint32_t mode)
+{
+    char path[1024];
+    uint32_t len = 0;
+    for (; len < sizeof(path); len++)
+        if (!mem_read(name + len, (uint8_t *)&path[len], 1))
+            return -1;
+        else if (path[len] == 0)
+            break;
+    uint32_t fd = 3;
+    while (fd < SYSCALL_MAX_FILES && GUEST_FILES[fd].mode)
+        fd++;
+    if (len == sizeof(path) || fd == SYSCALL_MAX_FILES || (flags & 3) == 3)
+        return -1;
+    // the access modes are those of the host, writing creates the file
+    static const int modes[] = {FILE_READ, FILE_WRITE, FILE_READ | FILE_WRITE};
+    int host_flags = (flags & 3) == O_RDONLY ? O_RDONLY
+                                             : (flags & 3) | O_CREAT | ((flags & 8) ? O_APPEND : O_TRUNC);
+    int host = open(path, host_flags, mode ? mode : 0644);
+    if (host < 0)
+        return -1;
+    GUEST_FILES[fd] = {host, modes[flags & 3], GUEST_FILES[fd].out, 0};
+    return fd;
+}
+
+// read: at most size bytes of guest file fd into memory at address,
+// a line at most from stdin; the bytes read, -1 on error
+uint32_t read_file(uint32_t fd, uint32_t address, uint32_t size)
+{
+    guest_file_t *f = guest_file(fd, FILE_READ);
+    if (f == NULL)
+        return -1;
+    uint8_t chunk[SYSCALL_CHUNK];
+    uint32_t done = 0;
+    if (fd == 0)
+    {
+        read_stdin();
+        int ch = 0;
+        while (done < size && ch != '\n')
+        {
+            uint32_t n = 0;
+            while (n < std::min<uint32_t>(size - done, SYSCALL_CHUNK) && ch != '\n' && (ch = getchar()) != EOF)
+                chunk[n++] = ch;
+            if (n == 0 || !guest_store(address + done, chunk, n))
+                break;
+            done += n;
+        }
+        return done;
+    }
+    // what the guest wrote comes before what it reads back
+    file_flush(f);
+    while (done < size)
+    {
+        ssize_t n = read(f->fd, chunk, std::min<uint32_t>(size - done, SYSCALL_CHUNK));
+        if (n < 0 && done == 0)
+            return -1;
+        if (n <= 0 || !guest_store(address + done, chunk, n))
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// write: size bytes from memory at address to guest file fd, the bytes written, -1 on error
+uint32_t write_file(uint32_t fd, uint32_t address, uint32_t size)
+{
+    guest_file_t *f = guest_file(fd, FILE_WRITE);
+    if (f == NULL)
+        return -1;
+    uint8_t chunk[SYSCALL_CHUNK];
+    for (uint32_t done = 0; done < size;)
+    {
+        uint32_t n = std::min<uint32_t>(size - done, SYSCALL_CHUNK);
+        if (!mem_read(address + done, chunk, n))
+            return done;
+        file_write(f, chunk, n);
+        done += n;
+    }
+    return size;
+}
+
+// close: flush and close guest file fd; the standard ones stay open for the shell
+uint32_t close_file(uint32_t fd)
+{
+    guest_file_t *f = guest_file(fd, FILE_READ | FILE_WRITE);
+    if (f == NULL)
+        return -1;
+    file_flush(f);
+    if (fd > 2)
+    {
+        close(f->fd);
+        f->mode = 0;
+    }
+    return 0;
+}
+
+// sbrk: move the break by size bytes (rounded up to words), return the old one
+uint32_t move_break(int32_t size)
+{
+    uint32_t old = HEAP_BREAK;
+    int64_t next = ((int64_t)HEAP_BREAK + size + 3) & ~(int64_t)3;
+    const mem_region_t *data = &MEM_REGIONS[REGION_DATA];
+    if (next < HEAP_START || next > (int64_t)data->start + data->size)
+        return -1;
+    HEAP_BREAK = next;
+    return old;
+}
+
+/*
+Procedure : syscall_service
+Purpose   : Return the name of service v0 (NULL if it is unknown) and set
+            effects to what it does to the machine, SERVICE_* flags
+*/
+const char *syscall_service(uint32_t v0, uint32_t *effects)
+{
+    *effects = SERVICE_RESULT;
+    switch (v0)
+    {
+    case SYS_READ_INT:
+        return "read_int";
+    case SYS_READ_CHAR:
+        return "read_char";
+    case SYS_SBRK:
+        return "sbrk";
+    case SYS_OPEN:
+        return "open";
+    case SYS_READ:
+        return "read";
+    case SYS_WRITE:
+        return "write";
+    }
+    *effects = 0;
+    switch (v0)
+    {
+    case SYS_PRINT_INT:
+        return "print_int";
+    case SYS_PRINT_STRING:
+        return "print_string";
+    case SYS_PRINT_CHAR:
+        return "print_char";
+    case SYS_READ_STRING:
+        return "read_string";
+    case SYS_CLOSE:
+        return "close";
+    case SYS_EXIT2:
+        *effects = SERVICE_HALT;
+        return "exit2";
+    }
+    // exit, and any other number, halts with $v0 = 10
+    *effects = SERVICE_RESULT | SERVICE_HALT;
+    return v0 == SYS_EXIT ? "exit" : NULL;
+}
+
+/*
+Procedure : system_call
+Purpose   : Perform the service $v0 names, results go to DEST_STATE
+*/
+ErrorCode system_call()
+{
+    const uint32_t *R = CURRENT_STATE.REGS;
+    uint32_t *result = &DEST_STATE->REGS[2], a0 = R[4], a1 = R[5], a2 = R[6];
+    char text[16];
+    switch (R[2])
+    {
+    case SYS_PRINT_INT:
+        file_write(&GUEST_FILES[1], text, snprintf(text, sizeof(text), "%d", (int32_t)a0));
+        break;
+    case SYS_PRINT_STRING:
+        write_string(&GUEST_FILES[1], a0);
+        break;
+    case SYS_PRINT_CHAR:
+        text[0] = a0;
+        file_write(&GUEST_FILES[1], text, 1);
+        break;
+    case SYS_READ_INT:
+    {
+        char line[64];
+        read_stdin();
+        *result = fgets(line, sizeof(line), stdin) ? strtol(line, NULL, 10) : 0;
+        break;
+    }
+    case SYS_READ_STRING:
+        read_string(a0, a1);
+        break;
+    case SYS_READ_CHAR:
+        read_stdin();
+        *result = getchar();
+        break;
+    case SYS_SBRK:
+        *result = move_break(a0);
+        break;
+    case SYS_OPEN:
+        *result = open_file(a0, a1, a2);
+        break;
+    case SYS_READ:
+        *result = read_file(a0, a1, a2);
+        break;
+    case SYS_WRITE:
+        *result = write_file(a0, a1, a2);
+        break;
+    case SYS_CLOSE:
+        close_file(a0);
+        break;
+    case SYS_EXIT2:
+        EXIT_STATUS = a0;
+        RUN_BIT = FALSE;
+        return NoError;
+    default:
+        *result = SYS_EXIT;
+        RUN_BIT = FALSE;
+        return NoError;
+    }
+    if (reverse_model)
+        reverse_barrier();
+    return NoError;
+}
@@ -0,0 +1,432 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   threaded execution engine                                 */
+/***************************************************************/
+
+#include <cstdio>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+Every decoded instruction ends by jumping straight to the code of the next
+one through a table of label addresses (computed goto), so there is a single
+indirect branch per instruction instead of the nested switches of
+process_instruction. Results are written directly into CURRENT_STATE, the
+architectural results are the same as those of process_instruction.
+*/
+
+// fetch the decoded instruction at pc and jump to its code
+#define DISPATCH()                                              \
+    {                                                           \
+        if (count >= max_ins)                                   \
+            goto done;                                          \
+        offset = pc - decoded_start;                            \
+        if (offset >= decoded_size || (offset & 003))           \
+            goto slow;                                          \
+        d = &decoded_text[offset >> 2];                         \
+        R[0] = 0;                                               \
+        goto *labels[d->dispatch];                              \
+    }
+// retire the instruction and continue with the next one / the one at target
+#define NEXT()        \
+    {                 \
+        pc += 4;      \
+        count++;      \
+        DISPATCH();   \
+    }
+// retire a load or store, which stops the run if it hit a watchpoint
+#define MEMORY_NEXT()                           \
+    {                                           \
+        if (watching && RUN_BIT == FALSE)       \
+        {                                       \
+            pc += 4;                            \
+            count++;                            \
+            goto done;                          \
+        }                                       \
+        NEXT();                                 \
+    }
+#define JUMP(target)                                                  \
+    {                                                                 \
+        uint32_t next = (target);                                     \
+        mix->taken[d->opid] += is_branch(d->opid) & (next != pc + 4); \
+        profile_run(run, pc + 4);                                     \
+        pc = run = next;                                              \
+        count++;                                                      \
+        DISPATCH();                                                   \
+    }
+// retire the first instruction of a superinstruction and go on with the
+// second one, unless the run ends between them
+#define FUSED_NEXT()                          \
+    {                                         \
+        pc += 4;                              \
+        count++;                              \
+        if (count >= max_ins)                 \
+            goto done;                        \
+        fused++;                              \
+        d++;                                  \
+    }
+#define FAULT(code)     \
+    {                   \
+        err = (code);   \
+        goto fault;     \
+    }
+#define RS R[d->rs]
+#define RT R[d->rt]
+#define RD R[d->rd]
+#define IMM (d->imm)
+#define BRANCH_TARGET (pc + 4 + IMM * 4)
+
+/*
+Procedure : run_threaded
+Purpose   : Execute at most max_ins instructions or until halted,
+            return the number of instructions executed
+            (and the straight-line runs from run as execution counts)
+*/
+uint64_t run_threaded(uint64_t max_ins)
+{
+    static void *const labels[DISPATCH_COUNT] = {
+        &&L_UNDECODED, &&L_UNKNOWN,
+        &&L_SLL, &&L_SRL, &&L_SRA, &&L_SLLV, &&L_SRLV, &&L_SRAV,
+        &&L_JR, &&L_JALR, &&L_SYSCALL,
+        &&L_MFHI, &&L_MTHI, &&L_MFLO, &&L_MTLO,
+        &&L_MULT, &&L_MULTU, &&L_DIV, &&L_DIVU,
+        &&L_ADD, &&L_ADDU, &&L_SUB, &&L_SUBU,
+        &&L_AND, &&L_OR, &&L_XOR, &&L_NOR, &&L_SLT, &&L_SLTU,
+        &&L_J, &&L_JAL,
+        &&L_BLTZ, &&L_BGEZ, &&L_BLTZAL, &&L_BGEZAL,
+        &&L_BEQ, &&L_BNE, &&L_BLEZ, &&L_BGTZ,
+        &&L_ADDI, &&L_ADDIU, &&L_SLTI, &&L_SLTIU,
+        &&L_ANDI, &&L_ORI, &&L_XORI, &&L_LUI,
+        &&L_LB, &&L_LH, &&L_LW, &&L_LBU, &&L_LHU,
+        &&L_SB, &&L_SH, &&L_SW,
+        &&L_LUI_ORI, &&L_SLT_BRANCH, &&L_SLTU_BRANCH, &&L_SLTI_BRANCH, &&L_SLTIU_BRANCH,
+        &&L_MULT_MFLO, &&L_MULTU_MFLO};
+    uint32_t *R = CURRENT_STATE.REGS;
+    uint32_t pc = CURRENT_STATE.PC, offset, err, run = pc;
+    insn_mix_t *mix = &INSN_MIX;
+    uint64_t count = 0, fused = 0;
+    int watching = watch_model;
+    decoded_ins_t *d;
+
+    if (RUN_BIT == FALSE)
+        return 0;
+    DISPATCH();
+
+L_UNDECODED:
+    decode_text(pc, d);
+    goto *labels[d->dispatch];
+L_UNKNOWN:
+    FAULT(UnknownInstruction);
+
+    // R type: shift
+L_SLL:
+    RD = RT << d->shamt;
+    NEXT();
+L_SRL:
+    RD = RT >> d->shamt;
+    NEXT();
+L_SRA:
+    RD = extend_sign_16(RT >> d->shamt);
+    NEXT();
+L_SLLV:
+    RD = RT << (RS & 0x1f);
+    NEXT();
+L_SRLV:
+    RD = RT >> (RS & 0x1f);
+    NEXT();
+L_SRAV:
+    RD = extend_sign_16(RT >> (RS & 0x1f));
+    NEXT();
+
+    // R type: jump & system
+L_JR:
+    if (RS & 003)
+        FAULT(UnalignedAddress);
+    JUMP(RS);
+L_JALR:
+{
+    uint32_t target = RS;
+    RD = pc + 4;
+    JUMP(target);
+}
+L_SYSCALL:
+    // the service ends the straight-line run, and the run if it halts
+    CURRENT_STATE.PC = pc;
+    DEST_STATE = &CURRENT_STATE;
+    system_call();
+    profile_run(run, pc + 4);
+    pc = run = pc + 4;
+    count++;
+    if (RUN_BIT == FALSE)
+        goto done;
+    DISPATCH();
+
+    // R type: HI & LO, mul & div
+L_MFHI:
+    RD = CURRENT_STATE.HI;
+    NEXT();
+L_MTHI:
+    CURRENT_STATE.HI = RS;
+    NEXT();
+L_MFLO:
+    RD = CURRENT_STATE.LO;
+    NEXT();
+L_MTLO:
+    CURRENT_STATE.LO = RS;
+    NEXT();
+L_MULT:
+{
+    int64_t prod = (int64_t)((int32_t)RS) * (int32_t)RT;
+    CURRENT_STATE.HI = (prod >> 32) & 0xffffffff;
+    CURRENT_STATE.LO = (prod) & 0xffffffff;
+    NEXT();
+}
+L_MULTU:
+{
+    uint64_t prod = (uint64_t)RS * RT;
+    CURRENT_STATE.HI = (prod >> 32) & 0xffffffff;
+    CURRENT_STATE.LO = (prod) & 0xffffffff;
+    NEXT();
+}
+L_DIV:
+    CURRENT_STATE.HI = (int32_t)RS % (int32_t)RT;
+    CURRENT_STATE.LO = (int32_t)RS / (int32_t)RT;
+    NEXT();
+L_DIVU:
+    CURRENT_STATE.HI = RS % RT;
+    CURRENT_STATE.LO = RS / RT;
+    NEXT();
+
+    // R type: arithmetic & logic & compare
+L_ADD:
+L_ADDU:
+    RD = RS + RT;
+    NEXT();
+L_SUB:
+L_SUBU:
+    RD = RS - RT;
+    NEXT();
+L_AND:
+    RD = RS & RT;
+    NEXT();
+L_OR:
+    RD = RS | RT;
+    NEXT();
+L_XOR:
+    RD = RS ^ RT;
+    NEXT();
+L_NOR:
+    RD = ~(RS | RT);
+    NEXT();
+L_SLT:
+    RD = ((int32_t)RS < (int32_t)RT);
+    NEXT();
+L_SLTU:
+    RD = (RS < RT);
+    NEXT();
+
+    // J type
+L_J:
+    JUMP((pc & 0xf0000000) | IMM);
+L_JAL:
+    R[31] = pc + 4;
+    JUMP((pc & 0xf0000000) | IMM);
+
+    // I type: branch (the condition is read before $31 is linked)
+L_BLTZ:
+    if (RS & 0x80000000)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_BGEZ:
+    if ((RS & 0x80000000) == 0)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_BLTZAL:
+{
+    uint32_t cond = RS & 0x80000000;
+    R[31] = pc + 4;
+    if (cond)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+}
+L_BGEZAL:
+{
+    uint32_t cond = RS & 0x80000000;
+    R[31] = pc + 4;
+    if (cond == 0)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+}
+L_BEQ:
+    if (RS == RT)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_BNE:
+    if (RS != RT)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_BLEZ:
+    if ((int32_t)RS <= 0)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_BGTZ:
+    if ((int32_t)RS > 0)
+        JUMP(BRANCH_TARGET);
+    NEXT();
+
+    // I type: arithmetic & logic & compare
+L_ADDI:
+L_ADDIU:
+    RT = RS + IMM;
+    NEXT();
+L_SLTI:
+    RT = ((int32_t)RS < (int32_t)IMM);
+    NEXT();
+L_SLTIU:
+    RT = (RS < IMM);
+    NEXT();
+L_ANDI:
+    RT = RS & IMM;
+    NEXT();
+L_ORI:
+    RT = RS | IMM;
+    NEXT();
+L_XORI:
+    RT = RS ^ IMM;
+    NEXT();
+L_LUI:
+    RT = IMM << 16;
+    NEXT();
+
+    // I type: load
+L_LB:
+{
+    uint32_t address = RS + IMM;
+    RT = extend_sign_8((mem_read_part(address, 1) >> (8 * (address & 003))) & 0xff);
+    MEMORY_NEXT();
+}
+L_LBU:
+{
+    uint32_t address = RS + IMM;
+    RT = (mem_read_part(address, 1) >> (8 * (address & 003))) & 0xff;
+    MEMORY_NEXT();
+}
+L_LH:
+{
+    uint32_t address = RS + IMM;
+    if (address & 001)
+        FAULT(UnalignedAddress);
+    RT = extend_sign_16((mem_read_part(address, 2) >> (8 * (address & 002))) & 0xffff);
+    MEMORY_NEXT();
+}
+L_LHU:
+{
+    uint32_t address = RS + IMM;
+    if (address & 001)
+        FAULT(UnalignedAddress);
+    RT = (mem_read_part(address, 2) >> (8 * (address & 002))) & 0xffff;
+    MEMORY_NEXT();
+}
+L_LW:
+{
+    uint32_t address = RS + IMM;
+    if (address & 003)
+        FAULT(UnalignedAddress);
+    RT = mem_read_32(address);
+    MEMORY_NEXT();
+}
+
+    // I type: store
+L_SB:
+{
+    uint32_t address = RS + IMM, shift = 8 * (address & 003);
+    uint32_t word = mem_read_32(address & ~3) & ~(0xffu << shift);
+    mem_write_32(address & ~3, word | ((RT & 0xff) << shift));
+    MEMORY_NEXT();
+}
+L_SH:
+{
+    uint32_t address = RS + IMM, shift = 8 * (address & 002);
+    if (address & 001)
+        FAULT(UnalignedAddress);
+    uint32_t word = mem_read_32(address & ~3) & ~(0xffffu << shift);
+    mem_write_32(address & ~3, word | ((RT & 0xffff) << shift));
+    MEMORY_NEXT();
+}
+L_SW:
+{
+    uint32_t address = RS + IMM;
+    if (address & 003)
+        FAULT(UnalignedAddress);
+    mem_write_32(address, RT);
+    MEMORY_NEXT();
+}
+
+    // superinstructions (see fuse_pair): the first instruction, then the second
+L_LUI_ORI:
+    RT = IMM << 16;
+    FUSED_NEXT();
+    RT = RS | IMM;
+    NEXT();
+L_SLT_BRANCH:
+    RD = ((int32_t)RS < (int32_t)RT);
+    FUSED_NEXT();
+    goto fused_branch;
+L_SLTU_BRANCH:
+    RD = (RS < RT);
+    FUSED_NEXT();
+    goto fused_branch;
+L_SLTI_BRANCH:
+    RT = ((int32_t)RS < (int32_t)IMM);
+    FUSED_NEXT();
+    goto fused_branch;
+L_SLTIU_BRANCH:
+    RT = (RS < IMM);
+    FUSED_NEXT();
+fused_branch:
+    // beq/bne comparing the result with $0: taken if it is 1 for bne, 0 for beq
+    if ((RS | RT) ^ (d->opid == OP_BEQ))
+        JUMP(BRANCH_TARGET);
+    NEXT();
+L_MULT_MFLO:
+{
+    int64_t prod = (int64_t)((int32_t)RS) * (int32_t)RT;
+    CURRENT_STATE.HI = (prod >> 32) & 0xffffffff;
+    CURRENT_STATE.LO = (prod) & 0xffffffff;
+    FUSED_NEXT();
+    RD = CURRENT_STATE.LO;
+    NEXT();
+}
+L_MULTU_MFLO:
+{
+    uint64_t prod = (uint64_t)RS * RT;
+    CURRENT_STATE.HI = (prod >> 32) & 0xffffffff;
+    CURRENT_STATE.LO = (prod) & 0xffffffff;
+    FUSED_NEXT();
+    RD = CURRENT_STATE.LO;
+    NEXT();
+}
+
+slow:
+    // instruction outside of the text segment, leave it to step_instruction
+    profile_run(run, pc);
+    CURRENT_STATE.PC = pc;
+    step_instruction();
+    pc = run = CURRENT_STATE.PC;
+    count++;
+    if (RUN_BIT == FALSE)
+        goto done;
+    DISPATCH();
+
+fault:
+    CURRENT_STATE.PC = pc;
+    alert_exception(d->ins, err);
+    count++;
+
+done:
+    mix->fused += fused;
+    profile_run(run, pc);
+    CURRENT_STATE.PC = pc;
+    NEXT_STATE = CURRENT_STATE;
+    return count;
+}
@@ -0,0 +1,162 @@
+/***************************************************************/
+/*   MIPS-32 Instruction Level Simulator                       */
+/*   binary execution trace                                    */
+/***************************************************************/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "myshell.h"
+#include "sim.h"
+
+/*
+A trace is a header (trace_header_t) and a sequence of records. A record
+starts with a byte of TR_* flags: a TR_SYNC record holds the whole CPU state
+(written whenever execution starts, as the shell may have changed it), any
+other one is an executed instruction: its word, then the fields its flags
+announce, values as LEB128 varints. The state before an instruction is the
+state after the previous one, so only what an instruction changes is kept:
+the register it writes, HI and LO, the word it loaded or the word it stored
+(after the store), its next PC if it is not PC + 4, and the exception it
+raised. simtrace replays the records to explain them offline.
+
+Records are collected in a buffer written out in large blocks; the engines
+leave tracing to the reference path (see execute).
+*/
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+int trace_model = FALSE;
+FILE *trace_file = NULL;
+uint8_t trace_buffer[TRACE_BUFFER_SIZE];
+size_t trace_used = 0;
+// the memory access of the instruction being executed
+uint32_t trace_flags = 0, trace_address, trace_word;
+
+void trace_flush()
+{
+    if (trace_used && fwrite(trace_buffer, 1, trace_used, trace_file) != trace_used)
+        printf("@ Error: Can't write the trace\n");
+    trace_used = 0;
+}
+inline void trace_byte(uint32_t b)
+{
+    trace_buffer[trace_used++] = b;
+}
+inline void trace_varint(uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        trace_byte(v | 0x80);
+        v >>= 7;
+    }
+    trace_byte(v);
+}
+inline void trace_word32(uint32_t w)
+{
+    memcpy(trace_buffer + trace_used, &w, 4);
+    trace_used += 4;
+}
+
+/*
+Procedure : trace_open
+Purpose   : Start writing a trace of the executed instructions to filename
+*/
+int trace_open(const char *filename)
+{
+    trace_close();
+    if ((trace_file = fopen(filename, "wb")) == NULL)
+    {
+        printf("@ Error: Can't open trace file %s\n", filename);
+        return FALSE;
+    }
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.num_regions = MEM_NREGIONS;
+    for (int i = 0; i < MEM_NREGIONS; i++)
+        header.regions[i].start = MEM_REGIONS[i].start, header.regions[i].size = MEM_REGIONS[i].size;
+    fwrite(&header, sizeof(header), 1, trace_file);
+    trace_model = TRUE;
+    return TRUE;
+}
+
+/*
+Procedure : trace_close
+Purpose   : Write out the buffered records and stop tracing
+*/
+void trace_close()
+{
+    if (trace_file == NULL)
+        return;
+    trace_flush();
+    fclose(trace_file);
+    trace_file = NULL;
+    trace_model = FALSE;
+}
+
+/*
+Procedure : trace_sync
+Purpose   : Record the whole CPU state, before execution starts
+*/
+void trace_sync()
+{
+    if (trace_used + sizeof(CPU_State) + 1 > TRACE_BUFFER_SIZE)
+        trace_flush();
+    trace_byte(TR_SYNC);
+    memcpy(trace_buffer + trace_used, &CURRENT_STATE, sizeof(CPU_State));
+    trace_used += sizeof(CPU_State);
+}
+
+/*
+Procedure : trace_memory
+Purpose   : Note the word a load read or a store left at address
+*/
+void trace_memory(uint32_t address, uint32_t word, int store)
+{
+    trace_flags = store ? TR_MEMORY | TR_STORE : TR_MEMORY;
+    trace_address = address, trace_word = word;
+}
+
+/*
+Procedure : trace_instruction
+Purpose   : Record the instruction d at CURRENT_STATE.PC, whose results are
+            in DEST_STATE and NEXT_PC
+*/
+void trace_instruction(const decoded_ins_t *d, uint32_t err)
+{
+    if (trace_used + TRACE_MAX_RECORD > TRACE_BUFFER_SIZE)
+        trace_flush();
+    uint32_t flags = trace_flags, pc = CURRENT_STATE.PC;
+    int dest = err == NoError ? dest_register(d) : -1;
+    if (dest == DEST_HILO)
+        flags |= TR_HILO;
+    else if (dest >= 0)
+        flags |= TR_DEST;
+    if (NEXT_PC != pc + 4)
+        flags |= TR_NEXT;
+    if (err != NoError)
+        flags |= TR_EXCEPTION;
+    trace_byte(flags);
+    trace_word32(d->ins);
+    if (flags & TR_DEST)
+    {
+        trace_byte(dest);
+        trace_varint(DEST_STATE->REGS[dest]);
+    }
+    if (flags & TR_HILO)
+    {
+        trace_varint(DEST_STATE->HI);
+        trace_varint(DEST_STATE->LO);
+    }
+    if (flags & TR_MEMORY)
+    {
+        trace_varint(trace_address);
+        trace_varint(trace_word);
+    }
+    if (flags & TR_NEXT)
+        trace_varint(NEXT_PC);
+    if (flags & TR_EXCEPTION)
+        trace_byte(err);
+    trace_flags = 0;
+}